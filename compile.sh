@@ -6,10 +6,12 @@
 echo "Compiling source files..."
 
 # g++ is the compiler command.
-# -std=c++17 tells the compiler to use the C++17 standard.
+# -std=c++20 tells the compiler to use the C++20 standard (needed for the
+# coroutine-based server mode).
+# -pthread links the threading support used by the server mode.
 # -o anuj names the final executable file 'anuj'.
 # We now only need to compile the single MainCode.cpp file.
-g++ -std=c++17 MainCode.cpp -o anuj
+g++ -std=c++20 -pthread MainCode.cpp -o anuj
 
 echo "Compilation complete."
 echo "To run the program, use the command: ./anuj"
\ No newline at end of file
@@ -2,6 +2,35 @@
 #include <string>
 #include <vector>
 #include <ctime>
+#include <chrono>
+#include <cstdio>
+#include <stdexcept>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <condition_variable>
+#include <functional>
+#include <string_view>
+#include <regex>
+#include <memory>
+#include <coroutine>
+#include <cstring>
+#include <cerrno>
+#include <csignal>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+#include <poll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
 
 using namespace std;
 
@@ -21,6 +50,22 @@ void custom_swap(T& a, T& b) {
     b = temp;
 }
 
+/**
+ *  Returns the larger of two values.
+ */
+template<typename T>
+T custom_max(const T& a, const T& b) {
+    return a < b ? b : a;
+}
+
+/**
+ *  Returns the smaller of two values.
+ */
+template<typename T>
+T custom_min(const T& a, const T& b) {
+    return b < a ? b : a;
+}
+
 /**
  *  Reverses a vector in place.
  */
@@ -36,6 +81,27 @@ void custom_reverse(vector<T>& vec) {
     }
 }
 
+/**
+ *  Sorts a vector in ascending order with a bottom-up merge sort.
+ */
+template<typename T>
+void custom_sort(vector<T>& vec) {
+    vector<T> buffer(vec.size());
+    for (size_t width = 1; width < vec.size(); width *= 2) {
+        for (size_t start = 0; start < vec.size(); start += 2 * width) {
+            size_t middle = start + width < vec.size() ? start + width : vec.size();
+            size_t end = middle + width < vec.size() ? middle + width : vec.size();
+            size_t left = start, right = middle, out = start;
+            while (left < middle && right < end) {
+                buffer[out++] = vec[right] < vec[left] ? move(vec[right++]) : move(vec[left++]);
+            }
+            while (left < middle) buffer[out++] = move(vec[left++]);
+            while (right < end) buffer[out++] = move(vec[right++]);
+        }
+        vec.swap(buffer);
+    }
+}
+
 //==============================================================================
 // CUSTOM HASH FUNCTION
 // Purpose: Provides a flexible hashing mechanism for the HashMap by using
@@ -56,6 +122,16 @@ struct custom_hash<int> {
     }
 };
 
+/**
+ *  Hash function specialization for 64-bit integer keys (blob IDs).
+ */
+template<>
+struct custom_hash<long long> {
+    size_t operator()(const long long& key) const {
+        return static_cast<size_t>(key ^ (key >> 32));
+    }
+};
+
 /**
  *  Hash function specialization for string keys.
  * Implements a polynomial rolling hash for effective distribution.
@@ -79,25 +155,133 @@ struct custom_hash<string> {
 // Purpose: Represents a single version of a file in the version history tree.
 //==============================================================================
 
+/**
+ *  Bytes a string holds on the heap: none while its characters fit in the
+ *  string object itself, otherwise its capacity and the terminator.
+ */
+inline long long string_heap_bytes(const string& text) {
+    const char* data = text.data();
+    bool in_place = data >= (const char*)&text && data < (const char*)(&text + 1);
+    return in_place ? 0 : (long long)text.capacity() + 1;
+}
+
+/**
+ *  A 16-byte string for short, rarely changed text such as snapshot
+ *  messages. Up to 15 characters are stored in the object itself; longer
+ *  text gets a heap block of exactly its length. The empty string, which is
+ *  all most versions have, holds nothing. The text is not null-terminated.
+ */
+class CompactString {
+private:
+    static const size_t LOCAL_CAPACITY = 15;
+    static const unsigned char ON_HEAP = 0xFF;
+
+    // The text itself, or a heap pointer and a 32-bit length. The last byte
+    // is the tag: the length of the text in place, or ON_HEAP.
+    alignas(char*) unsigned char bytes[16];
+
+    unsigned char tag() const { return bytes[15]; }
+    bool onHeap() const { return tag() == ON_HEAP; }
+    char* heapData() const {
+        char* data;
+        memcpy(&data, bytes, sizeof(data));
+        return data;
+    }
+    uint32_t heapSize() const {
+        uint32_t size;
+        memcpy(&size, bytes + sizeof(char*), sizeof(size));
+        return size;
+    }
+
+    void release() {
+        if (onHeap()) delete[] heapData();
+        bytes[15] = 0;
+    }
+
+public:
+    CompactString() { bytes[15] = 0; }
+    CompactString(string_view text) : CompactString() { assign(text); }
+    CompactString(const CompactString& other) : CompactString() { assign(other.view()); }
+    CompactString(CompactString&& other) noexcept {
+        memcpy(bytes, other.bytes, sizeof(bytes));
+        other.bytes[15] = 0;
+    }
+    CompactString& operator=(const CompactString& other) {
+        if (this != &other) assign(other.view());
+        return *this;
+    }
+    CompactString& operator=(CompactString&& other) noexcept {
+        if (this != &other) {
+            release();
+            memcpy(bytes, other.bytes, sizeof(bytes));
+            other.bytes[15] = 0;
+        }
+        return *this;
+    }
+    CompactString& operator=(string_view text) {
+        assign(text);
+        return *this;
+    }
+    ~CompactString() { release(); }
+
+    void assign(string_view text) {
+        // `text` may point into this string's own buffer: copy it before
+        // the old buffer is freed.
+        if (text.size() <= LOCAL_CAPACITY) {
+            unsigned char copy[LOCAL_CAPACITY];
+            memcpy(copy, text.data(), text.size());
+            release();
+            memcpy(bytes, copy, text.size());
+            bytes[15] = (unsigned char)text.size();
+            return;
+        }
+        char* data = new char[text.size()];
+        memcpy(data, text.data(), text.size());
+        release();
+        uint32_t size = (uint32_t)text.size();
+        memcpy(bytes, &data, sizeof(data));
+        memcpy(bytes + sizeof(char*), &size, sizeof(size));
+        bytes[15] = ON_HEAP;
+    }
+
+    size_t size() const { return onHeap() ? heapSize() : tag(); }
+    bool empty() const { return size() == 0; }
+    const char* data() const { return onHeap() ? heapData() : (const char*)bytes; }
+    string_view view() const { return string_view(data(), size()); }
+    string str() const { return string(data(), size()); }
+
+    // Bytes of the heap block, if any.
+    long long heapBytes() const { return onHeap() ? (long long)heapSize() : 0; }
+};
+
 struct VersionNode {
     int version_id;             // Unique identifier for this version within the file.
     string content;             // The content of the file at this version.
-    string message;             // The snapshot message, if this version is a snapshot.
+    CompactString message;      // The snapshot message; empty unless this version is a snapshot.
     time_t created_timestamp;   // Timestamp of when this version was created.
     time_t snapshot_timestamp;  // Timestamp of the snapshot; 0 if not a snapshot.
     VersionNode* parent;        // Pointer to the parent version in the tree.
-    vector<VersionNode*> children; // Pointers to child versions (branches).
+    VersionNode* merge_parent;  // Second parent of a MERGE result; nullptr otherwise.
+    long long blob_id;          // Content's blob in the pack store; -1 if not saved.
+    // Child versions (branches) form a list through next_sibling, newest
+    // first, so adding one needs no allocation. A walk that pushes the list
+    // onto a stack visits the oldest child first.
+    VersionNode* first_child;
+    VersionNode* next_sibling;
 
     /**
      *  Constructs a new version node.
      */
-    VersionNode(int id, const string& initial_content, VersionNode* parent_node)
+    VersionNode(int id, string initial_content, VersionNode* parent_node)
         : version_id(id),
-          content(initial_content),
-          parent(parent_node),
+          content(move(initial_content)),
           created_timestamp(time(nullptr)),
-          snapshot_timestamp(0), // Initially not a snapshot.
-          message("") {}
+          snapshot_timestamp(0), // Initially not a snapshot; no message.
+          parent(parent_node),
+          merge_parent(nullptr),
+          blob_id(-1),
+          first_child(nullptr),
+          next_sibling(nullptr) {}
 
     /**
      * Checks if this version is a snapshot.
@@ -106,6 +290,22 @@ struct VersionNode {
     bool isSnapshot() const {
         return snapshot_timestamp != 0;
     }
+
+    /**
+     *  True if the content may be edited in place: a snapshot, or a version
+     *  that others descend from, must keep the content they recorded.
+     */
+    bool isMutable() const {
+        return !isSnapshot() && first_child == nullptr;
+    }
+
+    /**
+     *  Adds a child version in O(1), ahead of the existing ones.
+     */
+    void addChild(VersionNode* child) {
+        child->next_sibling = first_child;
+        first_child = child;
+    }
 };
 
 //==============================================================================
@@ -114,6 +314,32 @@ struct VersionNode {
 //          resolution. Provides O(1) average time complexity for lookups.
 //==============================================================================
 
+/**
+ *  Occupancy and chain-length figures describing the health of a HashMap.
+ *  Probe lengths count how many chain nodes a successful lookup visits.
+ */
+struct HashMapStats {
+    long long entries = 0;        // Number of key-value pairs stored.
+    long long buckets = 0;        // Total number of buckets.
+    long long used_buckets = 0;   // Buckets holding at least one entry.
+    long long max_chain = 0;      // Length of the longest chain.
+    long long probe_total = 0;    // Sum of probe lengths over all entries.
+
+    double loadFactor() const { return buckets == 0 ? 0.0 : (double)entries / buckets; }
+    double avgProbeLength() const { return entries == 0 ? 0.0 : (double)probe_total / entries; }
+
+    /**
+     *  Folds another map's figures into this one (used to aggregate many maps).
+     */
+    void merge(const HashMapStats& other) {
+        entries += other.entries;
+        buckets += other.buckets;
+        used_buckets += other.used_buckets;
+        probe_total += other.probe_total;
+        if (other.max_chain > max_chain) max_chain = other.max_chain;
+    }
+};
+
 template <typename K, typename V>
 class HashMap {
 private:
@@ -136,6 +362,28 @@ private:
         return custom_hash<K>{}(key) % capacity;
     }
 
+    /**
+     *  Moves every entry into a new bucket array of the given size. Nodes are
+     *  relinked rather than reallocated.
+     */
+    void rehash(int new_capacity) {
+        Node** old_table = table;
+        int old_capacity = capacity;
+        table = new Node*[new_capacity]();
+        capacity = new_capacity;
+        for (int i = 0; i < old_capacity; ++i) {
+            Node* entry = old_table[i];
+            while (entry != nullptr) {
+                Node* next = entry->next;
+                int index = hashFunction(entry->key);
+                entry->next = table[index];
+                table[index] = entry;
+                entry = next;
+            }
+        }
+        delete[] old_table;
+    }
+
 public:
     /**
      *  Constructs the HashMap with a given capacity.
@@ -175,6 +423,11 @@ public:
             }
             entry = entry->next;
         }
+        // Keep chains short: grow once the load factor would exceed 0.75.
+        if ((long long)(current_size + 1) * 4 > (long long)capacity * 3) {
+            rehash(capacity * 2);
+            index = hashFunction(key);
+        }
         // If key doesn't exist, create a new node at the front of the list.
         Node* newNode = new Node(key, value);
         newNode->next = table[index];
@@ -211,6 +464,71 @@ public:
         return false;
     }
     
+    /**
+     *  Removes a key if present. Returns true if it was found.
+     */
+    bool remove(K key) {
+        int index = hashFunction(key);
+        Node** link = &table[index];
+        while (*link != nullptr) {
+            if ((*link)->key == key) {
+                Node* doomed = *link;
+                *link = doomed->next;
+                delete doomed;
+                current_size--;
+                return true;
+            }
+            link = &(*link)->next;
+        }
+        return false;
+    }
+
+    /**
+     *  Removes every entry. The bucket array keeps its size.
+     */
+    void clear() {
+        for (int i = 0; i < capacity; ++i) {
+            Node* entry = table[i];
+            while (entry != nullptr) {
+                Node* next = entry->next;
+                delete entry;
+                entry = next;
+            }
+            table[i] = nullptr;
+        }
+        current_size = 0;
+    }
+
+    /**
+     *  Removes every entry and replaces the bucket array with a new one of
+     *  the given size, giving back the memory of a map that had grown.
+     */
+    void reset(int new_capacity) {
+        clear();
+        delete[] table;
+        capacity = new_capacity > 0 ? new_capacity : 16;
+        table = new Node*[capacity]();
+    }
+
+    int size() const { return current_size; }
+
+    /**
+     *  Bytes of the bucket array and the entries. Memory the keys and values
+     *  point to is not included.
+     */
+    long long memoryBytes() const {
+        return (long long)capacity * (long long)sizeof(Node*) + (long long)current_size * (long long)sizeof(Node);
+    }
+
+    /**
+     *  Pre-sizes the bucket array for the expected number of entries, so a
+     *  bulk load does not rehash repeatedly.
+     */
+    void reserve(int expected_entries) {
+        int needed = (int)((long long)expected_entries * 4 / 3 + 1);
+        if (needed > capacity) rehash(needed);
+    }
+
     /**
      *  Returns a vector containing all values in the map.
      */
@@ -225,6 +543,25 @@ public:
         }
         return values;
     }
+
+    /**
+     *  Walks every bucket and reports load factor and chain-length figures.
+     */
+    HashMapStats getStats() const {
+        HashMapStats stats;
+        stats.entries = current_size;
+        stats.buckets = capacity;
+        for (int i = 0; i < capacity; ++i) {
+            long long chain = 0;
+            for (Node* entry = table[i]; entry != nullptr; entry = entry->next) {
+                chain++;
+                stats.probe_total += chain; // The n-th node in a chain needs n probes.
+            }
+            if (chain > 0) stats.used_buckets++;
+            if (chain > stats.max_chain) stats.max_chain = chain;
+        }
+        return stats;
+    }
 };
 
 
@@ -238,7 +575,7 @@ public:
  *  A simple struct to hold file metrics for ranking in the MaxHeap.
  */
 struct FileMetric {
-    string filename;
+    int file_id;
     long long value; // Can represent timestamp or version count.
 
     // Comparison operator needed by the heap to order elements.
@@ -256,14 +593,14 @@ private:
     vector<T> heap;
 
     // Helper functions to get parent and child indices.
-    int parent(int i) { return (i - 1) / 2; }
-    int leftChild(int i) { return 2 * i + 1; }
-    int rightChild(int i) { return 2 * i + 2; }
+    size_t parent(size_t i) { return (i - 1) / 2; }
+    size_t leftChild(size_t i) { return 2 * i + 1; }
+    size_t rightChild(size_t i) { return 2 * i + 2; }
 
     /**
      *  Moves an element up the heap to maintain the heap property.
      */
-    void heapifyUp(int index) {
+    void heapifyUp(size_t index) {
         while (index > 0 && heap[parent(index)] < heap[index]) {
             custom_swap(heap[parent(index)], heap[index]);
             index = parent(index);
@@ -273,11 +610,11 @@ private:
     /**
      *  Moves an element down the heap to maintain the heap property.
      */
-    void heapifyDown(int index) {
-        int maxIndex = index;
+    void heapifyDown(size_t index) {
+        size_t maxIndex = index;
         while (true) {
-            int l = leftChild(index);
-            int r = rightChild(index);
+            size_t l = leftChild(index);
+            size_t r = rightChild(index);
             if (l < heap.size() && heap[maxIndex] < heap[l]) {
                 maxIndex = l;
             }
@@ -315,382 +652,8416 @@ public:
     }
 };
 
-//==============================================================================
-// FILE CLASS
-// Purpose: Manages the version history and metadata for a single file.
-//==============================================================================
-
-class File {
-private:
+/**
+ *  A file's name and metric, as reported by RECENT_FILES and BIGGEST_TREES.
+ */
+struct RankedFile {
     string filename;
-    VersionNode* root;                  // The root of the version history tree.
-    VersionNode* active_version;        // The currently active version (HEAD).
-    HashMap<int, VersionNode*> version_map; // For O(1) lookup of versions by ID.
-    int total_versions;                 // Counter for assigning new version IDs.
-    time_t last_modification_time;      // Timestamp of the last modification.
+    long long value;
+};
 
-    /**
-     *  Recursively deletes the version tree to prevent memory leaks.
-     */
-    void deleteTree(VersionNode* node);
+/**
+ *  A MaxHeap of FileMetric that also knows where each file's entry is, so a
+ *  file's value can be changed or removed in O(log n) as it changes, instead
+ *  of rebuilding the heap.
+ */
+class IndexedMetricHeap {
+private:
+    vector<FileMetric> heap;
+    HashMap<int, int> position; // File ID -> index into heap.
 
-public:
-    File(const string& name);
-    ~File();
+    void place(int index, const FileMetric& metric) {
+        heap[index] = metric;
+        position.put(metric.file_id, index);
+    }
 
-    string read() const;
-    void insert(const string& content);
-    void update(const string& content);
-    void snapshot(const string& message);
-    bool rollback(int versionId = -1);
-    string history() const;
+    void siftUp(int index) {
+        FileMetric moving = heap[index];
+        while (index > 0 && heap[(index - 1) / 2] < moving) {
+            place(index, heap[(index - 1) / 2]);
+            index = (index - 1) / 2;
+        }
+        place(index, moving);
+    }
 
-    // Accessors for file metadata.
-    string getName() const;
-    int getVersionCount() const;
-    time_t getLastModificationTime() const;
-};
+    void siftDown(int index) {
+        FileMetric moving = heap[index];
+        int count = (int)heap.size();
+        while (true) {
+            int larger = 2 * index + 1;
+            if (larger >= count) break;
+            if (larger + 1 < count && heap[larger] < heap[larger + 1]) larger++;
+            if (!(moving < heap[larger])) break;
+            place(index, heap[larger]);
+            index = larger;
+        }
+        place(index, moving);
+    }
 
-//==============================================================================
-// FILE SYSTEM CLASS
-// Purpose: Acts as the main controller for the version control system,
-//          managing all files and providing the user-facing interface.
-//==============================================================================
+public:
+    IndexedMetricHeap() : position(256) {}
 
-class FileSystem {
-private:
-    HashMap<string, File*> files;          // Maps filenames to File objects.
-    MaxHeap<FileMetric> recent_files_heap;  // Heap for tracking recently modified files.
-    MaxHeap<FileMetric> biggest_trees_heap; // Heap for tracking files with the most versions.
+    int size() const { return (int)heap.size(); }
 
     /**
-     *  Rebuilds the analytics heaps. Called after any modification.
-     * NOTE: This is inefficient for large systems but simple for this project.
+     *  Inserts a file's value, or moves its entry if it already has one.
      */
-    void updateAnalytics();
-
-public:
-    FileSystem();
-    ~FileSystem();
+    void set(int file_id, long long value) {
+        if (!position.containsKey(file_id)) {
+            heap.push_back({file_id, value});
+            siftUp((int)heap.size() - 1);
+            return;
+        }
+        int index = position.get(file_id);
+        long long old_value = heap[index].value;
+        heap[index].value = value;
+        if (old_value < value) siftUp(index);
+        else siftDown(index);
+    }
 
-    // Core file operations.
-    void create(const string& filename);
-    string read(const string& filename);
-    void insert(const string& filename, const string& content);
-    void update(const string& filename, const string& content);
-    void snapshot(const string& filename, const string& message);
-    void rollback(const string& filename, int versionId = -1);
-    string history(const string& filename);
+    void remove(int file_id) {
+        if (!position.containsKey(file_id)) return;
+        int index = position.get(file_id);
+        position.remove(file_id);
+        FileMetric last = heap.back();
+        heap.pop_back();
+        if (index == (int)heap.size()) return;
+        place(index, last);
+        siftUp(index);
+        siftDown(position.get(last.file_id));
+    }
 
-    // System-wide analytics.
-    string recentFiles(int num);
-    string biggestTrees(int num);
+    /**
+     *  Appends the `k` largest entries in descending order, in O(k log k):
+     *  a second heap holds the frontier of heap positions still to visit.
+     */
+    void top(int k, vector<FileMetric>& out) const {
+        if (heap.empty() || k <= 0) return;
+        struct Candidate {
+            long long value;
+            int index;
+            bool operator<(const Candidate& other) const { return value < other.value; }
+        };
+        MaxHeap<Candidate> frontier;
+        frontier.insert({heap[0].value, 0});
+        while ((int)out.size() < k && !frontier.isEmpty()) {
+            Candidate next = frontier.extractMax();
+            out.push_back(heap[next.index]);
+            for (int child = 2 * next.index + 1; child <= 2 * next.index + 2; ++child) {
+                if (child < (int)heap.size()) frontier.insert({heap[child].value, child});
+            }
+        }
+    }
 };
 
 //==============================================================================
-// METHOD IMPLEMENTATIONS: File
+// LATENCY HISTOGRAM & SYSTEM STATISTICS
+// Purpose: Lets the FileSystem measure itself. Every command records its
+//          latency into an HDR-style histogram, and a few counters track how
+//          much data and how many versions have been written.
 //==============================================================================
 
-File::File(const string& name) : filename(name), version_map(16) {
-    total_versions = 1;
-    root = new VersionNode(0, "", nullptr);
-    active_version = root;
-    // The root version is always an initial snapshot.
-    root->message = "Initial version";
-    root->snapshot_timestamp = time(nullptr);
-    last_modification_time = root->snapshot_timestamp;
-    version_map.put(0, root);
+/**
+ *  Formats a floating point value with a fixed number of decimals.
+ */
+string format_fixed(double value, int decimals) {
+    char buf[64];
+    snprintf(buf, sizeof(buf), "%.*f", decimals, value);
+    return string(buf);
 }
 
-File::~File() {
-    deleteTree(root);
-}
+/**
+ *  A log-linear latency histogram in the spirit of HdrHistogram.
+ *  Values below SUB_BUCKETS are counted exactly. Larger values are grouped by
+ *  their highest set bit, and each power-of-two range is split into
+ *  SUB_BUCKETS equal slices, so every bucket has a relative error of at most
+ *  1/SUB_BUCKETS (about 6%) while the whole range of 64-bit values fits in a
+ *  fixed array.
+ */
+class LatencyHistogram {
+private:
+    static const int SUB_BUCKET_BITS = 4;
+    static const int SUB_BUCKETS = 1 << SUB_BUCKET_BITS;
+    static const int BUCKET_COUNT = SUB_BUCKETS + (64 - SUB_BUCKET_BITS) * SUB_BUCKETS;
 
-void File::deleteTree(VersionNode* node) {
-    if (node == nullptr) return;
-    for (VersionNode* child : node->children) {
-        deleteTree(child);
-    }
-    delete node;
-}
+    long long counts[BUCKET_COUNT];
+    long long total_count;
+    long long total_sum;
+    long long min_value;
+    long long max_value;
 
-string File::read() const {
-    return active_version->content;
-}
+    /**
+     *  Maps a value to its bucket index.
+     */
+    static int bucketIndex(long long value) {
+        if (value < SUB_BUCKETS) return (int)value;
+        int msb = 63 - __builtin_clzll((unsigned long long)value);
+        int shift = msb - SUB_BUCKET_BITS;
+        int sub = (int)(value >> shift) - SUB_BUCKETS;
+        return SUB_BUCKETS + shift * SUB_BUCKETS + sub;
+    }
 
-void File::insert(const string& content_to_add) {
-    // Core versioning logic: if the current version is a snapshot, create a new
-    // child version. Otherwise, modify the current (mutable) version in place.
-    if (active_version->isSnapshot()) {
-        string new_content = active_version->content + content_to_add;
-        VersionNode* new_version = new VersionNode(total_versions, new_content, active_version);
-        active_version->children.push_back(new_version);
-        active_version = new_version;
-        version_map.put(total_versions, new_version);
-        total_versions++;
-    } else {
-        active_version->content += content_to_add;
+    /**
+     *  Returns the largest value that falls into the given bucket.
+     */
+    static long long bucketUpperBound(int index) {
+        if (index < SUB_BUCKETS) return index;
+        int shift = (index - SUB_BUCKETS) / SUB_BUCKETS;
+        int sub = (index - SUB_BUCKETS) % SUB_BUCKETS;
+        return (((long long)(sub + SUB_BUCKETS + 1)) << shift) - 1;
     }
-    last_modification_time = time(nullptr);
-}
 
-void File::update(const string& new_content) {
-    // Versioning logic is identical to insert().
-    if (active_version->isSnapshot()) {
-        VersionNode* new_version = new VersionNode(total_versions, new_content, active_version);
-        active_version->children.push_back(new_version);
-        active_version = new_version;
-        version_map.put(total_versions, new_version);
-        total_versions++;
-    } else {
-        active_version->content = new_content;
+public:
+    LatencyHistogram() { reset(); }
+
+    void reset() {
+        for (int i = 0; i < BUCKET_COUNT; ++i) counts[i] = 0;
+        total_count = 0;
+        total_sum = 0;
+        min_value = 0;
+        max_value = 0;
     }
-    last_modification_time = time(nullptr);
-}
 
-void File::snapshot(const string& message) {
-    // Prevent creating a snapshot of an already snapshotted version.
-    if (active_version->isSnapshot()) {
-        cout << "Error: A snapshot already exists for the current version. "
-                  << "Modify the file to create a new version before snapshotting.\n";
-        return;
+    /**
+     *  Records a single measurement (in nanoseconds).
+     */
+    void record(long long value) {
+        if (value < 0) value = 0;
+        counts[bucketIndex(value)]++;
+        if (total_count == 0 || value < min_value) min_value = value;
+        if (value > max_value) max_value = value;
+        total_count++;
+        total_sum += value;
     }
-    active_version->message = message;
-    active_version->snapshot_timestamp = time(nullptr);
-    last_modification_time = time(nullptr); // Snapshotting counts as a modification.
-    cout << "Snapshot created for '" << filename << "'.\n";
-}
 
-bool File::rollback(int versionId) {
-    // Case 1: Rollback to parent version.
-    if (versionId == -1) {
-        if (active_version->parent != nullptr) {
-            active_version = active_version->parent;
-            return true;
-        }
-        return false; // Already at the root, cannot go back further.
-    // Case 2: Rollback to a specific version ID.
-    } else {
-        // Prevent a pointless rollback to the already active version.
-        if (versionId == active_version->version_id) {
-            cout << "Error: Cannot rollback to the version that is already active.\n";
-            return false;
-        }
+    long long count() const { return total_count; }
+    long long min() const { return min_value; }
+    long long max() const { return max_value; }
+    double mean() const { return total_count == 0 ? 0.0 : (double)total_sum / total_count; }
 
-        try {
-            // Use the hash map for a fast O(1) lookup.
-            VersionNode* target_version = version_map.get(versionId);
-            active_version = target_version;
-            return true;
-        } catch (const runtime_error& e) {
-            return false; // Version ID not found in the map.
-        }
+    /**
+     *  Adds every measurement of another histogram to this one.
+     */
+    void merge(const LatencyHistogram& other) {
+        if (other.total_count == 0) return;
+        for (int i = 0; i < BUCKET_COUNT; ++i) counts[i] += other.counts[i];
+        if (total_count == 0 || other.min_value < min_value) min_value = other.min_value;
+        if (other.max_value > max_value) max_value = other.max_value;
+        total_count += other.total_count;
+        total_sum += other.total_sum;
     }
-}
 
-string File::history() const {
-    string result = "";
+    /**
+     *  Returns the value at the given percentile (0-100), reported as the
+     *  upper bound of the bucket that contains it.
+     */
+    long long percentile(double p) const {
+        if (total_count == 0) return 0;
+        long long rank = (long long)(p / 100.0 * total_count + 0.5);
+        if (rank < 1) rank = 1;
+        long long seen = 0;
+        for (int i = 0; i < BUCKET_COUNT; ++i) {
+            seen += counts[i];
+            if (seen >= rank) {
+                long long bound = bucketUpperBound(i);
+                return bound > max_value ? max_value : bound;
+            }
+        }
+        return max_value;
+    }
+};
+
+/**
+ *  The command types whose latency is tracked individually.
+ */
+enum CommandType {
+    CMD_CREATE,
+    CMD_READ,
+    CMD_INSERT,
+    CMD_UPDATE,
+    CMD_SNAPSHOT,
+    CMD_ROLLBACK,
+    CMD_HISTORY,
+    CMD_RECENT_FILES,
+    CMD_BIGGEST_TREES,
+    CMD_IMPORT,
+    CMD_EXPORT,
+    CMD_READ_AT,
+    CMD_ROLLBACK_AT,
+    CMD_SNAPSHOT_ALL,
+    CMD_ROLLBACK_ALL,
+    CMD_DIFF,
+    CMD_MERGE,
+    CMD_GREP,
+    CMD_BLAME,
+    CMD_SAVE,
+    CMD_LS,
+    CMD_DELETE,
+    CMD_LIST,
+    CMD_RENAME,
+    CMD_TYPE_COUNT
+};
+
+const char* const COMMAND_NAMES[CMD_TYPE_COUNT] = {
+    "CREATE", "READ", "INSERT", "UPDATE", "SNAPSHOT",
+    "ROLLBACK", "HISTORY", "RECENT_FILES", "BIGGEST_TREES", "IMPORT",
+    "EXPORT", "READ_AT", "ROLLBACK_AT", "SNAPSHOT_ALL", "ROLLBACK_ALL",
+    "DIFF", "MERGE", "GREP", "BLAME", "SAVE",
+    "LS", "DELETE", "LIST", "RENAME"
+};
+
+/**
+ *  Everything the FileSystem knows about its own behaviour.
+ */
+struct SystemStats {
+    LatencyHistogram command_latency[CMD_TYPE_COUNT];
+    long long bytes_stored = 0;      // Content bytes accepted by INSERT and UPDATE.
+    long long versions_created = 0;  // Version nodes created across all files.
+};
+
+/**
+ *  RAII timer that records the lifetime of a scope into a histogram.
+ */
+class ScopedLatency {
+private:
+    LatencyHistogram& histogram;
+    chrono::steady_clock::time_point start;
+
+public:
+    ScopedLatency(LatencyHistogram& target)
+        : histogram(target), start(chrono::steady_clock::now()) {}
+
+    ~ScopedLatency() {
+        auto elapsed = chrono::steady_clock::now() - start;
+        histogram.record(chrono::duration_cast<chrono::nanoseconds>(elapsed).count());
+    }
+};
+
+//==============================================================================
+// SCOPED TRACING
+// Purpose: Lightweight RAII spans recorded into per-thread ring buffers and
+//          exported in the Chrome trace-event JSON format (chrome://tracing,
+//          Perfetto), so the time spent inside each operation can be seen on a
+//          timeline.
+//==============================================================================
+
+/**
+ *  Escapes a string for embedding inside a JSON string literal.
+ */
+string json_escape(const string& text) {
+    string result = "";
+    for (char c : text) {
+        switch (c) {
+            case '"':  result += "\\\""; break;
+            case '\\': result += "\\\\"; break;
+            case '\n': result += "\\n"; break;
+            case '\r': result += "\\r"; break;
+            case '\t': result += "\\t"; break;
+            default:
+                if ((unsigned char)c < 0x20) {
+                    char buf[8];
+                    snprintf(buf, sizeof(buf), "\\u%04x", (unsigned char)c);
+                    result += buf;
+                } else {
+                    result += c;
+                }
+        }
+    }
+    return result;
+}
+
+/**
+ *  One completed span. Names are string literals, so no copies are made.
+ */
+struct TraceEvent {
+    const char* name;
+    long long start_ns;     // Start time relative to the tracer's epoch.
+    long long duration_ns;
+};
+
+/**
+ *  A fixed-capacity ring buffer of spans owned by a single thread. Once full,
+ *  the oldest spans are overwritten. The lock is only contended while a dump
+ *  is in progress.
+ */
+class TraceRing {
+private:
+    vector<TraceEvent> events;
+    size_t next;        // Slot that the next span is written to.
+    bool wrapped;       // True once the ring has overwritten old spans.
+    mutex ring_lock;
+
+public:
+    const int thread_id;
+
+    TraceRing(int tid, size_t capacity) : events(capacity), next(0), wrapped(false), thread_id(tid) {}
+
+    void push(const TraceEvent& event) {
+        lock_guard<mutex> guard(ring_lock);
+        events[next] = event;
+        next++;
+        if (next == events.size()) {
+            next = 0;
+            wrapped = true;
+        }
+    }
+
+    /**
+     *  Copies the spans out in recording order (oldest first).
+     */
+    vector<TraceEvent> snapshot() {
+        lock_guard<mutex> guard(ring_lock);
+        vector<TraceEvent> result;
+        if (wrapped) {
+            for (size_t i = next; i < events.size(); ++i) result.push_back(events[i]);
+        }
+        for (size_t i = 0; i < next; ++i) result.push_back(events[i]);
+        return result;
+    }
+
+    void clear() {
+        lock_guard<mutex> guard(ring_lock);
+        next = 0;
+        wrapped = false;
+    }
+};
+
+/**
+ *  Process-wide registry of per-thread rings. A ring goes back on the free
+ *  list when its thread exits and is handed to the next new thread, keeping
+ *  the spans it holds until they are overwritten, so a server that starts a
+ *  thread per connection needs at most MAX_RINGS of them.
+ */
+class Tracer {
+private:
+    static const size_t RING_CAPACITY = 8192;
+    static const size_t MAX_RINGS = 64; // Threads beyond this record nothing.
+
+    /**
+     *  Returns the thread's ring to the free list when the thread exits.
+     */
+    struct RingOwner {
+        TraceRing* ring = nullptr;
+        ~RingOwner() {
+            if (ring != nullptr) Tracer::instance().releaseRing(ring);
+        }
+    };
+
+    mutex registry_lock;
+    vector<TraceRing*> rings;
+    vector<TraceRing*> free_rings;
+    atomic<bool> enabled;
+    chrono::steady_clock::time_point epoch;
+
+    Tracer() : enabled(true), epoch(chrono::steady_clock::now()) {}
+
+public:
+    ~Tracer() {
+        for (TraceRing* ring : rings) delete ring;
+    }
+
+    static Tracer& instance() {
+        static Tracer tracer;
+        return tracer;
+    }
+
+    bool isEnabled() const { return enabled.load(memory_order_relaxed); }
+    void setEnabled(bool on) { enabled.store(on, memory_order_relaxed); }
+
+    long long nowNs() const {
+        return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - epoch).count();
+    }
+
+    /**
+     *  Returns the calling thread's ring, taking a free or new one on first
+     *  use, or nullptr if every ring is taken.
+     */
+    TraceRing* localRing() {
+        thread_local RingOwner owner;
+        if (owner.ring == nullptr) {
+            lock_guard<mutex> guard(registry_lock);
+            if (!free_rings.empty()) {
+                owner.ring = free_rings.back();
+                free_rings.pop_back();
+            } else if (rings.size() < MAX_RINGS) {
+                owner.ring = new TraceRing((int)rings.size() + 1, RING_CAPACITY);
+                rings.push_back(owner.ring);
+            }
+        }
+        return owner.ring;
+    }
+
+    void releaseRing(TraceRing* ring) {
+        lock_guard<mutex> guard(registry_lock);
+        free_rings.push_back(ring);
+    }
+
+    void clear() {
+        lock_guard<mutex> guard(registry_lock);
+        for (TraceRing* ring : rings) ring->clear();
+    }
+
+    /**
+     *  Serializes every recorded span as Chrome trace-event JSON. Spans are
+     *  emitted as complete ("X") events with microsecond timestamps.
+     */
+    string exportChromeJson() {
+        lock_guard<mutex> guard(registry_lock);
+        string result = "{\"traceEvents\":[";
+        bool first = true;
+        for (TraceRing* ring : rings) {
+            for (const TraceEvent& e : ring->snapshot()) {
+                if (!first) result += ",";
+                first = false;
+                result += "{\"name\":\"" + json_escape(e.name) + "\",\"cat\":\"anuj\",\"ph\":\"X\""
+                          + ",\"ts\":" + format_fixed(e.start_ns / 1000.0, 3)
+                          + ",\"dur\":" + format_fixed(e.duration_ns / 1000.0, 3)
+                          + ",\"pid\":1,\"tid\":" + to_string(ring->thread_id) + "}";
+            }
+        }
+        result += "],\"displayTimeUnit\":\"ns\"}\n";
+        return result;
+    }
+};
+
+/**
+ *  RAII span: measures the enclosing scope and pushes it to the thread's ring.
+ */
+class TraceSpan {
+private:
+    const char* name;
+    long long start_ns;
+
+public:
+    TraceSpan(const char* span_name) : name(span_name), start_ns(-1) {
+        if (Tracer::instance().isEnabled()) start_ns = Tracer::instance().nowNs();
+    }
+
+    ~TraceSpan() {
+        if (start_ns < 0) return;
+        Tracer& tracer = Tracer::instance();
+        TraceRing* ring = tracer.localRing();
+        if (ring != nullptr) ring->push({name, start_ns, tracer.nowNs() - start_ns});
+    }
+};
+
+//==============================================================================
+// TIME INDEX
+// Purpose: A per-file sorted array of (timestamp, version ID) pairs, appended
+//          as versions are created, so "which version existed at time T" is a
+//          binary search instead of a scan over every version.
+//==============================================================================
+
+struct TimeIndexEntry {
+    time_t timestamp;
+    int version_id;
+};
+
+class TimeIndex {
+private:
+    vector<TimeIndexEntry> entries; // Sorted by timestamp (non-decreasing).
+
+public:
+    /**
+     *  Records a new version. If the clock stepped backwards, the entry is
+     *  clamped to the previous timestamp so the array stays sorted.
+     */
+    void append(time_t timestamp, int version_id) {
+        if (!entries.empty() && timestamp < entries.back().timestamp) {
+            timestamp = entries.back().timestamp;
+        }
+        entries.push_back({timestamp, version_id});
+    }
+
+    /**
+     *  Returns the ID of the last version recorded at or before `when`, or -1
+     *  if none was. O(log n).
+     */
+    int lookup(time_t when) const {
+        size_t low = 0;
+        size_t high = entries.size(); // Search for the first entry after `when`.
+        while (low < high) {
+            size_t mid = low + (high - low) / 2;
+            if (entries[mid].timestamp <= when) low = mid + 1;
+            else high = mid;
+        }
+        return low == 0 ? -1 : entries[low - 1].version_id;
+    }
+
+    /**
+     *  Drops every entry whose version ID matches `doomed`, keeping order.
+     */
+    template<typename Predicate>
+    void removeIf(Predicate doomed) {
+        size_t keep = 0;
+        for (size_t i = 0; i < entries.size(); ++i) {
+            if (!doomed(entries[i].version_id)) entries[keep++] = entries[i];
+        }
+        entries.resize(keep);
+    }
+
+    void clear() { entries.clear(); }
+
+    // Frees the unused capacity of the array.
+    void shrink() { entries.shrink_to_fit(); }
+
+    size_t size() const { return entries.size(); }
+    long long memoryBytes() const { return (long long)(entries.capacity() * sizeof(TimeIndexEntry)); }
+};
+
+//==============================================================================
+// DIFF ENGINE
+// Purpose: Line-level differences and three-way merges. Common leading and
+//          trailing lines are trimmed with plain memory comparisons (which is
+//          all an append-only edit needs), the rest is interned to integer IDs
+//          with a word-at-a-time hash, and Myers' linear-space O(ND) algorithm
+//          finds a shortest edit script on the IDs.
+//==============================================================================
+
+enum EditKind { EDIT_EQUAL, EDIT_DELETE, EDIT_INSERT };
+
+/**
+ *  A run of consecutive lines with the same edit kind. EQUAL runs use both
+ *  starts, DELETE runs use a_start and INSERT runs use b_start.
+ */
+struct EditRun {
+    EditKind kind;
+    int a_start;
+    int b_start;
+    int length;
+};
+
+/**
+ *  Appends a run to an edit script, extending the last run when it continues
+ *  it.
+ */
+void append_edit(vector<EditRun>& runs, EditKind kind, int a_start, int b_start, int length) {
+    if (length <= 0) return;
+    if (!runs.empty()) {
+        EditRun& last = runs.back();
+        if (last.kind == kind && last.a_start + (kind == EDIT_INSERT ? 0 : last.length) == a_start
+            && last.b_start + (kind == EDIT_DELETE ? 0 : last.length) == b_start) {
+            last.length += length;
+            return;
+        }
+    }
+    runs.push_back({kind, a_start, b_start, length});
+}
+
+/**
+ *  Splits text into lines. Each view includes its terminating newline, so a
+ *  final line without one compares unequal to the same text with one.
+ */
+vector<string_view> split_lines(const string& text) {
+    vector<string_view> lines;
+    const char* data = text.data();
+    size_t pos = 0;
+    while (pos < text.size()) {
+        const void* newline = memchr(data + pos, '\n', text.size() - pos);
+        size_t end = newline ? (size_t)((const char*)newline - data) + 1 : text.size();
+        lines.emplace_back(data + pos, end - pos);
+        pos = end;
+    }
+    return lines;
+}
+
+/**
+ *  Hashes a line eight bytes at a time (SWAR). Only used to bucket lines;
+ *  equality is always confirmed by comparing bytes.
+ */
+uint64_t hash_line(string_view line) {
+    const uint64_t MULTIPLIER = 0x9E3779B97F4A7C15ULL;
+    uint64_t hash = line.size() * MULTIPLIER;
+    size_t i = 0;
+    for (; i + 8 <= line.size(); i += 8) {
+        uint64_t word;
+        memcpy(&word, line.data() + i, 8);
+        hash = (hash ^ word) * MULTIPLIER;
+        hash ^= hash >> 29;
+    }
+    uint64_t tail = 0;
+    memcpy(&tail, line.data() + i, line.size() - i);
+    hash = (hash ^ tail) * MULTIPLIER;
+    return hash ^ (hash >> 32);
+}
+
+/**
+ *  Assigns the same small integer to equal lines of both inputs, so the Myers
+ *  search compares integers instead of strings.
+ */
+void intern_lines(const vector<string_view>& a, int a_lo, int a_hi,
+                  const vector<string_view>& b, int b_lo, int b_hi,
+                  vector<int>& a_ids, vector<int>& b_ids) {
+    size_t total = (size_t)(a_hi - a_lo) + (b_hi - b_lo);
+    size_t capacity = 16;
+    while (capacity < total * 2) capacity *= 2;
+    vector<int> slots(capacity, -1);   // Open addressing: slot -> distinct line index.
+    vector<string_view> distinct;
+    vector<uint64_t> distinct_hash;
+
+    auto intern = [&](string_view line) {
+        uint64_t hash = hash_line(line);
+        size_t slot = hash & (capacity - 1);
+        while (slots[slot] != -1) {
+            int id = slots[slot];
+            if (distinct_hash[id] == hash && distinct[id] == line) return id;
+            slot = (slot + 1) & (capacity - 1);
+        }
+        int id = (int)distinct.size();
+        slots[slot] = id;
+        distinct.push_back(line);
+        distinct_hash.push_back(hash);
+        return id;
+    };
+    a_ids.clear();
+    b_ids.clear();
+    for (int i = a_lo; i < a_hi; ++i) a_ids.push_back(intern(a[i]));
+    for (int i = b_lo; i < b_hi; ++i) b_ids.push_back(intern(b[i]));
+}
+
+/**
+ *  Linear-space Myers diff over interned line IDs.
+ */
+class MyersDiff {
+private:
+    const vector<int>& a;
+    const vector<int>& b;
+    vector<int> forward;   // Furthest x per diagonal, searching from the start.
+    vector<int> backward;  // Furthest x per diagonal, searching from the end.
+    vector<EditRun>& out;
+    int a_base;            // Offsets of the interned ranges in the full inputs.
+    int b_base;
+
+    void emit(EditKind kind, int a_start, int b_start, int length) {
+        append_edit(out, kind, a_start, b_start, length);
+    }
+
+    /**
+     *  Finds the middle snake of a[a_lo..a_hi) x b[b_lo..b_hi). Returns the
+     *  snake's start (x, y) and end (u, v) in absolute coordinates.
+     */
+    void middleSnake(int a_lo, int a_hi, int b_lo, int b_hi, int& x_out, int& y_out, int& u_out, int& v_out) {
+        int n = a_hi - a_lo;
+        int m = b_hi - b_lo;
+        int delta = n - m;
+        bool odd = (delta & 1) != 0;
+        int max_d = (n + m + 1) / 2;
+        int offset = max_d + 1;
+        forward[offset + 1] = 0;
+        backward[offset + 1] = 0;
+        for (int d = 0; d <= max_d; ++d) {
+            for (int k = -d; k <= d; k += 2) {
+                int x = (k == -d || (k != d && forward[offset + k - 1] < forward[offset + k + 1]))
+                        ? forward[offset + k + 1] : forward[offset + k - 1] + 1;
+                int y = x - k;
+                int start_x = x, start_y = y;
+                while (x < n && y < m && a[a_lo + x - a_base] == b[b_lo + y - b_base]) { x++; y++; }
+                forward[offset + k] = x;
+                int back_k = delta - k;
+                if (odd && back_k >= -(d - 1) && back_k <= d - 1 && x + backward[offset + back_k] >= n) {
+                    x_out = a_lo + start_x; y_out = b_lo + start_y;
+                    u_out = a_lo + x; v_out = b_lo + y;
+                    return;
+                }
+            }
+            for (int k = -d; k <= d; k += 2) {
+                int x = (k == -d || (k != d && backward[offset + k - 1] < backward[offset + k + 1]))
+                        ? backward[offset + k + 1] : backward[offset + k - 1] + 1;
+                int y = x - k;
+                int start_x = x, start_y = y;
+                while (x < n && y < m && a[a_hi - x - 1 - a_base] == b[b_hi - y - 1 - b_base]) { x++; y++; }
+                backward[offset + k] = x;
+                int fwd_k = delta - k;
+                if (!odd && fwd_k >= -d && fwd_k <= d && x + forward[offset + fwd_k] >= n) {
+                    x_out = a_hi - x; y_out = b_hi - y;
+                    u_out = a_hi - start_x; v_out = b_hi - start_y;
+                    return;
+                }
+            }
+        }
+        // Unreachable: a path of length n + m always exists.
+        x_out = u_out = a_lo;
+        y_out = v_out = b_lo;
+    }
+
+    void diffRange(int a_lo, int a_hi, int b_lo, int b_hi) {
+        // Trim common prefix and suffix.
+        int prefix = 0;
+        while (a_lo + prefix < a_hi && b_lo + prefix < b_hi
+               && a[a_lo + prefix - a_base] == b[b_lo + prefix - b_base]) prefix++;
+        emit(EDIT_EQUAL, a_lo, b_lo, prefix);
+        a_lo += prefix;
+        b_lo += prefix;
+        int suffix = 0;
+        while (a_hi - suffix > a_lo && b_hi - suffix > b_lo
+               && a[a_hi - suffix - 1 - a_base] == b[b_hi - suffix - 1 - b_base]) suffix++;
+        int a_end = a_hi - suffix;
+        int b_end = b_hi - suffix;
+
+        if (a_lo == a_end) {
+            emit(EDIT_INSERT, a_lo, b_lo, b_end - b_lo);
+        } else if (b_lo == b_end) {
+            emit(EDIT_DELETE, a_lo, b_lo, a_end - a_lo);
+        } else {
+            int x, y, u, v;
+            middleSnake(a_lo, a_end, b_lo, b_end, x, y, u, v);
+            diffRange(a_lo, x, b_lo, y);
+            emit(EDIT_EQUAL, x, y, u - x);
+            diffRange(u, a_end, v, b_end);
+        }
+        emit(EDIT_EQUAL, a_end, b_end, suffix);
+    }
+
+public:
+    MyersDiff(const vector<int>& a_ids, const vector<int>& b_ids, int a_offset, int b_offset, vector<EditRun>& result)
+        : a(a_ids), b(b_ids), out(result), a_base(a_offset), b_base(b_offset) {
+        size_t size = a_ids.size() + b_ids.size() + 3;
+        forward.assign(size, 0);
+        backward.assign(size, 0);
+    }
+
+    void run() { diffRange(a_base, a_base + (int)a.size(), b_base, b_base + (int)b.size()); }
+};
+
+/**
+ *  Computes the edit script turning lines `a` into lines `b`.
+ */
+vector<EditRun> diff_lines(const vector<string_view>& a, const vector<string_view>& b) {
+    vector<EditRun> runs;
+    int n = (int)a.size();
+    int m = (int)b.size();
+    // Shared leading and trailing lines are compared as bytes only, which makes
+    // the common append-only history cost one pass of memcmp.
+    int prefix = 0;
+    while (prefix < n && prefix < m && a[prefix] == b[prefix]) prefix++;
+    int suffix = 0;
+    while (suffix < n - prefix && suffix < m - prefix && a[n - suffix - 1] == b[m - suffix - 1]) suffix++;
+    if (prefix > 0) runs.push_back({EDIT_EQUAL, 0, 0, prefix});
+
+    if (prefix + suffix < n || prefix + suffix < m) {
+        vector<int> a_ids, b_ids;
+        intern_lines(a, prefix, n - suffix, b, prefix, m - suffix, a_ids, b_ids);
+
+        // A line that occurs on only one side can never be matched, so it is
+        // left out of the search and re-inserted afterwards. This does not
+        // change the result, and turns a rewrite of unique lines into O(n).
+        int distinct = 0;
+        for (int id : a_ids) distinct = custom_max(distinct, id + 1);
+        for (int id : b_ids) distinct = custom_max(distinct, id + 1);
+        vector<char> in_a(distinct, 0), in_b(distinct, 0);
+        for (int id : a_ids) in_a[id] = 1;
+        for (int id : b_ids) in_b[id] = 1;
+        vector<int> a_keep, b_keep;          // Indices into a_ids / b_ids.
+        vector<int> a_kept_ids, b_kept_ids;
+        for (int i = 0; i < (int)a_ids.size(); ++i) {
+            if (in_b[a_ids[i]]) { a_keep.push_back(i); a_kept_ids.push_back(a_ids[i]); }
+        }
+        for (int i = 0; i < (int)b_ids.size(); ++i) {
+            if (in_a[b_ids[i]]) { b_keep.push_back(i); b_kept_ids.push_back(b_ids[i]); }
+        }
+        vector<EditRun> kept_runs;
+        MyersDiff myers(a_kept_ids, b_kept_ids, 0, 0, kept_runs);
+        myers.run();
+
+        // Map the script back, emitting discarded lines just before the next
+        // kept line on their side.
+        int next_a = 0, next_b = 0;
+        auto flush_to = [&](int a_end, int b_end) {
+            append_edit(runs, EDIT_DELETE, prefix + next_a, prefix + next_b, a_end - next_a);
+            next_a = custom_max(next_a, a_end);
+            append_edit(runs, EDIT_INSERT, prefix + next_a, prefix + next_b, b_end - next_b);
+            next_b = custom_max(next_b, b_end);
+        };
+        for (const EditRun& run : kept_runs) {
+            for (int k = 0; k < run.length; ++k) {
+                if (run.kind == EDIT_EQUAL) {
+                    int ai = a_keep[run.a_start + k], bi = b_keep[run.b_start + k];
+                    flush_to(ai, bi);
+                    append_edit(runs, EDIT_EQUAL, prefix + ai, prefix + bi, 1);
+                    next_a = ai + 1;
+                    next_b = bi + 1;
+                } else if (run.kind == EDIT_DELETE) {
+                    flush_to(a_keep[run.a_start + k] + 1, next_b);
+                } else {
+                    flush_to(next_a, b_keep[run.b_start + k] + 1);
+                }
+            }
+        }
+        flush_to((int)a_ids.size(), (int)b_ids.size());
+    }
+    append_edit(runs, EDIT_EQUAL, n - suffix, m - suffix, suffix);
+    return runs;
+}
+
+/**
+ *  Formats an edit script as a unified diff with `context` lines of context.
+ */
+string unified_diff(const vector<string_view>& a, const vector<string_view>& b, const vector<EditRun>& runs,
+                    const string& a_label, const string& b_label, int context) {
+    // Flatten runs to one entry per line: kind plus the line in a or b.
+    struct LineEdit { EditKind kind; int a_line; int b_line; };
+    vector<LineEdit> edits;
+    for (const EditRun& run : runs) {
+        for (int i = 0; i < run.length; ++i) {
+            edits.push_back({run.kind, run.a_start + (run.kind == EDIT_INSERT ? 0 : i),
+                             run.b_start + (run.kind == EDIT_DELETE ? 0 : i)});
+        }
+    }
+    auto append_line = [](string& out, char prefix, string_view line) {
+        out += prefix;
+        out.append(line.data(), line.size());
+        if (line.empty() || line.back() != '\n') out += "\n\\ No newline at end of file\n";
+    };
+
+    string result = "--- " + a_label + "\n+++ " + b_label + "\n";
+    size_t i = 0;
+    while (i < edits.size()) {
+        if (edits[i].kind == EDIT_EQUAL) { i++; continue; }
+        // A hunk starts `context` lines before the change and extends while
+        // changes are separated by at most 2 * context equal lines.
+        size_t start = i >= (size_t)context ? i - context : 0;
+        size_t end = i;
+        size_t last_change = i;
+        while (end < edits.size()) {
+            if (edits[end].kind != EDIT_EQUAL) last_change = end;
+            else if (end - last_change > (size_t)(2 * context)) break;
+            end++;
+        }
+        end = last_change + 1 + context < edits.size() ? last_change + 1 + context : edits.size();
+
+        // Hunk header: 1-based start lines and counts on each side.
+        int a_count = 0, b_count = 0;
+        for (size_t j = start; j < end; ++j) {
+            if (edits[j].kind != EDIT_INSERT) a_count++;
+            if (edits[j].kind != EDIT_DELETE) b_count++;
+        }
+        int a_first = edits[start].a_line + (a_count > 0 ? 1 : 0);
+        int b_first = edits[start].b_line + (b_count > 0 ? 1 : 0);
+        result += "@@ -" + to_string(a_first) + "," + to_string(a_count)
+                  + " +" + to_string(b_first) + "," + to_string(b_count) + " @@\n";
+        for (size_t j = start; j < end; ++j) {
+            if (edits[j].kind == EDIT_EQUAL) append_line(result, ' ', a[edits[j].a_line]);
+            else if (edits[j].kind == EDIT_DELETE) append_line(result, '-', a[edits[j].a_line]);
+            else append_line(result, '+', b[edits[j].b_line]);
+        }
+        i = end;
+    }
+    return result;
+}
+
+/**
+ *  One changed region of a two-way diff: base[base_start..base_end) became
+ *  side[side_start..side_end).
+ */
+struct DiffChange {
+    int base_start, base_end;
+    int side_start, side_end;
+};
+
+/**
+ *  Groups an edit script into changed regions, in base order.
+ */
+vector<DiffChange> collect_changes(const vector<EditRun>& runs) {
+    vector<DiffChange> changes;
+    bool open = false;
+    for (const EditRun& run : runs) {
+        if (run.kind == EDIT_EQUAL) {
+            open = false;
+            continue;
+        }
+        if (!open) {
+            changes.push_back({run.a_start, run.a_start, run.b_start, run.b_start});
+            open = true;
+        }
+        if (run.kind == EDIT_DELETE) changes.back().base_end = run.a_start + run.length;
+        else changes.back().side_end = run.b_start + run.length;
+    }
+    return changes;
+}
+
+/**
+ *  Three-way line merge of `ours` and `theirs` against their common `base`.
+ *  Regions changed on one side only are taken from that side; regions both
+ *  sides changed differently (or edits that touch) become conflict blocks.
+ *  Returns the number of conflicts.
+ */
+int merge_three_way(const string& base, const string& ours, const string& theirs,
+                    const string& ours_label, const string& theirs_label, string& result) {
+    vector<string_view> base_lines = split_lines(base);
+    vector<string_view> our_lines = split_lines(ours);
+    vector<string_view> their_lines = split_lines(theirs);
+    vector<DiffChange> our_changes = collect_changes(diff_lines(base_lines, our_lines));
+    vector<DiffChange> their_changes = collect_changes(diff_lines(base_lines, their_lines));
+
+    auto append_lines = [&result](const vector<string_view>& lines, int from, int to, bool terminate) {
+        for (int i = from; i < to; ++i) result.append(lines[i].data(), lines[i].size());
+        if (terminate && to > from && lines[to - 1].back() != '\n') result += '\n';
+    };
+    // Lines of one side covering base[start..end), given its changes [first..last).
+    auto side_range = [](const vector<DiffChange>& changes, size_t first, size_t last,
+                         int start, int end, int& from, int& to) {
+        from = changes[first].side_start - (changes[first].base_start - start);
+        to = changes[last - 1].side_end + (end - changes[last - 1].base_end);
+    };
+
+    result.clear();
+    int conflicts = 0;
+    int base_pos = 0;
+    size_t i = 0, j = 0;
+    while (i < our_changes.size() || j < their_changes.size()) {
+        bool ours_first = j == their_changes.size()
+                          || (i < our_changes.size() && our_changes[i].base_start <= their_changes[j].base_start);
+        int start = ours_first ? our_changes[i].base_start : their_changes[j].base_start;
+        int end = ours_first ? our_changes[i].base_end : their_changes[j].base_end;
+        append_lines(base_lines, base_pos, start, false);
+
+        // Grow the region until no change on either side touches it.
+        size_t i_end = i, j_end = j;
+        bool grew = true;
+        while (grew) {
+            grew = false;
+            if (i_end < our_changes.size() && our_changes[i_end].base_start <= end) {
+                end = custom_max(end, our_changes[i_end++].base_end);
+                grew = true;
+            }
+            if (j_end < their_changes.size() && their_changes[j_end].base_start <= end) {
+                end = custom_max(end, their_changes[j_end++].base_end);
+                grew = true;
+            }
+        }
+
+        int our_from, our_to, their_from, their_to;
+        if (j_end == j) {
+            side_range(our_changes, i, i_end, start, end, our_from, our_to);
+            append_lines(our_lines, our_from, our_to, false);
+        } else if (i_end == i) {
+            side_range(their_changes, j, j_end, start, end, their_from, their_to);
+            append_lines(their_lines, their_from, their_to, false);
+        } else {
+            side_range(our_changes, i, i_end, start, end, our_from, our_to);
+            side_range(their_changes, j, j_end, start, end, their_from, their_to);
+            bool same = our_to - our_from == their_to - their_from;
+            for (int k = 0; same && k < our_to - our_from; ++k) {
+                same = our_lines[our_from + k] == their_lines[their_from + k];
+            }
+            if (same) {
+                append_lines(our_lines, our_from, our_to, false);
+            } else {
+                conflicts++;
+                if (!result.empty() && result.back() != '\n') result += '\n';
+                result += "<<<<<<< " + ours_label + "\n";
+                append_lines(our_lines, our_from, our_to, true);
+                result += "=======\n";
+                append_lines(their_lines, their_from, their_to, true);
+                result += ">>>>>>> " + theirs_label + "\n";
+            }
+        }
+        base_pos = end;
+        i = i_end;
+        j = j_end;
+    }
+    append_lines(base_lines, base_pos, (int)base_lines.size(), false);
+    return conflicts;
+}
+
+//==============================================================================
+// SEARCH INDEX
+// Purpose: A trigram index over the content of every (file, version) pair, so
+//          GREP only has to verify the few versions that contain all of a
+//          pattern's three-byte substrings. Documents of deleted files,
+//          freed versions and content replaced in place are marked dead and
+//          skipped; once they hold half of the index it is rebuilt without
+//          them.
+//==============================================================================
+
+/**
+ *  A searchable (file, version) pair.
+ */
+struct SearchDoc {
+    int file_id;       // Stable across RENAME; never reused after DELETE.
+    int version_id;
+    int postings = 0;  // Posting list entries that name this doc.
+    bool live = true;
+};
+
+class SearchIndex {
+private:
+    // Documents and postings held for one file, so DELETE can drop them all
+    // without visiting each one.
+    struct FileEntries {
+        int docs = 0;
+        long long postings = 0;
+    };
+
+    vector<SearchDoc> docs;
+    HashMap<long long, int> doc_by_key; // (file ID << 32 | version) -> doc ID, live docs only.
+    HashMap<int, FileEntries> by_file;
+    HashMap<int, bool> dead_files;      // Deleted since the last rebuild; their docs are dead.
+    // Packed trigram -> 1 + index into postings, 0 if absent. Trigrams are 24
+    // bits, so this is a direct-address table. It and `seen` are allocated
+    // when the first text is indexed, and calloc leaves the pages of unused
+    // trigram ranges unmapped.
+    int* list_by_trigram;
+    vector<vector<int>> postings;       // Sorted doc IDs per trigram.
+    vector<int> list_trigram;           // The trigram of each posting list.
+    long long total_postings;
+    long long dead_docs;
+    long long dead_postings;            // Entries naming dead docs.
+    long long rebuilds;
+    vector<uint64_t> seen;              // Scratch bitmap over all trigrams.
+    vector<int> distinct;               // Scratch list of the bits set in `seen`.
+
+    static const int TRIGRAM_SPACE = 1 << 24;
+
+    static int packTrigram(const unsigned char* p) { return (p[0] << 16) | (p[1] << 8) | p[2]; }
+    static long long keyOf(int file_id, int version_id) {
+        return ((long long)file_id << 32) | (unsigned int)version_id;
+    }
+
+    int listOf(int trigram) const { return list_by_trigram == nullptr ? 0 : list_by_trigram[trigram]; }
+
+    /**
+     *  Adds `doc` to a posting list and returns whether it was missing. Docs
+     *  are usually indexed in ID order, so this is almost always an append.
+     */
+    bool addPosting(vector<int>& list, int doc) {
+        if (list.empty() || list.back() < doc) {
+            list.push_back(doc);
+            total_postings++;
+            return true;
+        }
+        size_t low = 0, high = list.size();
+        while (low < high) {
+            size_t mid = low + (high - low) / 2;
+            if (list[mid] < doc) low = mid + 1;
+            else high = mid;
+        }
+        if (list[low] == doc) return false;
+        list.insert(list.begin() + low, doc);
+        total_postings++;
+        return true;
+    }
+
+    void killDocument(int doc) {
+        docs[doc].live = false;
+        dead_docs++;
+        dead_postings += docs[doc].postings;
+    }
+
+    /**
+     *  Rebuilds the index without dead docs once they hold half of it, so
+     *  the cost is paid off by the removals that led up to it. Doc IDs are
+     *  renumbered in order, which keeps every posting list sorted.
+     */
+    void rebuildIfSparse() {
+        if (dead_docs * 2 <= (long long)docs.size() && dead_postings * 2 <= total_postings) return;
+        vector<int> renumbered(docs.size(), -1);
+        size_t kept = 0;
+        for (size_t doc = 0; doc < docs.size(); ++doc) {
+            if (!isLive((int)doc)) continue;
+            renumbered[doc] = (int)kept;
+            docs[kept++] = docs[doc];
+        }
+        docs.resize(kept);
+        docs.shrink_to_fit();
+        doc_by_key.reset(custom_max<int>(1024, (int)kept));
+        for (size_t doc = 0; doc < kept; ++doc) doc_by_key.put(keyOf(docs[doc].file_id, docs[doc].version_id), (int)doc);
+
+        size_t lists = 0;
+        total_postings = 0;
+        for (size_t i = 0; i < postings.size(); ++i) {
+            vector<int>& list = postings[i];
+            size_t keep = 0;
+            for (int doc : list) {
+                if (renumbered[doc] != -1) list[keep++] = renumbered[doc];
+            }
+            if (keep == 0) {
+                list_by_trigram[list_trigram[i]] = 0;
+                continue;
+            }
+            list.resize(keep);
+            list.shrink_to_fit();
+            total_postings += keep;
+            list_by_trigram[list_trigram[i]] = (int)lists + 1;
+            list_trigram[lists] = list_trigram[i];
+            if (lists != i) postings[lists] = move(list);
+            lists++;
+        }
+        postings.resize(lists);
+        list_trigram.resize(lists);
+        dead_files.clear();
+        dead_docs = 0;
+        dead_postings = 0;
+        rebuilds++;
+    }
+
+public:
+    SearchIndex() : doc_by_key(1024), by_file(256), list_by_trigram(nullptr), total_postings(0), dead_docs(0),
+                    dead_postings(0), rebuilds(0) {}
+
+    ~SearchIndex() { free(list_by_trigram); }
+
+    SearchIndex(const SearchIndex&) = delete;
+    SearchIndex& operator=(const SearchIndex&) = delete;
+
+    /**
+     *  Returns the doc ID of a (file, version) pair, registering it if new.
+     */
+    int documentFor(int file_id, int version_id) {
+        long long key = keyOf(file_id, version_id);
+        if (doc_by_key.containsKey(key)) return doc_by_key.get(key);
+        int doc = (int)docs.size();
+        docs.push_back({file_id, version_id});
+        doc_by_key.put(key, doc);
+        FileEntries entries = by_file.containsKey(file_id) ? by_file.get(file_id) : FileEntries();
+        entries.docs++;
+        by_file.put(file_id, entries);
+        return doc;
+    }
+
+    /**
+     *  Marks a version's doc dead: the version was freed, or its content is
+     *  about to be indexed afresh after changing in place.
+     */
+    void removeDocument(int file_id, int version_id) {
+        long long key = keyOf(file_id, version_id);
+        if (!doc_by_key.containsKey(key)) return;
+        int doc = doc_by_key.get(key);
+        doc_by_key.remove(key);
+        killDocument(doc);
+        FileEntries entries = by_file.get(file_id);
+        entries.docs--;
+        entries.postings -= docs[doc].postings;
+        by_file.put(file_id, entries);
+        rebuildIfSparse();
+    }
+
+    /**
+     *  Marks every doc of a deleted file dead in O(1); they are dropped by
+     *  the next rebuild. File IDs are never reused.
+     */
+    void removeFile(int file_id) {
+        if (!by_file.containsKey(file_id)) return;
+        FileEntries entries = by_file.get(file_id);
+        by_file.remove(file_id);
+        dead_files.put(file_id, true);
+        dead_docs += entries.docs;
+        dead_postings += entries.postings;
+        rebuildIfSparse();
+    }
+
+    bool isLive(int doc) const { return docs[doc].live && !dead_files.containsKey(docs[doc].file_id); }
+
+    /**
+     *  Indexes every trigram of text[from..] for `doc`. Callers pass the offset
+     *  where new bytes begin minus two, so trigrams spanning the old end are
+     *  included.
+     */
+    void addText(int doc, const string& text, size_t from) {
+        if (from + 3 > text.size()) return;
+        if (list_by_trigram == nullptr) {
+            list_by_trigram = (int*)calloc(TRIGRAM_SPACE, sizeof(int));
+            if (list_by_trigram == nullptr) throw bad_alloc();
+            seen.assign(TRIGRAM_SPACE / 64, 0);
+        }
+        // First collect the distinct trigrams in a bitmap (2 MiB, cleared
+        // again below), then touch each posting list once.
+        const unsigned char* data = (const unsigned char*)text.data();
+        distinct.clear();
+        for (size_t i = from; i + 3 <= text.size(); ++i) {
+            int trigram = packTrigram(data + i);
+            uint64_t bit = 1ULL << (trigram & 63);
+            if (seen[trigram >> 6] & bit) continue;
+            seen[trigram >> 6] |= bit;
+            distinct.push_back(trigram);
+        }
+        int added = 0;
+        for (int trigram : distinct) {
+            seen[trigram >> 6] = 0;
+            if (list_by_trigram[trigram] == 0) {
+                postings.emplace_back();
+                list_trigram.push_back(trigram);
+                list_by_trigram[trigram] = (int)postings.size();
+            }
+            vector<int>& list = postings[list_by_trigram[trigram] - 1];
+            if (!list.empty() && list.back() == doc) continue;
+            if (addPosting(list, doc)) added++;
+        }
+        docs[doc].postings += added;
+        FileEntries entries = by_file.get(docs[doc].file_id);
+        entries.postings += added;
+        by_file.put(docs[doc].file_id, entries);
+    }
+
+    /**
+     *  Intersects the posting lists of every trigram in `literals`. Returns
+     *  false when no literal is long enough to filter anything, in which case
+     *  every document is a candidate.
+     */
+    bool candidates(const vector<string>& literals, vector<int>& out) const {
+        vector<int> lists;
+        for (const string& literal : literals) {
+            const unsigned char* data = (const unsigned char*)literal.data();
+            for (size_t i = 0; i + 3 <= literal.size(); ++i) {
+                int trigram = packTrigram(data + i);
+                if (listOf(trigram) == 0) {
+                    out.clear(); // A required trigram occurs nowhere.
+                    return true;
+                }
+                lists.push_back(listOf(trigram) - 1);
+            }
+        }
+        if (lists.empty()) return false;
+
+        // Start from the shortest list and filter it against the others.
+        size_t shortest = 0;
+        for (size_t i = 1; i < lists.size(); ++i) {
+            if (postings[lists[i]].size() < postings[lists[shortest]].size()) shortest = i;
+        }
+        out.clear();
+        for (int doc : postings[lists[shortest]]) {
+            if (isLive(doc)) out.push_back(doc);
+        }
+        for (size_t i = 0; i < lists.size() && !out.empty(); ++i) {
+            if (i == shortest) continue;
+            const vector<int>& other = postings[lists[i]];
+            size_t keep = 0, k = 0;
+            for (int doc : out) {
+                while (k < other.size() && other[k] < doc) k++;
+                if (k < other.size() && other[k] == doc) out[keep++] = doc;
+            }
+            out.resize(keep);
+        }
+        return true;
+    }
+
+    const SearchDoc& document(int doc) const { return docs[doc]; }
+    int documentCount() const { return (int)docs.size(); } // Including dead docs.
+    long long liveDocumentCount() const { return (long long)docs.size() - dead_docs; }
+    int trigramCount() const { return (int)postings.size(); }
+    long long postingCount() const { return total_postings; }
+    long long deadPostingCount() const { return dead_postings; }
+    long long rebuildCount() const { return rebuilds; }
+};
+
+/**
+ *  Returns the literal substrings every match of an ECMAScript regex must
+ *  contain, for filtering through the trigram index. Only runs outside of
+ *  groups and classes are used, and nothing is returned when the pattern has a
+ *  top-level alternation. Missing a literal only weakens the filter.
+ */
+vector<string> regex_required_literals(const string& pattern) {
+    vector<string> literals;
+    string run;
+    int depth = 0;
+    auto finish = [&]() {
+        if (run.size() >= 3) literals.push_back(run);
+        run.clear();
+    };
+    for (size_t i = 0; i < pattern.size(); ++i) {
+        char c = pattern[i];
+        if (depth > 0) {
+            if (c == '\\') i++;
+            else if (c == '(' || c == '[') depth++;
+            else if (c == ')' || c == ']') depth--;
+            continue;
+        }
+        if (c == '|') return {};
+        if (c == '*' || c == '?' || c == '{') {
+            if (!run.empty()) run.pop_back(); // The previous atom may be absent.
+            finish();
+            if (c == '{') {
+                while (i < pattern.size() && pattern[i] != '}') i++;
+            }
+            continue;
+        }
+        if (c == '+') {
+            // The previous atom is required but may repeat, so the run breaks
+            // after it and the next run starts with it.
+            string last = run.empty() ? "" : run.substr(run.size() - 1);
+            finish();
+            run = last;
+            continue;
+        }
+        if (c == '(' || c == '[') {
+            finish();
+            depth++;
+            continue;
+        }
+        bool literal = true;
+        char value = c;
+        if (c == '\\') {
+            if (i + 1 >= pattern.size()) break;
+            value = pattern[++i];
+            literal = !isalnum((unsigned char)value); // \d, \w, \b... are classes or anchors.
+            // Escapes with arguments stand for one unknown character, so their
+            // hex digits, control letter or back-reference digits are skipped.
+            size_t skip = value == 'x' ? 2 : value == 'u' ? 4 : value == 'c' ? 1 : 0;
+            if (isdigit((unsigned char)value)) {
+                while (i + 1 < pattern.size() && isdigit((unsigned char)pattern[i + 1])) i++;
+            }
+            i = i + skip < pattern.size() ? i + skip : pattern.size() - 1;
+        } else if (c == '.' || c == '^' || c == '$' || c == ')' || c == ']' || c == '}') {
+            literal = false;
+        }
+        if (!literal) {
+            finish();
+            continue;
+        }
+        run += value;
+    }
+    finish();
+    return literals;
+}
+
+const size_t MAX_REGEX_LINE_BYTES = 1024;
+
+/**
+ *  Matches a regex against each line of `content`. libstdc++'s regex engine
+ *  recurses at least once per character, so a long line can overflow the
+ *  stack; lines over MAX_REGEX_LINE_BYTES are not searched, and `skipped`
+ *  is set when one of them was left unchecked and no other line matched.
+ */
+bool regex_search_lines(const string& content, const regex& compiled, bool& skipped) {
+    skipped = false;
+    size_t start = 0;
+    while (start <= content.size()) {
+        size_t end = content.find('\n', start);
+        if (end == string::npos) end = content.size();
+        if (end - start > MAX_REGEX_LINE_BYTES) {
+            skipped = true;
+        } else if (regex_search(content.data() + start, content.data() + end, compiled)) {
+            skipped = false;
+            return true;
+        }
+        start = end + 1;
+    }
+    return false;
+}
+
+//==============================================================================
+// GARBAGE COLLECTOR
+// Purpose: Enforces a retention policy on version trees from a background
+//          thread. A pass is split into slices that each hold the command lock
+//          for at most a couple of milliseconds, so foreground commands only
+//          ever wait for one slice.
+//==============================================================================
+
+/**
+ *  Which versions survive garbage collection. The root, the active version
+ *  and versions recorded by a checkpoint are always kept; everything else
+ *  must be one of the newest `keep_last` snapshots or the newest snapshot of
+ *  one of the last `daily_days` days.
+ */
+struct RetentionPolicy {
+    int keep_last = 10;
+    int daily_days = 30;
+    int interval_seconds = 0; // Automatic passes; 0 runs only on request.
+};
+
+/**
+ *  Orders snapshots newest first in a MaxHeap.
+ */
+struct SnapshotRank {
+    time_t timestamp;
+    int version_id;
+    VersionNode* node;
+
+    bool operator<(const SnapshotRank& other) const {
+        if (timestamp != other.timestamp) return timestamp < other.timestamp;
+        return version_id < other.version_id;
+    }
+};
+
+/**
+ *  Runs collection passes on its own thread, either when requested or every
+ *  `interval_seconds`. A pass calls `run_slice` until it reports completion,
+ *  sleeping briefly between slices so waiting commands get the lock.
+ */
+class GarbageCollector {
+private:
+    function<bool()> run_slice; // Does one bounded slice; true when the pass is done.
+    thread worker;
+    mutex state_lock;
+    condition_variable wake;
+    bool pass_requested = false;
+    bool settings_changed = false;
+    int interval_seconds = 0;
+    atomic<bool> stopping{false};
+    atomic<bool> pass_running{false};
+
+    void loop() {
+        unique_lock<mutex> lock(state_lock);
+        while (!stopping) {
+            auto ready = [this] { return stopping || pass_requested || settings_changed; };
+            bool due = false; // An automatic pass is due when the wait times out.
+            if (interval_seconds > 0) {
+                due = !wake.wait_for(lock, chrono::seconds(interval_seconds), ready);
+            } else {
+                wake.wait(lock, ready);
+            }
+            if (stopping) break;
+            settings_changed = false; // Re-wait with the new interval.
+            if (!pass_requested && !due) continue;
+            pass_requested = false;
+            pass_running = true;
+            lock.unlock();
+            while (!stopping && !run_slice()) {
+                this_thread::sleep_for(chrono::microseconds(500));
+            }
+            pass_running = false;
+            lock.lock();
+        }
+    }
+
+public:
+    ~GarbageCollector() { stop(); }
+
+    void start(function<bool()> slice) {
+        run_slice = move(slice);
+        worker = thread(&GarbageCollector::loop, this);
+    }
+
+    /**
+     *  Asks for a pass. Returns false if one is already running.
+     */
+    bool request() {
+        lock_guard<mutex> lock(state_lock);
+        if (pass_running || pass_requested) return false;
+        pass_requested = true;
+        wake.notify_one();
+        return true;
+    }
+
+    void setInterval(int seconds) {
+        lock_guard<mutex> lock(state_lock);
+        interval_seconds = seconds;
+        settings_changed = true;
+        wake.notify_one();
+    }
+
+    bool isRunning() const { return pass_running; }
+
+    /**
+     *  Stops the thread, abandoning any pass after its current slice.
+     */
+    void stop() {
+        {
+            lock_guard<mutex> lock(state_lock);
+            stopping = true;
+            wake.notify_one();
+        }
+        if (worker.joinable()) worker.join();
+    }
+};
+
+//==============================================================================
+// FILE CLASS
+// Purpose: Manages the version history and metadata for a single file.
+//==============================================================================
+
+class PackStore;   // Defined with the persistence code further down.
+class IndexWriter;
+class IndexReader;
+class File;
+
+/**
+ *  Heap bytes held by files, by what holds them. Each block is counted at
+ *  the size requested from the allocator, without its bookkeeping.
+ */
+struct MemoryUsage {
+    long long versions = 0;     // Loaded versions (not a byte count).
+    long long nodes = 0;        // The VersionNode objects.
+    long long contents = 0;     // Content buffers.
+    long long messages = 0;     // Snapshot message buffers.
+    long long version_maps = 0; // Buckets and entries of the version maps.
+    long long time_indexes = 0;
+    long long blame_caches = 0; // Cached line origins.
+    long long stubs = 0;        // Serialized trees of files not loaded.
+    long long file_objects = 0; // File objects, names and ID lists.
+
+    long long total() const {
+        return nodes + contents + messages + version_maps + time_indexes + blame_caches + stubs + file_objects;
+    }
+
+    void add(const MemoryUsage& other) {
+        versions += other.versions;
+        nodes += other.nodes;
+        contents += other.contents;
+        messages += other.messages;
+        version_maps += other.version_maps;
+        time_indexes += other.time_indexes;
+        blame_caches += other.blame_caches;
+        stubs += other.stubs;
+        file_objects += other.file_objects;
+    }
+};
+
+/**
+ *  Blob contents read ahead of loading stubs, so that the reads can happen
+ *  without the FileSystem lock. Loading takes contents from here first.
+ */
+struct FetchedBlobs {
+    HashMap<long long, size_t> slots; // Blob ID -> index into contents.
+    vector<string> contents;
+
+    void add(long long blob_id, string content) {
+        slots.put(blob_id, contents.size());
+        contents.push_back(move(content));
+    }
+
+    bool take(long long blob_id, string& out) {
+        if (!slots.containsKey(blob_id)) return false;
+        out = move(contents[slots.get(blob_id)]);
+        slots.remove(blob_id);
+        return true;
+    }
+};
+
+/**
+ *  A cap on the bytes of loaded version trees, shared by every shard. A
+ *  write that would go over it first frees slack capacity, then evicts cold
+ *  trees to the store, and is refused if that is not enough.
+ */
+struct MemoryBudget {
+    atomic<long long> used{0};      // Bytes of every loaded tree.
+    atomic<long long> limit{0};     // 0 for no budget.
+    atomic<long long> slack_freed{0};
+    atomic<long long> evictions{0};
+    atomic<long long> refused{0};   // Writes turned away.
+
+    bool exceededBy(long long incoming) const {
+        long long cap = limit.load();
+        return cap > 0 && used.load() + incoming > cap;
+    }
+};
+
+/**
+ *  The files of one FileSystem whose version trees are in memory, most
+ *  recently used first, and the bytes they hold. The list is threaded
+ *  through the files themselves. Eviction takes files from the cold end.
+ */
+class ResidentSet {
+private:
+    File* head = nullptr; // Most recently used.
+    File* tail = nullptr;
+
+public:
+    atomic<long long> bytes{0};
+    MemoryBudget* budget = nullptr; // Also charged for every byte.
+    long long loads = 0;     // Stubs whose tree was read from the store.
+    long long evictions = 0; // Trees dropped back to stubs.
+    long long files = 0;
+
+    void add(File* file);
+    void remove(File* file);
+    void touch(File* file);
+    void adjust(long long delta) {
+        bytes += delta;
+        budget->used += delta;
+    }
+    File* coldest() const { return tail; }
+    File* hottest() const { return head; }
+};
+
+class File {
+private:
+    string filename;
+    int file_id;                        // Assigned by the FileSystem; survives RENAME.
+    VersionNode* root;                  // The root of the version history tree.
+    VersionNode* active_version;        // The currently active version (HEAD).
+    HashMap<int, VersionNode*> version_map; // For O(1) lookup of versions by ID.
+    int total_versions;                 // Counter for assigning new version IDs.
+    time_t last_modification_time;      // Timestamp of the last modification.
+    TimeIndex time_index;               // Version creation times, for point-in-time lookups.
+    bool checkpoint_dirty;              // Changed since the last SNAPSHOT_ALL.
+    HashMap<int, vector<int>*> blame_cache; // Line origins of snapshot versions.
+    vector<int> pinned_versions;        // Recorded by checkpoints; never collected.
+    vector<long long> released_blobs;   // Saved contents that were freed or overwritten.
+    bool search_pending;                // Versions not yet in the FileSystem's search index.
+
+    // A file opened from a store starts as a stub: its version tree stays in
+    // the serialized form of the index until something needs it.
+    PackStore* lazy_store;              // Non-null while the tree is not loaded.
+    string lazy_tree;                   // Node count and nodes, as in the index.
+    int stub_active_id;
+    int stub_live_versions;
+
+    // Residency, managed with the owning FileSystem's ResidentSet.
+    ResidentSet* resident;              // Null until added to a FileSystem.
+    File* resident_prev;                // Neighbours in the set's list...
+    File* resident_next;
+    bool in_resident_list;              // ...when the tree is loaded.
+    long long resident_bytes;           // Heap bytes of the loaded tree; see loadedBytes().
+    bool slack_free;                    // Nothing grew since releaseSlack().
+    friend class ResidentSet;
+
+    /**
+     *  Adds to this file's byte count, and to its set's while listed.
+     */
+    void account(long long delta) {
+        resident_bytes += delta;
+        if (delta > 0) slack_free = false;
+        if (in_resident_list) resident->adjust(delta);
+    }
+
+    static long long nodeBytes(const VersionNode* node) {
+        return (long long)sizeof(VersionNode) + string_heap_bytes(node->content) + node->message.heapBytes();
+    }
+    long long indexBytes() const { return version_map.memoryBytes() + time_index.memoryBytes(); }
+
+    /**
+     *  Bytes of everything memoryUsage() reports except the file object and
+     *  the stub, or 0 for a stub. recount() sets the running count to it
+     *  after changes too scattered to follow one by one.
+     */
+    long long loadedBytes() const;
+    void recount() { account(loadedBytes() - resident_bytes); }
+
+    /**
+     *  Adds a new version as the last child of `parent` and makes it active.
+     */
+    VersionNode* addVersion(VersionNode* parent, string content);
+
+    /**
+     *  Recursively deletes the version tree to prevent memory leaks.
+     */
+    void deleteTree(VersionNode* node);
+
+    /**
+     *  Builds the version tree of a stub, reading every version's content
+     *  from the store unless `fetched` has it. Every method that touches the
+     *  tree calls this first.
+     */
+    void ensureLoaded(FetchedBlobs* fetched = nullptr) const;
+
+    // Reads the serialized nodes. With `build`, contents are read from the
+    // store (or taken from `fetched`) and the tree is built; otherwise the
+    // nodes are only checked.
+    bool readTree(IndexReader& in, PackStore& store, bool build, uint32_t active_id,
+                  FetchedBlobs* fetched = nullptr);
+    void writeTree(IndexWriter& out) const;
+
+    /**
+     *  Forgets the saved blob of the active version before it is changed in
+     *  place.
+     */
+    void releaseActiveBlob() {
+        if (active_version->blob_id == -1) return;
+        released_blobs.push_back(active_version->blob_id);
+        active_version->blob_id = -1;
+    }
+
+    /**
+     *  Derives a version's line origins from its parent's. `parent_origins`
+     *  belongs to `node->parent`.
+     */
+    void deriveLineOrigins(const VersionNode* node, const vector<int>& parent_origins, vector<int>& origins);
+
+public:
+    File(const string& name);
+    ~File();
+
+    string read() const;
+    void insert(const string& content);
+    void update(string content);
+    bool snapshot(const string& message);
+    bool rollback(int versionId = -1);
+    string history() const;
+
+    // Returns the newest version created at or before `when`, or nullptr.
+    // O(log n) through the time index.
+    const VersionNode* versionAt(time_t when) const;
+
+    // Returns the version with the given ID, or nullptr.
+    const VersionNode* getVersion(int versionId) const;
+
+    // Frees every version the policy does not retain and relinks the
+    // survivors to their nearest surviving ancestor. Returns the number of
+    // versions freed and adds their content bytes to `bytes_freed`.
+    int prune(const RetentionPolicy& policy, time_t now, long long& bytes_freed);
+
+    // Protects a version from garbage collection.
+    void pinVersion(int versionId) { pinned_versions.push_back(versionId); }
+
+    // Persistence. persist() stores every unsaved version's content as a
+    // blob and returns how many it wrote; the released blobs are handed back
+    // to the store on the next save.
+    int persist(PackStore& store, long long& bytes);
+    void serialize(IndexWriter& out) const;
+    // Reads a file as a stub; the tree itself is loaded on first use.
+    bool deserialize(IndexReader& in, PackStore& store);
+    bool isLoaded() const { return lazy_store == nullptr; }
+    void load(FetchedBlobs* fetched = nullptr) { ensureLoaded(fetched); }
+
+    // Adds the blob ID of every version of a stub to `out`, without loading it.
+    void stubBlobIds(vector<long long>& out) const;
+    // Finds the blob of a stub's version current at `as_of` (the active one
+    // for -1), without loading it. Returns false if no version existed yet.
+    bool stubBlobAt(time_t as_of, long long& blob_id) const;
+
+    // Drops the version tree, leaving a stub that is loaded again on next
+    // use. Every version must already be saved in `store`.
+    void evict(PackStore& store);
+
+    // Joins a FileSystem's resident set (if loaded), or leaves it.
+    void setResidentSet(ResidentSet* set);
+    long long getResidentBytes() const { return resident_bytes; }
+
+    // Heap bytes held by this file, by kind. A stub is not loaded to count it.
+    MemoryUsage memoryUsage() const;
+
+    // Frees the spare capacity of contents and the time index. Returns the
+    // bytes given back.
+    long long releaseSlack();
+    File* newerResident() const { return resident_prev; }
+    vector<long long> takeReleasedBlobs() { return move(released_blobs); }
+
+    // Moves the blob of every version, and every blob released earlier, to
+    // `out`. Used when the file itself is deleted.
+    void releaseAllBlobs(vector<long long>& out);
+
+    // For each line of a version, the ID of the version that introduced it.
+    // Returns false if the version does not exist.
+    bool lineOrigins(int versionId, vector<int>& origins);
+
+    // Newest version reachable from both versions through parent and
+    // merge-parent links, or nullptr.
+    const VersionNode* commonAncestor(int firstId, int secondId) const;
+
+    // Adds a version with two parents (a child of `oursId` in the tree) and
+    // makes it active. Returns its ID.
+    int addMerge(int oursId, int theirsId, string content);
+
+    // Accessors for file metadata.
+    string getName() const;
+    void setName(const string& name) { filename = name; }
+    int getId() const { return file_id; }
+    void setId(int id) { file_id = id; }
+    int getVersionCount() const;        // Versions ever created (next ID).
+    int getLiveVersionCount() const;    // Versions not yet garbage collected.
+    int getActiveVersionId() const;
+    time_t getLastModificationTime() const;
+    HashMapStats getVersionMapStats() const;
+
+    // Dirty flag used by the FileSystem to track files changed since the
+    // last system-wide checkpoint.
+    bool isCheckpointDirty() const { return checkpoint_dirty; }
+    void setCheckpointDirty(bool dirty) { checkpoint_dirty = dirty; }
+
+    // Set for files loaded from a store until the FileSystem indexes them.
+    bool isSearchPending() const { return search_pending; }
+    void setSearchPending(bool pending) { search_pending = pending; }
+};
+
+/**
+ *  A file read from disk by IMPORT, waiting to be loaded into the FileSystem.
+ */
+struct ImportedFile {
+    string name;     // Path relative to the imported directory.
+    string content;
+    bool ok = false; // False if the file could not be read.
+};
+
+/**
+ *  A system-wide checkpoint created by SNAPSHOT_ALL. Only the files that
+ *  changed since the previous checkpoint are recorded; the full state is the
+ *  newest entry per file along the chain of previous checkpoints.
+ */
+struct GlobalCheckpoint {
+    string tag;
+    time_t timestamp;
+    vector<int> changed_files;     // IDs of the files recorded by this checkpoint...
+    vector<int> version_ids;       // ...and the version each one had.
+    int previous;                  // Index of the previous checkpoint, or -1.
+};
+
+/**
+ *  One file's chosen version for EXPORT. Unsaved content is copied out of
+ *  the FileSystem; saved content is read from a pack while it is written.
+ */
+struct ExportedFile {
+    string name;
+    string content;
+    int source_fd = -1;         // Pack to read instead of `content`, or -1.
+    uint64_t source_offset = 0;
+    uint64_t source_length = 0;
+
+    uint64_t size() const { return source_fd < 0 ? content.size() : source_length; }
+};
+
+//==============================================================================
+// BACKGROUND RECLAIMER
+// Purpose: Frees deleted files on a background thread. DELETE only unlinks a
+//          file from the FileSystem's indexes; walking and freeing a version
+//          tree that may hold millions of nodes happens here, off the command
+//          lock.
+//==============================================================================
+
+class Reclaimer {
+private:
+    thread worker;
+    mutex state_lock;
+    condition_variable wake;        // Work arrived, or stop() was called.
+    condition_variable idle;        // The queue has been emptied.
+    vector<File*> queue;
+    vector<long long> released;     // Blobs of reclaimed files, for the next save.
+    size_t in_flight = 0;           // Files taken off the queue, not yet freed.
+    bool stopping = false;
+    long long files_reclaimed = 0;
+    long long versions_reclaimed = 0;
+
+    void loop() {
+        unique_lock<mutex> lock(state_lock);
+        while (true) {
+            wake.wait(lock, [this] { return stopping || !queue.empty(); });
+            if (queue.empty()) break; // Stopping, and nothing left to free.
+            vector<File*> batch;
+            batch.swap(queue);
+            in_flight = batch.size();
+            lock.unlock();
+            vector<long long> blobs;
+            long long versions = 0;
+            for (File* file : batch) {
+                TraceSpan span("Reclaimer::reclaim");
+                file->releaseAllBlobs(blobs);
+                versions += file->getLiveVersionCount();
+                delete file;
+            }
+            lock.lock();
+            for (long long blob_id : blobs) released.push_back(blob_id);
+            files_reclaimed += (long long)batch.size();
+            versions_reclaimed += versions;
+            in_flight = 0;
+            if (queue.empty()) idle.notify_all();
+        }
+    }
+
+public:
+    ~Reclaimer() { stop(); }
+
+    void start() { worker = thread(&Reclaimer::loop, this); }
+
+    /**
+     *  Hands over a file that is no longer reachable from the FileSystem.
+     */
+    void enqueue(File* file) {
+        lock_guard<mutex> lock(state_lock);
+        queue.push_back(file);
+        wake.notify_one();
+    }
+
+    /**
+     *  Waits until every file handed over so far has been freed.
+     */
+    void drain() {
+        unique_lock<mutex> lock(state_lock);
+        idle.wait(lock, [this] { return queue.empty() && in_flight == 0; });
+    }
+
+    vector<long long> takeReleasedBlobs() {
+        lock_guard<mutex> lock(state_lock);
+        return move(released);
+    }
+
+    /**
+     *  Queues blobs freed some other way for the next save.
+     */
+    void addReleasedBlobs(const vector<long long>& blobs) {
+        lock_guard<mutex> lock(state_lock);
+        for (long long blob_id : blobs) released.push_back(blob_id);
+    }
+
+    /**
+     *  Files waiting to be freed, and files and versions freed so far.
+     */
+    void counts(long long& pending, long long& files, long long& versions) {
+        lock_guard<mutex> lock(state_lock);
+        pending = (long long)(queue.size() + in_flight);
+        files = files_reclaimed;
+        versions = versions_reclaimed;
+    }
+
+    /**
+     *  Frees whatever is still queued, then stops the thread.
+     */
+    void stop() {
+        {
+            lock_guard<mutex> lock(state_lock);
+            stopping = true;
+            wake.notify_one();
+        }
+        if (worker.joinable()) worker.join();
+    }
+
+    /**
+     *  Stops the thread without freeing what is still queued, for a process
+     *  that is about to exit. A batch already being freed is finished.
+     */
+    void abandon() {
+        {
+            lock_guard<mutex> lock(state_lock);
+            queue.clear();
+        }
+        stop();
+    }
+};
+
+//==============================================================================
+// NAMESPACE TREE
+// Purpose: A directory tree over the '/'-separated filenames, kept alongside
+//          the flat HashMap. Each directory keeps its subdirectories and file
+//          names in sorted arrays, so listing one directory costs O(entries)
+//          and a recursive listing only visits the subtree it prints.
+//==============================================================================
+
+class NamespaceTree {
+private:
+    struct DirNode {
+        string name;
+        vector<DirNode*> subdirs; // Sorted by name.
+        vector<string> files;     // Leaf names, sorted.
+        long long file_count = 0; // Files anywhere below this directory.
+    };
+
+    DirNode root;
+
+    /**
+     *  Index of the first subdirectory whose name is not less than `name`.
+     */
+    static size_t findSubdir(const DirNode* dir, const string& name) {
+        size_t low = 0, high = dir->subdirs.size();
+        while (low < high) {
+            size_t mid = low + (high - low) / 2;
+            if (dir->subdirs[mid]->name < name) low = mid + 1;
+            else high = mid;
+        }
+        return low;
+    }
+
+    static size_t findFile(const DirNode* dir, const string& name) {
+        size_t low = 0, high = dir->files.size();
+        while (low < high) {
+            size_t mid = low + (high - low) / 2;
+            if (dir->files[mid] < name) low = mid + 1;
+            else high = mid;
+        }
+        return low;
+    }
+
+    /**
+     *  Splits "a/b/c" into its components.
+     */
+    static vector<string> split(const string& path) {
+        vector<string> parts;
+        size_t start = 0;
+        while (true) {
+            size_t slash = path.find('/', start);
+            if (slash == string::npos) {
+                parts.push_back(path.substr(start));
+                return parts;
+            }
+            parts.push_back(path.substr(start, slash - start));
+            start = slash + 1;
+        }
+    }
+
+    /**
+     *  Resolves a directory path ("" is the root; a trailing '/' is ignored).
+     */
+    const DirNode* findDir(const string& path) const {
+        string trimmed = path;
+        if (!trimmed.empty() && trimmed.back() == '/') trimmed.pop_back();
+        const DirNode* dir = &root;
+        if (trimmed.empty()) return dir;
+        for (const string& part : split(trimmed)) {
+            size_t index = findSubdir(dir, part);
+            if (index == dir->subdirs.size() || dir->subdirs[index]->name != part) return nullptr;
+            dir = dir->subdirs[index];
+        }
+        return dir;
+    }
+
+    static void collectFrom(const DirNode* dir, const string& prefix, vector<string>& out) {
+        // Merge subdirectories and files so the output is in path order.
+        size_t d = 0, f = 0;
+        while (d < dir->subdirs.size() || f < dir->files.size()) {
+            if (f == dir->files.size() || (d < dir->subdirs.size() && dir->subdirs[d]->name + "/" < dir->files[f])) {
+                collectFrom(dir->subdirs[d], prefix + dir->subdirs[d]->name + "/", out);
+                d++;
+            } else {
+                out.push_back(prefix + dir->files[f]);
+                f++;
+            }
+        }
+    }
+
+    static void deleteDirs(DirNode* dir) {
+        for (DirNode* child : dir->subdirs) {
+            deleteDirs(child);
+            delete child;
+        }
+    }
+
+public:
+    NamespaceTree() {}
+    ~NamespaceTree() { deleteDirs(&root); }
+
+    NamespaceTree(const NamespaceTree&) = delete;
+    NamespaceTree& operator=(const NamespaceTree&) = delete;
+
+    void add(const string& path) {
+        vector<string> parts = split(path);
+        DirNode* dir = &root;
+        vector<DirNode*> trail = {dir};
+        for (size_t i = 0; i + 1 < parts.size(); ++i) {
+            size_t index = findSubdir(dir, parts[i]);
+            if (index == dir->subdirs.size() || dir->subdirs[index]->name != parts[i]) {
+                DirNode* created = new DirNode();
+                created->name = parts[i];
+                dir->subdirs.insert(dir->subdirs.begin() + index, created);
+            }
+            dir = dir->subdirs[index];
+            trail.push_back(dir);
+        }
+        size_t index = findFile(dir, parts.back());
+        if (index < dir->files.size() && dir->files[index] == parts.back()) return;
+        dir->files.insert(dir->files.begin() + index, parts.back());
+        for (DirNode* node : trail) node->file_count++;
+    }
+
+    /**
+     *  Removes a file and any directories it leaves empty.
+     */
+    void remove(const string& path) {
+        vector<string> parts = split(path);
+        vector<DirNode*> trail = {&root};
+        for (size_t i = 0; i + 1 < parts.size(); ++i) {
+            DirNode* dir = trail.back();
+            size_t index = findSubdir(dir, parts[i]);
+            if (index == dir->subdirs.size() || dir->subdirs[index]->name != parts[i]) return;
+            trail.push_back(dir->subdirs[index]);
+        }
+        DirNode* dir = trail.back();
+        size_t index = findFile(dir, parts.back());
+        if (index == dir->files.size() || dir->files[index] != parts.back()) return;
+        dir->files.erase(dir->files.begin() + index);
+        for (DirNode* node : trail) node->file_count--;
+        for (size_t i = trail.size() - 1; i > 0 && trail[i]->file_count == 0; --i) {
+            DirNode* parent = trail[i - 1];
+            parent->subdirs.erase(parent->subdirs.begin() + findSubdir(parent, trail[i]->name));
+            delete trail[i];
+        }
+    }
+
+    /**
+     *  Lists one directory: subdirectories (with their file counts) and
+     *  files, each sorted. Returns false if the directory does not exist.
+     */
+    bool list(const string& path, vector<string>& subdirs, vector<long long>& counts, vector<string>& files) const {
+        const DirNode* dir = findDir(path);
+        if (dir == nullptr) return false;
+        for (const DirNode* child : dir->subdirs) {
+            subdirs.push_back(child->name);
+            counts.push_back(child->file_count);
+        }
+        files = dir->files;
+        return true;
+    }
+
+    /**
+     *  Appends the full path of every file below a directory, in sorted
+     *  order. Returns false if the directory does not exist.
+     */
+    bool collect(const string& path, vector<string>& out) const {
+        const DirNode* dir = findDir(path);
+        if (dir == nullptr) return false;
+        string prefix = path;
+        if (!prefix.empty() && prefix.back() != '/') prefix += '/';
+        collectFrom(dir, prefix, out);
+        return true;
+    }
+};
+
+//==============================================================================
+// ORDERED NAME INDEX
+// Purpose: A B+-tree over the filenames, kept alongside the HashMap so sorted
+//          listings, range scans and glob matches read names in order instead
+//          of sorting every filename per request. Nodes hold up to 64 keys in
+//          one array, and the leaves are chained for sequential scans.
+//==============================================================================
+
+class NameIndex {
+private:
+    static const int MAX_KEYS = 64;
+
+    struct Node {
+        bool leaf;
+        int count = 0;                       // Keys in use.
+        string keys[MAX_KEYS + 1];           // One spare slot while splitting.
+        Node* children[MAX_KEYS + 2] = {};   // Inner nodes: count + 1 children.
+        Node* prev = nullptr;                // Leaf chain.
+        Node* next = nullptr;
+        Node(bool is_leaf) : leaf(is_leaf) {}
+    };
+
+    Node* root;
+    size_t total;
+
+    /**
+     *  Index of the first key in the node that is not less than `key`.
+     */
+    static int lowerBound(const Node* node, const string& key) {
+        int low = 0, high = node->count;
+        while (low < high) {
+            int mid = (low + high) / 2;
+            if (node->keys[mid] < key) low = mid + 1;
+            else high = mid;
+        }
+        return low;
+    }
+
+    /**
+     *  The child of an inner node that may contain `key`. Separator i is the
+     *  smallest key of child i + 1.
+     */
+    static int childFor(const Node* node, const string& key) {
+        int low = 0, high = node->count;
+        while (low < high) {
+            int mid = (low + high) / 2;
+            if (node->keys[mid] <= key) low = mid + 1;
+            else high = mid;
+        }
+        return low;
+    }
+
+    /**
+     *  Descends to the leaf that may contain `key`, recording the inner
+     *  nodes and child slots taken.
+     */
+    Node* descend(const string& key, vector<Node*>* path, vector<int>* slots) const {
+        Node* node = root;
+        while (!node->leaf) {
+            int slot = childFor(node, key);
+            if (path) {
+                path->push_back(node);
+                slots->push_back(slot);
+            }
+            node = node->children[slot];
+        }
+        return node;
+    }
+
+    static void shiftKeysRight(Node* node, int from) {
+        for (int i = node->count; i > from; --i) node->keys[i] = move(node->keys[i - 1]);
+    }
+
+    static void destroy(Node* node) {
+        if (!node->leaf) {
+            for (int i = 0; i <= node->count; ++i) destroy(node->children[i]);
+        }
+        delete node;
+    }
+
+public:
+    NameIndex() : root(new Node(true)), total(0) {}
+    ~NameIndex() { destroy(root); }
+
+    NameIndex(const NameIndex&) = delete;
+    NameIndex& operator=(const NameIndex&) = delete;
+
+    size_t size() const { return total; }
+
+    /**
+     *  Adds a name. Returns false if it was already present.
+     */
+    bool insert(const string& key) {
+        vector<Node*> path;
+        vector<int> slots;
+        Node* leaf = descend(key, &path, &slots);
+        int pos = lowerBound(leaf, key);
+        if (pos < leaf->count && leaf->keys[pos] == key) return false;
+        shiftKeysRight(leaf, pos);
+        leaf->keys[pos] = key;
+        leaf->count++;
+        total++;
+        if (leaf->count <= MAX_KEYS) return true;
+
+        // Split the leaf; its right half's first key becomes the separator.
+        Node* right = new Node(true);
+        int keep = leaf->count / 2;
+        for (int i = keep; i < leaf->count; ++i) right->keys[right->count++] = move(leaf->keys[i]);
+        leaf->count = keep;
+        right->next = leaf->next;
+        right->prev = leaf;
+        if (leaf->next) leaf->next->prev = right;
+        leaf->next = right;
+        string separator = right->keys[0];
+        Node* new_child = right;
+
+        // Insert the separator into the parents, splitting them as needed.
+        while (true) {
+            if (path.empty()) {
+                Node* new_root = new Node(false);
+                new_root->keys[0] = move(separator);
+                new_root->children[0] = root;
+                new_root->children[1] = new_child;
+                new_root->count = 1;
+                root = new_root;
+                return true;
+            }
+            Node* parent = path.back();
+            int slot = slots.back();
+            path.pop_back();
+            slots.pop_back();
+            shiftKeysRight(parent, slot);
+            for (int i = parent->count + 1; i > slot + 1; --i) parent->children[i] = parent->children[i - 1];
+            parent->keys[slot] = move(separator);
+            parent->children[slot + 1] = new_child;
+            parent->count++;
+            if (parent->count <= MAX_KEYS) return true;
+
+            // The middle key moves up; the keys after it go to a new node.
+            Node* sibling = new Node(false);
+            int middle = parent->count / 2;
+            separator = move(parent->keys[middle]);
+            for (int i = middle + 1; i < parent->count; ++i) {
+                sibling->keys[sibling->count] = move(parent->keys[i]);
+                sibling->children[sibling->count] = parent->children[i];
+                sibling->count++;
+            }
+            sibling->children[sibling->count] = parent->children[parent->count];
+            parent->count = middle;
+            new_child = sibling;
+        }
+    }
+
+    /**
+     *  Removes a name. Returns false if it was not present. Leaves may run
+     *  below half full; a leaf is only freed once it is empty, and its
+     *  parents with it if they lose their last child.
+     */
+    bool erase(const string& key) {
+        vector<Node*> path;
+        vector<int> slots;
+        Node* leaf = descend(key, &path, &slots);
+        int pos = lowerBound(leaf, key);
+        if (pos == leaf->count || leaf->keys[pos] != key) return false;
+        for (int i = pos; i + 1 < leaf->count; ++i) leaf->keys[i] = move(leaf->keys[i + 1]);
+        leaf->count--;
+        leaf->keys[leaf->count].clear();
+        total--;
+        if (leaf->count > 0 || leaf == root) return true;
+
+        if (leaf->prev) leaf->prev->next = leaf->next;
+        if (leaf->next) leaf->next->prev = leaf->prev;
+        Node* doomed = leaf;
+        while (!path.empty()) {
+            Node* parent = path.back();
+            int slot = slots.back();
+            path.pop_back();
+            slots.pop_back();
+            delete doomed;
+            if (parent->count == 0) { // It had no other child.
+                doomed = parent;
+                continue;
+            }
+            // Drop the child and the separator next to it.
+            int key_slot = slot > 0 ? slot - 1 : 0;
+            for (int i = key_slot; i + 1 < parent->count; ++i) parent->keys[i] = move(parent->keys[i + 1]);
+            for (int i = slot; i < parent->count; ++i) parent->children[i] = parent->children[i + 1];
+            parent->count--;
+            parent->keys[parent->count].clear();
+            doomed = nullptr;
+            break;
+        }
+        if (doomed != nullptr) { // Every node on the path emptied out.
+            delete doomed;
+            root = new Node(true);
+        }
+        while (!root->leaf && root->count == 0) {
+            Node* only = root->children[0];
+            delete root;
+            root = only;
+        }
+        return true;
+    }
+
+    /**
+     *  Calls visit(name) on each name from `from` on, in order, until it
+     *  returns false.
+     */
+    template<typename Visit>
+    void scan(const string& from, Visit visit) const {
+        const Node* leaf = descend(from, nullptr, nullptr);
+        for (int pos = lowerBound(leaf, from); leaf != nullptr; leaf = leaf->next, pos = 0) {
+            for (; pos < leaf->count; ++pos) {
+                if (!visit(leaf->keys[pos])) return;
+            }
+        }
+    }
+};
+
+/**
+ *  Shell-style match of a whole name: '*' matches any run of characters, '?'
+ *  any one character, and [abc] or [a-z] one character from the set.
+ */
+bool glob_match(const string& pattern, const string& name) {
+    size_t p = 0, n = 0;
+    size_t star = string::npos, resume = 0; // Last '*' seen, and where it resumes.
+    while (n < name.size()) {
+        if (p < pattern.size() && pattern[p] == '*') {
+            star = p++;
+            resume = n;
+            continue;
+        }
+        if (p < pattern.size() && pattern[p] == '[') {
+            size_t close = pattern.find(']', p + 1);
+            if (close != string::npos) {
+                bool matched = false;
+                for (size_t i = p + 1; i < close; ++i) {
+                    if (i + 2 < close && pattern[i + 1] == '-') {
+                        if (pattern[i] <= name[n] && name[n] <= pattern[i + 2]) matched = true;
+                        i += 2;
+                    } else if (pattern[i] == name[n]) {
+                        matched = true;
+                    }
+                }
+                if (matched) {
+                    p = close + 1;
+                    n++;
+                    continue;
+                }
+            } else if (name[n] == '[') {
+                p++;
+                n++;
+                continue;
+            }
+        } else if (p < pattern.size() && (pattern[p] == '?' || pattern[p] == name[n])) {
+            p++;
+            n++;
+            continue;
+        }
+        if (star == string::npos) return false;
+        p = star + 1; // Let the last '*' absorb one more character.
+        n = ++resume;
+    }
+    while (p < pattern.size() && pattern[p] == '*') p++;
+    return p == pattern.size();
+}
+
+//==============================================================================
+// WORK-STEALING SCHEDULER
+// Purpose: Spreads whole-system operations (freeing every file, exporting,
+//          searching, pruning) across cores. Each worker keeps a deque of
+//          index ranges: it splits its own ranges at the back, and idle
+//          workers steal from the front of the others' deques.
+//==============================================================================
+
+/**
+ *  Counters for STATS. Idle time is how long workers slept with nothing to
+ *  run or steal.
+ */
+struct SchedulerStats {
+    int workers = 0;
+    long long jobs = 0;
+    long long tasks = 0;
+    long long steals = 0;
+    long long idle_ns = 0;
+};
+
+class WorkStealingScheduler {
+private:
+    /**
+     *  One parallelFor call. It lives on the caller's stack until `done`.
+     */
+    struct Job {
+        const function<void(size_t, size_t)>* body;
+        size_t grain;
+        atomic<size_t> remaining; // Indices not yet processed.
+        mutex done_lock;
+        condition_variable done_signal;
+        bool done = false;
+    };
+
+    struct Task {
+        Job* job;
+        size_t begin;
+        size_t end;
+    };
+
+    /**
+     *  A worker's deque: a vector with a moving head. The owner pushes and
+     *  pops at the back; thieves take from the head, where the biggest
+     *  ranges are.
+     */
+    struct Worker {
+        mutex deque_lock;
+        vector<Task> deque;
+        size_t head = 0;
+        atomic<long long> tasks{0};
+        atomic<long long> steals{0};
+        atomic<long long> idle_ns{0};
+        thread runner;
+    };
+
+    vector<Worker*> workers;
+    atomic<long long> queued{0}; // Tasks in all deques; sleepers wait for it.
+    atomic<long long> jobs{0};
+    atomic<unsigned> next_victim{0};
+    mutex sleep_lock;
+    condition_variable wake;
+    int sleeping = 0;
+    bool stopping = false;
+
+    void push(Worker* worker, const Task& task) {
+        {
+            lock_guard<mutex> guard(worker->deque_lock);
+            worker->deque.push_back(task);
+        }
+        queued.fetch_add(1);
+        lock_guard<mutex> guard(sleep_lock);
+        if (sleeping > 0) wake.notify_one();
+    }
+
+    bool popBack(Worker* worker, Task& out) {
+        lock_guard<mutex> guard(worker->deque_lock);
+        if (worker->head == worker->deque.size()) return false;
+        out = worker->deque.back();
+        worker->deque.pop_back();
+        if (worker->head == worker->deque.size()) {
+            worker->deque.clear();
+            worker->head = 0;
+        }
+        queued.fetch_sub(1);
+        return true;
+    }
+
+    bool stealFront(Worker* victim, Task& out) {
+        lock_guard<mutex> guard(victim->deque_lock);
+        if (victim->head == victim->deque.size()) return false;
+        out = victim->deque[victim->head++];
+        if (victim->head == victim->deque.size()) {
+            victim->deque.clear();
+            victim->head = 0;
+        }
+        queued.fetch_sub(1);
+        return true;
+    }
+
+    /**
+     *  Runs a range, first splitting off its upper halves for thieves until
+     *  it is down to the job's grain. Splits fall on multiples of the grain.
+     */
+    void run(Worker* self, Task task) {
+        Job* job = task.job;
+        while (task.end - task.begin > job->grain) {
+            size_t chunks = (task.end - task.begin + job->grain - 1) / job->grain;
+            size_t middle = task.begin + chunks / 2 * job->grain;
+            push(self, {job, middle, task.end});
+            task.end = middle;
+        }
+        (*job->body)(task.begin, task.end);
+        self->tasks.fetch_add(1, memory_order_relaxed);
+        if (job->remaining.fetch_sub(task.end - task.begin) == task.end - task.begin) {
+            lock_guard<mutex> guard(job->done_lock);
+            job->done = true;
+            job->done_signal.notify_one(); // The caller may free the job once the lock is released.
+        }
+    }
+
+    void workerLoop(int index) {
+        Worker* self = workers[index];
+        while (true) {
+            Task task;
+            bool found = popBack(self, task);
+            for (size_t i = 1; !found && i < workers.size(); ++i) {
+                found = stealFront(workers[(index + i) % workers.size()], task);
+                if (found) self->steals.fetch_add(1, memory_order_relaxed);
+            }
+            if (found) {
+                run(self, task);
+                continue;
+            }
+            auto start = chrono::steady_clock::now();
+            {
+                unique_lock<mutex> guard(sleep_lock);
+                sleeping++;
+                wake.wait(guard, [this] { return queued.load() > 0 || stopping; });
+                sleeping--;
+                if (stopping) return;
+            }
+            self->idle_ns.fetch_add(
+                chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count(),
+                memory_order_relaxed);
+        }
+    }
+
+public:
+    WorkStealingScheduler(int worker_count) {
+        if (worker_count < 1) worker_count = 1;
+        for (int i = 0; i < worker_count; ++i) workers.push_back(new Worker());
+        // A single worker would only add a hand-off; parallelFor then runs inline.
+        if (worker_count > 1) {
+            for (int i = 0; i < worker_count; ++i) workers[i]->runner = thread(&WorkStealingScheduler::workerLoop, this, i);
+        }
+    }
+
+    ~WorkStealingScheduler() {
+        {
+            lock_guard<mutex> guard(sleep_lock);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (Worker* worker : workers) {
+            if (worker->runner.joinable()) worker->runner.join();
+            delete worker;
+        }
+    }
+
+    WorkStealingScheduler(const WorkStealingScheduler&) = delete;
+    WorkStealingScheduler& operator=(const WorkStealingScheduler&) = delete;
+
+    /**
+     *  Calls body(begin, end) over disjoint ranges covering [0, count), in
+     *  parallel, and returns once all of them are done. Each range starts at
+     *  a multiple of `grain` and is at most `grain` long, so callers can
+     *  keep per-range results at begin / grain. Several threads may run
+     *  jobs at once.
+     */
+    void parallelFor(size_t count, size_t grain, const function<void(size_t, size_t)>& body) {
+        if (count == 0) return;
+        if (grain < 1) grain = 1;
+        jobs.fetch_add(1, memory_order_relaxed);
+        if (workers.size() == 1 || count <= grain) {
+            for (size_t begin = 0; begin < count; begin += grain) {
+                body(begin, begin + grain < count ? begin + grain : count);
+                workers[0]->tasks.fetch_add(1, memory_order_relaxed);
+            }
+            return;
+        }
+        Job job;
+        job.body = &body;
+        job.grain = grain;
+        job.remaining = count;
+        // Callers spread over the deques, so concurrent jobs start on different workers.
+        push(workers[next_victim.fetch_add(1) % workers.size()], {&job, 0, count});
+        unique_lock<mutex> guard(job.done_lock);
+        job.done_signal.wait(guard, [&job] { return job.done; });
+    }
+
+    SchedulerStats stats() const {
+        SchedulerStats result;
+        result.workers = (int)workers.size();
+        result.jobs = jobs.load();
+        for (Worker* worker : workers) {
+            result.tasks += worker->tasks.load();
+            result.steals += worker->steals.load();
+            result.idle_ns += worker->idle_ns.load();
+        }
+        return result;
+    }
+};
+
+/**
+ *  The process-wide scheduler, one worker per core. Its threads start on
+ *  first use.
+ */
+WorkStealingScheduler& bulk_scheduler() {
+    static WorkStealingScheduler scheduler((int)thread::hardware_concurrency());
+    return scheduler;
+}
+
+//==============================================================================
+// FILE SYSTEM CLASS
+// Purpose: Acts as the main controller for the version control system,
+//          managing all files and providing the user-facing interface.
+//==============================================================================
+
+class FileSystem {
+private:
+    HashMap<string, File*> files;          // Maps filenames to File objects.
+    HashMap<int, File*> files_by_id;       // The same files by their stable ID.
+    int next_file_id;
+    IndexedMetricHeap recent_files_heap;    // Files by last modification time.
+    IndexedMetricHeap biggest_trees_heap;   // Files by live version count.
+    SystemStats stats;                      // Latency histograms and counters.
+    mutex command_lock;                     // Serializes commands from concurrent clients.
+
+    vector<int> dirty_files;                // IDs of files changed since the last SNAPSHOT_ALL.
+    vector<GlobalCheckpoint> checkpoints;   // In creation order.
+    HashMap<string, int> checkpoint_by_tag; // Tag -> index into checkpoints.
+    SearchIndex search_index;               // Trigrams of every stored version.
+
+    RetentionPolicy retention;              // What garbage collection keeps.
+    vector<int> gc_pass;                    // File IDs of the pass in progress...
+    size_t gc_cursor;                       // ...and how far it has got.
+    long long gc_passes;
+    long long gc_versions_freed;
+    long long gc_bytes_freed;
+    long long gc_max_pause_ns;              // Longest time one slice held the lock.
+    long long gc_file_ns;                   // Measured cost of collecting one file; sizes the batches.
+    GarbageCollector collector;
+
+    PackStore* store;                       // Open store, or nullptr when running in memory only.
+    Reclaimer reclaimer;                    // Frees deleted files in the background.
+
+    NamespaceTree directory_tree;           // Directory view of the filenames.
+    NameIndex name_index;                   // The filenames in sorted order.
+
+    vector<int> unindexed_files;            // IDs of stubs whose versions are not searchable yet.
+    bool fast_exit;                         // Leave the files to the OS when destroyed.
+
+    ResidentSet resident_set;               // Files whose version trees are in memory.
+    long long resident_limit;               // Bytes of trees to keep loaded; 0 for no limit.
+    MemoryBudget own_budget;
+    MemoryBudget* budget;                   // own_budget, or one shared by every shard.
+
+    /**
+     *  Refreshes one file's entries in the analytics heaps, in O(log n).
+     *  Called after any change to the file.
+     */
+    void updateAnalytics(File* file);
+
+    /**
+     *  Adds a file to the dirty set in O(1) (once per checkpoint interval).
+     */
+    void markDirty(File* file);
+
+    /**
+     *  Adds the active version's content from byte `from` on to the search
+     *  index. Appends pass the old length; everything else passes 0.
+     */
+    void indexActiveVersion(File* file, size_t from);
+
+    /**
+     *  Adds a new file to the HashMap and the directory tree.
+     */
+    void addFile(File* file);
+
+    /**
+     *  Removes a file from the name maps, directory tree, name index and
+     *  analytics heaps.
+     */
+    void unlinkFile(File* file);
+
+    /**
+     *  Unlinks a file and hands it to the reclaimer. Its saved blobs are
+     *  released on the next save.
+     */
+    void removeFile(const string& filename);
+
+    /**
+     *  Adds every version of a file to the search index. Returns how many.
+     */
+    long long indexAllVersions(File* file);
+
+    /**
+     *  Indexes the files opened from the store that nothing has indexed yet.
+     *  Run before the first search, which is what loads their trees.
+     */
+    void indexPendingFiles();
+
+    /**
+     *  Finds a file for a command and marks it as recently used. The caller
+     *  has checked that it exists. Cold files are evicted first if the trees
+     *  in memory have outgrown the limit.
+     */
+    File* lookup(const string& filename);
+
+    /**
+     *  Evicts the least recently used trees until the resident bytes fit
+     *  the limit, and the budget has room for `incoming` more. Unsaved
+     *  versions are written to the store first. The most recently used file
+     *  always stays loaded.
+     */
+    void trimResident(long long incoming = 0);
+
+    /**
+     *  Makes room in the memory budget for a write that adds about
+     *  `incoming` bytes: frees slack, then evicts cold trees. Returns an
+     *  error message if the write still does not fit, otherwise "".
+     */
+    string admitWrite(long long incoming);
+
+    /**
+     *  The live file with the given ID, or nullptr if it was deleted.
+     */
+    File* fileById(int id) { return files_by_id.containsKey(id) ? files_by_id.get(id) : nullptr; }
+
+    /**
+     *  One garbage collection slice: prunes files under the command lock until
+     *  the time budget is spent. Returns true when the pass is complete.
+     */
+    bool collectGarbageSlice();
+
+    /**
+     *  Starts a garbage collection pass if none is in progress, then reads the
+     *  blobs of the stubs among the next `count` files of the pass. Only
+     *  planning the reads takes the command lock. Returns the position in the
+     *  pass where the read-ahead ends.
+     */
+    size_t prefetchGcStubs(size_t count, FetchedBlobs& fetched);
+
+    /**
+     *  Encodes every file and checkpoint for the store's index.
+     */
+    string serializeMetadata();
+
+    /**
+     *  Closes the store, if one is open. Unsaved changes are not written.
+     */
+    void closeStore();
+
+    /**
+     *  The store's line of the STATS report, or "" when no store is open.
+     */
+    string storeReport(bool as_json);
+
+public:
+    FileSystem();
+    ~FileSystem();
+
+    // Core file operations. Each returns the message to show the user.
+    string create(const string& filename);
+    string read(const string& filename);
+    string insert(const string& filename, const string& content);
+    string update(const string& filename, const string& content);
+    string snapshot(const string& filename, const string& message);
+    string rollback(const string& filename, int versionId = -1);
+    string history(const string& filename);
+
+    // Directory view: the entries of one directory, or every file below it.
+    string list(const string& directory, bool recursive);
+    bool directoryEntries(const string& directory, vector<string>& subdirs, vector<long long>& counts,
+                          vector<string>& files_here) {
+        return directory_tree.list(directory, subdirs, counts, files_here);
+    }
+    bool collectPaths(const string& directory, vector<string>& out) { return directory_tree.collect(directory, out); }
+    static string formatDirectory(const vector<string>& subdirs, const vector<long long>& counts,
+                                  const vector<string>& files_here);
+    static string formatPaths(const vector<string>& paths);
+
+    // Deletes every file below a directory. deleteUnder() returns how many,
+    // or -1 if the directory does not exist.
+    string deleteDirectory(const string& directory);
+    long long deleteUnder(const string& directory);
+    static string formatDeleted(const string& directory, long long deleted);
+
+    // Deletes one file, or gives it a new name, keeping its history.
+    string deleteFile(const string& filename);
+    string rename(const string& oldName, const string& newName);
+
+    // Moves a file out of this FileSystem, or into it under a new name, for
+    // a RENAME between shards. The file keeps its history, and `places` carries
+    // its (tag, version) entries in earlier checkpoints across, since its ID
+    // changes. attachFile() fails if the name is taken.
+    File* detachFile(const string& filename, vector<pair<string, int>>& places);
+    bool attachFile(File* file, const string& newName, const vector<pair<string, int>>& places);
+    bool hasFile(const string& filename) { return files.containsKey(filename); }
+
+    // Sorted listing of the names in [from, to) (to unbounded when `bounded`
+    // is false), or of the names matching a glob, at most `limit` at a time.
+    string listNames(const string& from, const string& to, bool bounded, size_t limit);
+    string globNames(const string& pattern, size_t limit);
+    void collectNames(const string& from, const string& to, bool bounded, size_t count, vector<string>& out);
+    void collectGlob(const string& pattern, size_t count, vector<string>& out);
+    static string formatNamePage(const vector<string>& names, size_t limit, bool glob);
+
+    // Point-in-time access through each file's time index.
+    string readAt(const string& filename, time_t when);
+    string rollbackAt(const string& filename, time_t when);
+
+    // READ (when < 0) or READ_AT with an explicit result: true with the
+    // stored content in `out`, or false with the error message.
+    bool readContent(const string& filename, time_t when, string& out);
+
+    // Unified diff between two versions of a file.
+    string diff(const string& filename, int fromVersion, int toVersion);
+
+    // Three-way merge of two versions into a new version with both as parents.
+    string merge(const string& filename, int oursVersion, int theirsVersion);
+
+    // Each line of a version (the active one by default) with the ID of the
+    // version that introduced it.
+    string blame(const string& filename, int versionId = -1);
+
+    // Lists every (file, version) whose content contains the literal pattern,
+    // or matches it as an ECMAScript regex.
+    string grep(const string& pattern, bool as_regex);
+    string grepMatches(const string& pattern, bool as_regex, vector<string>& matches, size_t& checked,
+                       size_t& skipped);
+    static string formatGrep(const vector<string>& matches, size_t checked, size_t skipped);
+
+    // System-wide analytics. topFiles() appends the top `num` files (all
+    // when -1) by modification time or by version count.
+    string recentFiles(int num);
+    string biggestTrees(int num);
+    void topFiles(bool by_recent, int num, vector<RankedFile>& out);
+    static string formatRecentFiles(int num, const vector<RankedFile>& top);
+    static string formatBiggestTrees(int num, const vector<RankedFile>& top);
+
+    // Bulk load: creates/updates and snapshots many files under one lock.
+    // Adds the number of files and bytes loaded to the counters.
+    void importFiles(vector<ImportedFile>& batch, const string& message, long long& imported_out,
+                     long long& bytes_out);
+
+    // Picks the active version of every file, or the version current at
+    // `as_of` when it is not -1. Files that did not exist yet are left out.
+    // Saved versions point at their blob through descriptors added to `fds`,
+    // which the caller closes; only unsaved content is copied.
+    void collectForExport(time_t as_of, vector<ExportedFile>& out, vector<int>& fds);
+
+    // System-wide checkpoints across all files.
+    // The optional pointers receive the counts that the message reports.
+    string snapshotAll(const string& tag, int* changed_out = nullptr, int* snapshotted_out = nullptr);
+    string rollbackAll(const string& tag, int* restored_out = nullptr);
+
+    // Garbage collection of old versions.
+    string gcRun();
+    string gcStatus();
+    string gcSetPolicy(int keepLast, int dailyDays, int intervalSeconds);
+
+    // Persistence to a pack store directory. Files are opened as stubs and
+    // their version trees are loaded the first time a command needs them.
+    string openStore(const string& directory);
+    string save();
+    PackStore* getStore() { return store; }
+
+    // Makes the destructor skip freeing every file and version, for a process
+    // that is about to exit. The store is still closed properly.
+    void setFastExit() { fast_exit = true; }
+
+    // Caps the memory held by loaded version trees. Only takes effect with
+    // a store, which evicted trees are read back from.
+    void setResidentLimit(long long bytes) { resident_limit = bytes; }
+
+    // Memory accounting (MEM). The budget caps the bytes of loaded trees;
+    // writes that would exceed it are refused. Shards share one budget,
+    // which must be handed over before any file is added.
+    void shareBudget(MemoryBudget* shared);
+    string setMemoryBudget(long long bytes);
+    string memoryReport();
+    string fileMemoryReport(const string& filename);
+    void collectMemory(MemoryUsage& usage, long long& file_count, long long& loaded, long long& table_bytes);
+    static string formatMemory(const MemoryUsage& usage, long long file_count, long long loaded,
+                               long long table_bytes, const MemoryBudget& budget);
+
+    // Self-measurement report, as plain text or JSON.
+    string statsReport(bool as_json);
+
+    // Lock held by the command dispatcher while a command runs.
+    mutex& commandMutex() { return command_lock; }
+};
+
+//==============================================================================
+// METHOD IMPLEMENTATIONS: File
+//==============================================================================
+
+File::File(const string& name) : filename(name), version_map(16), blame_cache(16) {
+    file_id = -1;
+    total_versions = 1;
+    checkpoint_dirty = false;
+    search_pending = false;
+    lazy_store = nullptr;
+    stub_active_id = 0;
+    stub_live_versions = 0;
+    resident = nullptr;
+    resident_prev = nullptr;
+    resident_next = nullptr;
+    in_resident_list = false;
+    resident_bytes = 0;
+    slack_free = false;
+    root = new VersionNode(0, "", nullptr);
+    active_version = root;
+    // The root version is always an initial snapshot.
+    root->message = "Initial version";
+    root->snapshot_timestamp = time(nullptr);
+    last_modification_time = root->snapshot_timestamp;
+    version_map.put(0, root);
+    time_index.append(root->created_timestamp, 0);
+    recount();
+}
+
+File::~File() {
+    deleteTree(root);
+    for (vector<int>* origins : blame_cache.getValues()) delete origins;
+}
+
+int File::prune(const RetentionPolicy& policy, time_t now, long long& bytes_freed) {
+    TraceSpan span("File::prune");
+    ensureLoaded();
+    // Collect every version, parents before children.
+    vector<VersionNode*> order;
+    vector<VersionNode*> stack = {root};
+    while (!stack.empty()) {
+        VersionNode* node = stack.back();
+        stack.pop_back();
+        order.push_back(node);
+        for (VersionNode* child = node->first_child; child != nullptr; child = child->next_sibling) {
+            stack.push_back(child);
+        }
+    }
+
+    // Decide what to keep.
+    HashMap<int, bool> keep((int)order.size() * 2);
+    keep.put(root->version_id, true);
+    keep.put(active_version->version_id, true);
+    for (int id : pinned_versions) keep.put(id, true);
+    MaxHeap<SnapshotRank> snapshots;
+    for (VersionNode* node : order) {
+        if (node->isSnapshot()) snapshots.insert({node->snapshot_timestamp, node->version_id, node});
+    }
+    int ranked = 0;
+    int last_day = -1;
+    time_t daily_cutoff = now - (time_t)policy.daily_days * 86400;
+    while (!snapshots.isEmpty()) {
+        SnapshotRank snapshot = snapshots.extractMax();
+        if (ranked++ < policy.keep_last) keep.put(snapshot.version_id, true);
+        if (snapshot.timestamp < daily_cutoff) continue;
+        tm local;
+        localtime_r(&snapshot.timestamp, &local); // Files are pruned on several threads.
+        int day = local.tm_year * 1000 + local.tm_yday;
+        if (day != last_day) keep.put(snapshot.version_id, true); // Newest of its day.
+        last_day = day;
+    }
+    if (keep.size() == (int)order.size()) return 0;
+
+    // Each version's nearest kept ancestor-or-self, before any links change.
+    HashMap<int, VersionNode*> target((int)order.size() * 2);
+    for (VersionNode* node : order) {
+        bool kept = keep.containsKey(node->version_id);
+        target.put(node->version_id, kept ? node : target.get(node->parent->version_id));
+    }
+
+    // Relink the survivors, keeping sibling order.
+    for (VersionNode* node : order) {
+        if (keep.containsKey(node->version_id)) node->first_child = nullptr;
+    }
+    for (VersionNode* node : order) {
+        if (node == root || !keep.containsKey(node->version_id)) continue;
+        node->parent = target.get(node->parent->version_id);
+        node->parent->addChild(node);
+        if (node->merge_parent != nullptr) {
+            VersionNode* merged = target.get(node->merge_parent->version_id);
+            node->merge_parent = merged == node->parent ? nullptr : merged;
+        }
+    }
+
+    // Free the rest.
+    int freed = 0;
+    for (VersionNode* node : order) {
+        if (keep.containsKey(node->version_id)) continue;
+        bytes_freed += (long long)node->content.capacity();
+        if (node->blob_id != -1) released_blobs.push_back(node->blob_id);
+        version_map.remove(node->version_id);
+        delete node;
+        freed++;
+    }
+    time_index.removeIf([this](int id) { return !version_map.containsKey(id); });
+    // Cached origins may name freed versions; they are rebuilt on demand.
+    for (vector<int>* origins : blame_cache.getValues()) delete origins;
+    blame_cache.clear();
+    recount();
+    return freed;
+}
+
+void File::deleteTree(VersionNode* node) {
+    // Iterative, so a long chain of versions cannot overflow the stack.
+    vector<VersionNode*> stack;
+    if (node != nullptr) stack.push_back(node);
+    while (!stack.empty()) {
+        VersionNode* current = stack.back();
+        stack.pop_back();
+        for (VersionNode* child = current->first_child; child != nullptr; child = child->next_sibling) {
+            stack.push_back(child);
+        }
+        delete current;
+    }
+}
+
+string File::read() const {
+    ensureLoaded();
+    return active_version->content;
+}
+
+void File::insert(const string& content_to_add) {
+    TraceSpan span("File::insert");
+    ensureLoaded();
+    // Core versioning logic: if the current version is a snapshot (or has
+    // children), create a new child version. Otherwise, modify the current
+    // (mutable) version in place.
+    if (!active_version->isMutable()) {
+        addVersion(active_version, active_version->content + content_to_add);
+    } else {
+        releaseActiveBlob();
+        long long before = string_heap_bytes(active_version->content);
+        active_version->content += content_to_add;
+        account(string_heap_bytes(active_version->content) - before);
+    }
+    last_modification_time = time(nullptr);
+}
+
+void File::update(string new_content) {
+    TraceSpan span("File::update");
+    ensureLoaded();
+    // Versioning logic is identical to insert().
+    if (!active_version->isMutable()) {
+        addVersion(active_version, move(new_content));
+    } else {
+        releaseActiveBlob();
+        long long before = string_heap_bytes(active_version->content);
+        active_version->content = move(new_content);
+        account(string_heap_bytes(active_version->content) - before);
+    }
+    last_modification_time = time(nullptr);
+}
+
+bool File::snapshot(const string& message) {
+    TraceSpan span("File::snapshot");
+    ensureLoaded();
+    // Prevent creating a snapshot of an already snapshotted version.
+    if (active_version->isSnapshot()) return false;
+    long long before = active_version->message.heapBytes();
+    active_version->message = message;
+    account(active_version->message.heapBytes() - before);
+    active_version->snapshot_timestamp = time(nullptr);
+    last_modification_time = time(nullptr); // Snapshotting counts as a modification.
+    return true;
+}
+
+bool File::rollback(int versionId) {
+    TraceSpan span("File::rollback");
+    ensureLoaded();
+    // Case 1: Rollback to parent version.
+    if (versionId == -1) {
+        if (active_version->parent != nullptr) {
+            active_version = active_version->parent;
+            return true;
+        }
+        return false; // Already at the root, cannot go back further.
+    // Case 2: Rollback to a specific version ID.
+    } else {
+        // Prevent a pointless rollback to the already active version.
+        if (versionId == active_version->version_id) return false;
+
+        try {
+            // Use the hash map for a fast O(1) lookup.
+            VersionNode* target_version = version_map.get(versionId);
+            active_version = target_version;
+            return true;
+        } catch (const runtime_error& e) {
+            return false; // Version ID not found in the map.
+        }
+    }
+}
+
+string File::history() const {
+    TraceSpan span("File::history");
+    ensureLoaded();
+    string result = "";
     VersionNode* current = active_version;
     vector<string> history_entries;
     // Traverse up the tree from the active node to the root.
     while (current != nullptr) {
         if (current->isSnapshot()) {
             char time_buf[100];
-            strftime(time_buf, sizeof(time_buf), "%c", localtime(&current->snapshot_timestamp));
+            tm local;
+            localtime_r(&current->snapshot_timestamp, &local); // Shards format on several threads.
+            strftime(time_buf, sizeof(time_buf), "%c", &local);
             string entry = "Version: " + to_string(current->version_id)
                               + ", Timestamp: " + time_buf
-                              + ", Message: " + current->message;
+                              + ", Message: " + current->message.str();
+            if (current->merge_parent != nullptr) {
+                entry += " (merged with version " + to_string(current->merge_parent->version_id) + ")";
+            }
             history_entries.push_back(entry);
         }
-        current = current->parent;
+        current = current->parent;
+    }
+    // Reverse the list to display in chronological order (root first).
+    custom_reverse(history_entries);
+    for (const auto& entry : history_entries) {
+        result += entry + "\n";
+    }
+    return result;
+}
+
+const VersionNode* File::versionAt(time_t when) const {
+    ensureLoaded();
+    int version_id = time_index.lookup(when);
+    if (version_id == -1) return nullptr;
+    return version_map.get(version_id);
+}
+
+const VersionNode* File::getVersion(int versionId) const {
+    ensureLoaded();
+    if (!version_map.containsKey(versionId)) return nullptr;
+    return version_map.get(versionId);
+}
+
+const VersionNode* File::commonAncestor(int firstId, int secondId) const {
+    TraceSpan span("File::commonAncestor");
+    ensureLoaded();
+    // Mark everything reachable from the first version, then search from the
+    // second. IDs grow with creation time, so the largest shared ID is the
+    // lowest common ancestor.
+    HashMap<int, bool> reachable;
+    vector<VersionNode*> stack = {version_map.get(firstId)};
+    while (!stack.empty()) {
+        VersionNode* node = stack.back();
+        stack.pop_back();
+        if (node == nullptr || reachable.containsKey(node->version_id)) continue;
+        reachable.put(node->version_id, true);
+        stack.push_back(node->parent);
+        stack.push_back(node->merge_parent);
+    }
+    const VersionNode* best = nullptr;
+    HashMap<int, bool> visited;
+    stack.push_back(version_map.get(secondId));
+    while (!stack.empty()) {
+        VersionNode* node = stack.back();
+        stack.pop_back();
+        if (node == nullptr || visited.containsKey(node->version_id)) continue;
+        visited.put(node->version_id, true);
+        if (reachable.containsKey(node->version_id)) {
+            // Ancestors of a shared version are older; no need to go further.
+            if (best == nullptr || node->version_id > best->version_id) best = node;
+            continue;
+        }
+        stack.push_back(node->parent);
+        stack.push_back(node->merge_parent);
+    }
+    return best;
+}
+
+bool File::lineOrigins(int versionId, vector<int>& origins) {
+    TraceSpan span("File::lineOrigins");
+    ensureLoaded();
+    if (!version_map.containsKey(versionId)) return false;
+    // Walk up to the nearest version whose origins are cached (or past the
+    // root), then work back down, caching each snapshot on the way. Snapshot
+    // content never changes, so its cached origins stay valid.
+    vector<VersionNode*> chain;
+    VersionNode* node = version_map.get(versionId);
+    while (node != nullptr && !blame_cache.containsKey(node->version_id)) {
+        chain.push_back(node);
+        node = node->parent;
+    }
+    vector<int> current;
+    if (node != nullptr) current = *blame_cache.get(node->version_id);
+    for (size_t i = chain.size(); i-- > 0;) {
+        vector<int> next;
+        if (chain[i]->parent == nullptr) {
+            next.assign(split_lines(chain[i]->content).size(), chain[i]->version_id);
+        } else {
+            deriveLineOrigins(chain[i], current, next);
+        }
+        current.swap(next);
+        if (!chain[i]->isSnapshot()) continue;
+        vector<int>* cached = new vector<int>(current);
+        long long before = blame_cache.memoryBytes();
+        blame_cache.put(chain[i]->version_id, cached);
+        account(blame_cache.memoryBytes() - before + (long long)(sizeof(vector<int>) + cached->capacity() * sizeof(int)));
+    }
+    origins.swap(current);
+    return true;
+}
+
+void File::deriveLineOrigins(const VersionNode* node, const vector<int>& parent_origins, vector<int>& origins) {
+    const string& before = node->parent->content;
+    const string& after = node->content;
+    // Fast path for appends: the parent's lines are unchanged, only the
+    // new lines need attributing.
+    bool appended = after.size() >= before.size()
+                    && (before.empty() || before.back() == '\n')
+                    && memcmp(after.data(), before.data(), before.size()) == 0;
+    if (appended && node->merge_parent == nullptr) {
+        origins = parent_origins;
+        string tail = after.substr(before.size());
+        origins.resize(parent_origins.size() + split_lines(tail).size(), node->version_id);
+        return;
+    }
+
+    vector<string_view> before_lines = split_lines(before);
+    vector<string_view> after_lines = split_lines(after);
+    origins.assign(after_lines.size(), -1);
+    for (const EditRun& run : diff_lines(before_lines, after_lines)) {
+        if (run.kind != EDIT_EQUAL) continue;
+        for (int k = 0; k < run.length; ++k) origins[run.b_start + k] = parent_origins[run.a_start + k];
+    }
+
+    // Lines the first parent lacks may come from the merged branch.
+    if (node->merge_parent != nullptr) {
+        vector<int> merge_origins;
+        lineOrigins(node->merge_parent->version_id, merge_origins);
+        vector<string_view> merge_lines = split_lines(node->merge_parent->content);
+        for (const EditRun& run : diff_lines(merge_lines, after_lines)) {
+            if (run.kind != EDIT_EQUAL) continue;
+            for (int k = 0; k < run.length; ++k) {
+                if (origins[run.b_start + k] == -1) origins[run.b_start + k] = merge_origins[run.a_start + k];
+            }
+        }
+    }
+    for (int& origin : origins) {
+        if (origin == -1) origin = node->version_id;
+    }
+}
+
+int File::addMerge(int oursId, int theirsId, string content) {
+    TraceSpan span("File::addMerge");
+    ensureLoaded();
+    VersionNode* new_version = addVersion(version_map.get(oursId), move(content));
+    new_version->merge_parent = version_map.get(theirsId);
+    last_modification_time = time(nullptr);
+    return new_version->version_id;
+}
+
+VersionNode* File::addVersion(VersionNode* parent, string content) {
+    long long before = indexBytes();
+    VersionNode* node = new VersionNode(total_versions, move(content), parent);
+    parent->addChild(node);
+    version_map.put(total_versions, node);
+    time_index.append(node->created_timestamp, total_versions);
+    total_versions++;
+    active_version = node;
+    account(nodeBytes(node) + indexBytes() - before);
+    return node;
+}
+
+MemoryUsage File::memoryUsage() const {
+    MemoryUsage usage;
+    usage.file_objects = (long long)sizeof(File) + string_heap_bytes(filename)
+                         + (long long)(pinned_versions.capacity() * sizeof(int))
+                         + (long long)(released_blobs.capacity() * sizeof(long long));
+    usage.version_maps = version_map.memoryBytes();
+    usage.time_indexes = time_index.memoryBytes();
+    usage.blame_caches = blame_cache.memoryBytes();
+    for (vector<int>* origins : blame_cache.getValues()) {
+        usage.blame_caches += (long long)(sizeof(vector<int>) + origins->capacity() * sizeof(int));
+    }
+    if (!isLoaded()) {
+        usage.stubs = string_heap_bytes(lazy_tree);
+        return usage;
+    }
+    for (VersionNode* node : version_map.getValues()) {
+        usage.versions++;
+        usage.nodes += (long long)sizeof(VersionNode);
+        usage.contents += string_heap_bytes(node->content);
+        usage.messages += node->message.heapBytes();
+    }
+    return usage;
+}
+
+long long File::loadedBytes() const {
+    if (!isLoaded()) return 0;
+    MemoryUsage usage = memoryUsage();
+    return usage.total() - usage.file_objects;
+}
+
+long long File::releaseSlack() {
+    if (!isLoaded() || slack_free) return 0;
+    long long before = resident_bytes;
+    for (VersionNode* node : version_map.getValues()) {
+        node->content.shrink_to_fit();
+    }
+    time_index.shrink();
+    recount();
+    slack_free = true;
+    return before - resident_bytes;
+}
+
+string File::getName() const { return filename; }
+int File::getVersionCount() const { return total_versions; }
+int File::getLiveVersionCount() const { return isLoaded() ? version_map.size() : stub_live_versions; }
+int File::getActiveVersionId() const { return isLoaded() ? active_version->version_id : stub_active_id; }
+time_t File::getLastModificationTime() const { return last_modification_time; }
+HashMapStats File::getVersionMapStats() const { return version_map.getStats(); }
+
+
+//==============================================================================
+// METHOD IMPLEMENTATIONS: FileSystem
+//==============================================================================
+
+FileSystem::FileSystem() : files(256), files_by_id(256) { // Initialize with a capacity of 256.
+    next_file_id = 0;
+    gc_cursor = 0;
+    gc_passes = 0;
+    gc_versions_freed = 0;
+    gc_bytes_freed = 0;
+    gc_max_pause_ns = 0;
+    gc_file_ns = 100000;
+    store = nullptr;
+    fast_exit = false;
+    resident_limit = 0;
+    budget = &own_budget;
+    resident_set.budget = budget;
+    collector.start([this] { return collectGarbageSlice(); });
+    reclaimer.start();
+}
+
+FileSystem::~FileSystem() {
+    collector.stop(); // Before the files it prunes go away.
+    if (fast_exit) {
+        // The OS takes back the memory at once; freeing millions of nodes
+        // one by one would only delay the exit.
+        reclaimer.abandon();
+        closeStore();
+        return;
+    }
+    reclaimer.stop(); // Frees the files deleted so far.
+    // Clean up dynamically allocated File objects, many at a time.
+    vector<File*> all_files = files.getValues();
+    bulk_scheduler().parallelFor(all_files.size(), 64, [&all_files](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i) delete all_files[i];
+    });
+    closeStore();
+}
+
+void FileSystem::updateAnalytics(File* file) {
+    recent_files_heap.set(file->getId(), file->getLastModificationTime());
+    biggest_trees_heap.set(file->getId(), (long long)file->getLiveVersionCount());
+}
+
+void FileSystem::markDirty(File* file) {
+    if (file->isCheckpointDirty()) return;
+    file->setCheckpointDirty(true);
+    dirty_files.push_back(file->getId());
+}
+
+void FileSystem::indexActiveVersion(File* file, size_t from) {
+    if (file->isSearchPending()) {
+        indexAllVersions(file); // Its older versions were never indexed.
+        return;
+    }
+    const VersionNode* version = file->getVersion(file->getActiveVersionId());
+    // Content replaced in place would leave stale postings behind.
+    if (from == 0) search_index.removeDocument(file->getId(), version->version_id);
+    int doc = search_index.documentFor(file->getId(), version->version_id);
+    // Back up two bytes so trigrams spanning the old end are indexed too.
+    search_index.addText(doc, version->content, from >= 2 ? from - 2 : 0);
+}
+
+void FileSystem::addFile(File* file) {
+    file->setId(next_file_id++);
+    files.put(file->getName(), file);
+    files_by_id.put(file->getId(), file);
+    directory_tree.add(file->getName());
+    name_index.insert(file->getName());
+    file->setResidentSet(&resident_set);
+    updateAnalytics(file);
+}
+
+void FileSystem::unlinkFile(File* file) {
+    files.remove(file->getName());
+    files_by_id.remove(file->getId());
+    directory_tree.remove(file->getName());
+    name_index.erase(file->getName());
+    recent_files_heap.remove(file->getId());
+    biggest_trees_heap.remove(file->getId());
+    file->setResidentSet(nullptr); // The reclaimer frees it on another thread.
+    search_index.removeFile(file->getId());
+    // Dirty-set, checkpoint and GC entries hold the ID and are skipped once
+    // it no longer resolves.
+}
+
+void FileSystem::removeFile(const string& filename) {
+    File* file = files.get(filename);
+    unlinkFile(file);
+    reclaimer.enqueue(file);
+}
+
+long long FileSystem::indexAllVersions(File* file) {
+    file->setSearchPending(false);
+    long long indexed = 0;
+    for (int id = 0; id < file->getVersionCount(); ++id) {
+        const VersionNode* version = file->getVersion(id);
+        if (version == nullptr) continue;
+        search_index.addText(search_index.documentFor(file->getId(), id), version->content, 0);
+        indexed++;
+    }
+    return indexed;
+}
+
+void FileSystem::indexPendingFiles() {
+    for (int id : unindexed_files) {
+        File* file = fileById(id);
+        if (file == nullptr || !file->isSearchPending()) continue;
+        indexAllVersions(file);
+        trimResident(); // Indexing loads every file; keep only what fits.
+    }
+    unindexed_files.clear();
+}
+
+File* FileSystem::lookup(const string& filename) {
+    File* file = files.get(filename);
+    resident_set.touch(file);
+    trimResident();
+    return file;
+}
+
+void FileSystem::trimResident(long long incoming) {
+    if (store == nullptr) return;
+    File* file = resident_set.coldest();
+    while (file != nullptr && file != resident_set.hottest()
+           && ((resident_limit > 0 && resident_set.bytes > resident_limit) || budget->exceededBy(incoming))) {
+        File* newer = file->newerResident();
+        long long bytes = 0;
+        file->persist(*store, bytes);
+        file->evict(*store);
+        file = newer;
+    }
+}
+
+string FileSystem::admitWrite(long long incoming) {
+    if (!budget->exceededBy(incoming)) return "";
+    for (File* file = resident_set.coldest(); file != nullptr && budget->exceededBy(incoming);
+         file = file->newerResident()) {
+        budget->slack_freed += file->releaseSlack();
+    }
+    trimResident(incoming);
+    if (!budget->exceededBy(incoming)) return "";
+    budget->refused++;
+    return "Error: Memory budget exceeded (" + to_string(budget->used.load()) + " of "
+           + to_string(budget->limit.load()) + " bytes in use).\n";
+}
+
+string FileSystem::create(const string& filename) {
+    TraceSpan span("FileSystem::create");
+    ScopedLatency timer(stats.command_latency[CMD_CREATE]);
+    if (files.containsKey(filename)) {
+        return "Error: File '" + filename + "' already exists.\n";
+    }
+    string refused = admitWrite((long long)(sizeof(File) + sizeof(VersionNode)));
+    if (!refused.empty()) return refused;
+    File* file = new File(filename);
+    addFile(file);
+    stats.versions_created++; // The root version.
+    markDirty(file);
+    return "File '" + filename + "' created.\n";
+}
+
+string FileSystem::read(const string& filename) {
+    string out;
+    readContent(filename, -1, out);
+    return out;
+}
+
+string FileSystem::insert(const string& filename, const string& content) {
+    TraceSpan span("FileSystem::insert");
+    ScopedLatency timer(stats.command_latency[CMD_INSERT]);
+    if (!files.containsKey(filename)) return "Error: File not found.\n";
+    File* file = lookup(filename);
+    const VersionNode* active = file->getVersion(file->getActiveVersionId());
+    size_t size_before = active->content.size();
+    // Appending to a frozen version copies its content into a new version.
+    string refused = admitWrite((long long)(content.size() + (active->isMutable() ? 0 : size_before)));
+    if (!refused.empty()) return refused;
+    int versions_before = file->getVersionCount();
+    file->insert(content);
+    markDirty(file);
+    // An in-place append only adds trigrams after the old end.
+    indexActiveVersion(file, file->getVersionCount() > versions_before ? 0 : size_before);
+    stats.bytes_stored += content.size();
+    stats.versions_created += file->getVersionCount() - versions_before;
+    updateAnalytics(file);
+    return "Content inserted into '" + filename + "'.\n";
+}
+
+string FileSystem::update(const string& filename, const string& content) {
+    TraceSpan span("FileSystem::update");
+    ScopedLatency timer(stats.command_latency[CMD_UPDATE]);
+    if (!files.containsKey(filename)) return "Error: File not found.\n";
+    File* file = lookup(filename);
+    string refused = admitWrite((long long)content.size());
+    if (!refused.empty()) return refused;
+    int versions_before = file->getVersionCount();
+    file->update(content);
+    markDirty(file);
+    indexActiveVersion(file, 0);
+    stats.bytes_stored += content.size();
+    stats.versions_created += file->getVersionCount() - versions_before;
+    updateAnalytics(file);
+    return "Content updated in '" + filename + "'.\n";
+}
+
+string FileSystem::snapshot(const string& filename, const string& message) {
+    TraceSpan span("FileSystem::snapshot");
+    ScopedLatency timer(stats.command_latency[CMD_SNAPSHOT]);
+    if (!files.containsKey(filename)) return "Error: File not found.\n";
+    File* file = lookup(filename);
+    string refused = admitWrite((long long)message.size());
+    if (!refused.empty()) return refused;
+    if (!file->snapshot(message)) {
+        return "Error: A snapshot already exists for the current version. "
+               "Modify the file to create a new version before snapshotting.\n";
+    }
+    markDirty(file);
+    updateAnalytics(file); // A snapshot might update last modification time.
+    return "Snapshot created for '" + filename + "'.\n";
+}
+
+string FileSystem::rollback(const string& filename, int versionId) {
+    TraceSpan span("FileSystem::rollback");
+    ScopedLatency timer(stats.command_latency[CMD_ROLLBACK]);
+    if (!files.containsKey(filename)) return "Error: File not found.\n";
+    File* file = lookup(filename);
+    if (versionId != -1 && versionId == file->getActiveVersionId()) {
+        return "Error: Cannot rollback to the version that is already active.\n";
+    }
+    if (file->rollback(versionId)) {
+        markDirty(file);
+        return "Rollback successful for '" + filename + "'.\n";
+    }
+    return "Error: Rollback failed. Invalid version or already at root.\n";
+}
+
+string FileSystem::history(const string& filename) {
+    TraceSpan span("FileSystem::history");
+    ScopedLatency timer(stats.command_latency[CMD_HISTORY]);
+    if (!files.containsKey(filename)) return "Error: File not found.\n";
+    return lookup(filename)->history();
+}
+
+string FileSystem::list(const string& directory, bool recursive) {
+    TraceSpan span("FileSystem::list");
+    ScopedLatency timer(stats.command_latency[CMD_LS]);
+    if (recursive) {
+        vector<string> paths;
+        if (!collectPaths(directory, paths)) return "Error: Directory '" + directory + "' not found.\n";
+        return formatPaths(paths);
+    }
+    vector<string> subdirs, files_here;
+    vector<long long> counts;
+    if (!directoryEntries(directory, subdirs, counts, files_here)) {
+        return "Error: Directory '" + directory + "' not found.\n";
+    }
+    return formatDirectory(subdirs, counts, files_here);
+}
+
+string FileSystem::formatPaths(const vector<string>& paths) {
+    string result = "";
+    for (const string& path : paths) result += path + "\n";
+    return result.empty() ? "No files.\n" : result;
+}
+
+string FileSystem::formatDirectory(const vector<string>& subdirs, const vector<long long>& counts,
+                                   const vector<string>& files_here) {
+    string result = "";
+    for (size_t i = 0; i < subdirs.size(); ++i) {
+        result += subdirs[i] + "/ (" + to_string(counts[i]) + (counts[i] == 1 ? " file)\n" : " files)\n");
+    }
+    for (const string& name : files_here) result += name + "\n";
+    return result.empty() ? "No files.\n" : result;
+}
+
+string FileSystem::deleteDirectory(const string& directory) {
+    TraceSpan span("FileSystem::deleteDirectory");
+    ScopedLatency timer(stats.command_latency[CMD_DELETE]);
+    if (directory.empty() || directory == "/") return "Error: Refusing to delete the root directory.\n";
+    long long deleted = deleteUnder(directory);
+    if (deleted < 0) return "Error: Directory '" + directory + "' not found.\n";
+    return formatDeleted(directory, deleted);
+}
+
+long long FileSystem::deleteUnder(const string& directory) {
+    vector<string> doomed;
+    if (!directory_tree.collect(directory, doomed)) return -1;
+    for (const string& name : doomed) removeFile(name);
+    return (long long)doomed.size();
+}
+
+string FileSystem::formatDeleted(const string& directory, long long deleted) {
+    return "Deleted " + to_string(deleted) + (deleted == 1 ? " file" : " files") + " under '" + directory + "'.\n";
+}
+
+string FileSystem::deleteFile(const string& filename) {
+    TraceSpan span("FileSystem::deleteFile");
+    ScopedLatency timer(stats.command_latency[CMD_DELETE]);
+    if (!files.containsKey(filename)) return "Error: File not found.\n";
+    removeFile(filename);
+    return "File '" + filename + "' deleted.\n";
+}
+
+string FileSystem::rename(const string& oldName, const string& newName) {
+    TraceSpan span("FileSystem::rename");
+    ScopedLatency timer(stats.command_latency[CMD_RENAME]);
+    if (!files.containsKey(oldName)) return "Error: File not found.\n";
+    if (files.containsKey(newName)) return "Error: File '" + newName + "' already exists.\n";
+    // Everything else refers to the file by ID, so only the name indexes change.
+    File* file = files.get(oldName);
+    files.remove(oldName);
+    directory_tree.remove(oldName);
+    name_index.erase(oldName);
+    file->setName(newName);
+    files.put(newName, file);
+    directory_tree.add(newName);
+    name_index.insert(newName);
+    return "File '" + oldName + "' renamed to '" + newName + "'.\n";
+}
+
+File* FileSystem::detachFile(const string& filename, vector<pair<string, int>>& places) {
+    TraceSpan span("FileSystem::detachFile");
+    if (!files.containsKey(filename)) return nullptr;
+    File* file = files.get(filename);
+    // Checkpoints run oldest first and each one only lists what changed, so
+    // one pass finds every tag at which the file took a new version.
+    int id = file->getId();
+    for (const GlobalCheckpoint& checkpoint : checkpoints) {
+        for (size_t i = 0; i < checkpoint.changed_files.size(); ++i) {
+            if (checkpoint.changed_files[i] == id) places.push_back({checkpoint.tag, checkpoint.version_ids[i]});
+        }
+    }
+    unlinkFile(file);
+    file->load(); // The contents must come along.
+    if (file->isSearchPending()) file->setSearchPending(false); // Indexed again where it is attached.
+    // Its saved contents belong to this FileSystem's store.
+    vector<long long> blobs;
+    file->releaseAllBlobs(blobs);
+    reclaimer.addReleasedBlobs(blobs);
+    file->setCheckpointDirty(false);
+    return file;
+}
+
+bool FileSystem::attachFile(File* file, const string& newName, const vector<pair<string, int>>& places) {
+    TraceSpan span("FileSystem::attachFile");
+    if (files.containsKey(newName)) return false;
+    file->setName(newName);
+    addFile(file);
+    // Sharded SNAPSHOT_ALL gives every shard the same tags, so the entries
+    // land in the matching checkpoints here under the file's new ID.
+    for (const pair<string, int>& place : places) {
+        if (!checkpoint_by_tag.containsKey(place.first)) continue;
+        GlobalCheckpoint& checkpoint = checkpoints[checkpoint_by_tag.get(place.first)];
+        checkpoint.changed_files.push_back(file->getId());
+        checkpoint.version_ids.push_back(place.second);
+    }
+    indexAllVersions(file);
+    markDirty(file);
+    return true;
+}
+
+string FileSystem::listNames(const string& from, const string& to, bool bounded, size_t limit) {
+    TraceSpan span("FileSystem::listNames");
+    ScopedLatency timer(stats.command_latency[CMD_LIST]);
+    vector<string> names;
+    collectNames(from, to, bounded, limit == (size_t)-1 ? limit : limit + 1, names);
+    return formatNamePage(names, limit, false);
+}
+
+string FileSystem::globNames(const string& pattern, size_t limit) {
+    TraceSpan span("FileSystem::globNames");
+    ScopedLatency timer(stats.command_latency[CMD_LIST]);
+    vector<string> names;
+    collectGlob(pattern, limit == (size_t)-1 ? limit : limit + 1, names);
+    return formatNamePage(names, limit, true);
+}
+
+void FileSystem::collectNames(const string& from, const string& to, bool bounded, size_t count, vector<string>& out) {
+    name_index.scan(from, [&](const string& name) {
+        if (out.size() == count || (bounded && !(name < to))) return false;
+        out.push_back(name);
+        return true;
+    });
+}
+
+void FileSystem::collectGlob(const string& pattern, size_t count, vector<string>& out) {
+    // Only names starting with the literal prefix can match.
+    string prefix = pattern.substr(0, pattern.find_first_of("*?["));
+    name_index.scan(prefix, [&](const string& name) {
+        if (out.size() == count || name.compare(0, prefix.size(), prefix) != 0) return false;
+        if (glob_match(pattern, name)) out.push_back(name);
+        return true;
+    });
+}
+
+string FileSystem::formatNamePage(const vector<string>& names, size_t limit, bool glob) {
+    if (names.empty()) return glob ? "No matches.\n" : "No files.\n";
+    string result = "";
+    for (size_t i = 0; i < names.size() && i < limit; ++i) result += names[i] + "\n";
+    if (names.size() > limit) {
+        result += (glob ? "Next match is '" : "Next page starts at '") + names[limit] + "'.\n";
+    }
+    return result;
+}
+
+string FileSystem::readAt(const string& filename, time_t when) {
+    string out;
+    readContent(filename, when, out);
+    return out;
+}
+
+bool FileSystem::readContent(const string& filename, time_t when, string& out) {
+    TraceSpan span(when < 0 ? "FileSystem::read" : "FileSystem::readAt");
+    ScopedLatency timer(stats.command_latency[when < 0 ? CMD_READ : CMD_READ_AT]);
+    if (!files.containsKey(filename)) {
+        out = "Error: File not found.";
+        return false;
+    }
+    if (when < 0) {
+        out = lookup(filename)->read();
+        return true;
+    }
+    const VersionNode* version = lookup(filename)->versionAt(when);
+    if (version == nullptr) {
+        out = "Error: No version of the file existed at that time.";
+        return false;
+    }
+    out = version->content;
+    return true;
+}
+
+string FileSystem::rollbackAt(const string& filename, time_t when) {
+    TraceSpan span("FileSystem::rollbackAt");
+    ScopedLatency timer(stats.command_latency[CMD_ROLLBACK_AT]);
+    if (!files.containsKey(filename)) return "Error: File not found.\n";
+    File* file = lookup(filename);
+    const VersionNode* version = file->versionAt(when);
+    if (version == nullptr) return "Error: No version of the file existed at that time.\n";
+    if (version->version_id == file->getActiveVersionId()) {
+        return "Error: Cannot rollback to the version that is already active.\n";
+    }
+    file->rollback(version->version_id);
+    markDirty(file);
+    return "Rollback successful for '" + filename + "' (version " + to_string(version->version_id) + ").\n";
+}
+
+void FileSystem::topFiles(bool by_recent, int num, vector<RankedFile>& out) {
+    int limit = (num == -1) ? files.size() : num;
+    // Reads the top entries without disturbing the heap.
+    vector<FileMetric> top;
+    (by_recent ? recent_files_heap : biggest_trees_heap).top(limit, top);
+    for (const FileMetric& metric : top) out.push_back({files_by_id.get(metric.file_id)->getName(), metric.value});
+}
+
+string FileSystem::recentFiles(int num) {
+    TraceSpan span("FileSystem::recentFiles");
+    ScopedLatency timer(stats.command_latency[CMD_RECENT_FILES]);
+    vector<RankedFile> top;
+    topFiles(true, num, top);
+    return formatRecentFiles(num, top);
+}
+
+string FileSystem::biggestTrees(int num) {
+    TraceSpan span("FileSystem::biggestTrees");
+    ScopedLatency timer(stats.command_latency[CMD_BIGGEST_TREES]);
+    vector<RankedFile> top;
+    topFiles(false, num, top);
+    return formatBiggestTrees(num, top);
+}
+
+string FileSystem::formatRecentFiles(int num, const vector<RankedFile>& top) {
+    string result = (num == -1) ? "--- Top All Recently Modified Files ---\n"
+                                : "--- Top " + to_string(num) + " Recently Modified Files ---\n";
+    for (const RankedFile& entry : top) {
+        time_t t = entry.value;
+        char time_buf[100];
+        tm local;
+        localtime_r(&t, &local); // Shards format on several threads.
+        strftime(time_buf, sizeof(time_buf), "%c", &local);
+        result += entry.filename + " (Modified: " + time_buf + ")\n";
+    }
+    return result;
+}
+
+string FileSystem::formatBiggestTrees(int num, const vector<RankedFile>& top) {
+    string result = (num == -1) ? "--- Top All Files by Version Count ---\n"
+                                : "--- Top " + to_string(num) + " Files by Version Count ---\n";
+    for (const RankedFile& entry : top) {
+        result += entry.filename + " (" + to_string(entry.value) + " versions)\n";
+    }
+    return result;
+}
+
+void FileSystem::importFiles(vector<ImportedFile>& batch, const string& message, long long& imported_out,
+                             long long& bytes_out) {
+    TraceSpan span("FileSystem::importFiles");
+    ScopedLatency timer(stats.command_latency[CMD_IMPORT]);
+    files.reserve(files.size() + (int)batch.size());
+    long long imported = 0;
+    long long bytes = 0;
+    for (ImportedFile& item : batch) {
+        if (!item.ok) continue;
+        if (!admitWrite((long long)item.content.size()).empty()) break; // The caller reports the rest as refused.
+        File* file;
+        if (files.containsKey(item.name)) {
+            file = lookup(item.name);
+        } else {
+            file = new File(item.name);
+            addFile(file);
+            stats.versions_created++; // The root version.
+        }
+        int versions_before = file->getVersionCount();
+        bytes += item.content.size();
+        file->update(move(item.content));
+        file->snapshot(message); // Always succeeds: update() leaves a mutable version.
+        markDirty(file);
+        indexActiveVersion(file, 0);
+        stats.versions_created += file->getVersionCount() - versions_before;
+        updateAnalytics(file);
+        imported++;
+    }
+    stats.bytes_stored += bytes;
+    imported_out += imported;
+    bytes_out += bytes;
+}
+
+string FileSystem::diff(const string& filename, int fromVersion, int toVersion) {
+    TraceSpan span("FileSystem::diff");
+    ScopedLatency timer(stats.command_latency[CMD_DIFF]);
+    if (!files.containsKey(filename)) return "Error: File not found.\n";
+    File* file = lookup(filename);
+    const VersionNode* from = file->getVersion(fromVersion);
+    const VersionNode* to = file->getVersion(toVersion);
+    if (from == nullptr || to == nullptr) return "Error: Version ID not found.\n";
+    // Same node, or a rollback that recreated identical content.
+    if (from == to || from->content == to->content) return "No differences.\n";
+
+    vector<string_view> a = split_lines(from->content);
+    vector<string_view> b = split_lines(to->content);
+    vector<EditRun> runs = diff_lines(a, b);
+    return unified_diff(a, b, runs, filename + "@" + to_string(fromVersion),
+                        filename + "@" + to_string(toVersion), 3);
+}
+
+string FileSystem::merge(const string& filename, int oursVersion, int theirsVersion) {
+    TraceSpan span("FileSystem::merge");
+    ScopedLatency timer(stats.command_latency[CMD_MERGE]);
+    if (!files.containsKey(filename)) return "Error: File not found.\n";
+    File* file = lookup(filename);
+    const VersionNode* ours = file->getVersion(oursVersion);
+    const VersionNode* theirs = file->getVersion(theirsVersion);
+    if (ours == nullptr || theirs == nullptr) return "Error: Version ID not found.\n";
+    if (ours == theirs) return "Error: Cannot merge a version with itself.\n";
+    // Both parents must be frozen, or an in-place edit could later change
+    // what the merge was made from.
+    if (!ours->isSnapshot() || !theirs->isSnapshot()) {
+        return "Error: Version " + to_string(ours->isSnapshot() ? theirsVersion : oursVersion)
+               + " is not a snapshot. SNAPSHOT it before merging.\n";
+    }
+    string refused = admitWrite((long long)(ours->content.size() > theirs->content.size() ? ours->content.size()
+                                                                                         : theirs->content.size()));
+    if (!refused.empty()) return refused;
+    const VersionNode* base = file->commonAncestor(oursVersion, theirsVersion);
+
+    // Fast paths: one side already contains the other, or both sides agree.
+    string merged;
+    int conflicts = 0;
+    if (base == theirs || theirs->content == ours->content || theirs->content == base->content) {
+        merged = ours->content;
+    } else if (base == ours || ours->content == base->content) {
+        merged = theirs->content;
+    } else {
+        conflicts = merge_three_way(base->content, ours->content, theirs->content,
+                                    filename + "@" + to_string(oursVersion),
+                                    filename + "@" + to_string(theirsVersion), merged);
+    }
+    size_t merged_size = merged.size();
+    int new_id = file->addMerge(oursVersion, theirsVersion, move(merged));
+    markDirty(file);
+    indexActiveVersion(file, 0);
+    stats.bytes_stored += merged_size;
+    stats.versions_created++;
+    updateAnalytics(file);
+
+    string result = "Merged versions " + to_string(oursVersion) + " and " + to_string(theirsVersion)
+                    + " (base " + to_string(base->version_id) + ") into version " + to_string(new_id);
+    if (conflicts > 0) {
+        return result + " with " + to_string(conflicts) + " conflicts. Resolve them with UPDATE before SNAPSHOT.\n";
+    }
+    return result + ".\n";
+}
+
+string FileSystem::blame(const string& filename, int versionId) {
+    TraceSpan span("FileSystem::blame");
+    ScopedLatency timer(stats.command_latency[CMD_BLAME]);
+    if (!files.containsKey(filename)) return "Error: File not found.\n";
+    File* file = lookup(filename);
+    if (versionId == -1) versionId = file->getActiveVersionId();
+    vector<int> origins;
+    if (!file->lineOrigins(versionId, origins)) return "Error: Version ID not found.\n";
+
+    vector<string_view> lines = split_lines(file->getVersion(versionId)->content);
+    int width = (int)to_string(file->getVersionCount() - 1).size();
+    string result = "";
+    for (size_t i = 0; i < lines.size(); ++i) {
+        string id = to_string(origins[i]);
+        result += string(width - id.size(), ' ') + id + " | ";
+        result.append(lines[i].data(), lines[i].size());
+        if (lines[i].back() != '\n') result += '\n';
+    }
+    return result;
+}
+
+string FileSystem::grep(const string& pattern, bool as_regex) {
+    vector<string> matches;
+    size_t checked = 0, skipped = 0;
+    string error = grepMatches(pattern, as_regex, matches, checked, skipped);
+    return error.empty() ? formatGrep(matches, checked, skipped) : error;
+}
+
+string FileSystem::formatGrep(const vector<string>& matches, size_t checked, size_t skipped) {
+    string result = "";
+    if (matches.empty()) {
+        result = "No matches.\n";
+    } else {
+        for (const string& match : matches) result += match + "\n";
+        result += to_string(matches.size()) + " matching versions (" + to_string(checked) + " candidates checked).\n";
+    }
+    if (skipped > 0) {
+        result += to_string(skipped) + " versions with lines over " + to_string(MAX_REGEX_LINE_BYTES)
+                  + " bytes were not fully searched.\n";
+    }
+    return result;
+}
+
+string FileSystem::grepMatches(const string& pattern, bool as_regex, vector<string>& matches, size_t& checked,
+                               size_t& skipped) {
+    TraceSpan span("FileSystem::grep");
+    ScopedLatency timer(stats.command_latency[CMD_GREP]);
+    regex compiled;
+    vector<string> literals;
+    if (as_regex) {
+        try {
+            compiled = regex(pattern);
+        } catch (const regex_error& e) {
+            return "Error: Invalid regular expression.\n";
+        }
+        literals = regex_required_literals(pattern);
+    } else {
+        literals.push_back(pattern);
+    }
+
+    indexPendingFiles();
+    // Patterns with no usable trigram fall back to checking every version.
+    vector<int> candidates;
+    if (!search_index.candidates(literals, candidates)) {
+        for (int doc = 0; doc < search_index.documentCount(); ++doc) {
+            if (search_index.isLive(doc)) candidates.push_back(doc);
+        }
+    }
+
+    // Candidates are verified a block at a time: the block's files are loaded
+    // (one at a time, as loading reads the store), checked in parallel, and
+    // then may be evicted again. Matches keep the candidate order.
+    const size_t BLOCK = 4096;
+    vector<char> found(candidates.size(), 0);
+    vector<char> too_long(candidates.size(), 0);
+    for (size_t start = 0; start < candidates.size(); start += BLOCK) {
+        size_t stop = start + BLOCK < candidates.size() ? start + BLOCK : candidates.size();
+        for (size_t i = start; i < stop; ++i) {
+            File* file = fileById(search_index.document(candidates[i]).file_id);
+            if (file != nullptr) file->load();
+        }
+        bulk_scheduler().parallelFor(stop - start, 256, [&](size_t begin, size_t end) {
+            for (size_t i = start + begin; i < start + end; ++i) {
+                const SearchDoc& entry = search_index.document(candidates[i]);
+                File* file = fileById(entry.file_id);
+                if (file == nullptr) continue; // Deleted.
+                const VersionNode* version = file->getVersion(entry.version_id);
+                if (version == nullptr) continue;
+                const string& content = version->content;
+                if (as_regex) {
+                    bool skipped_line = false;
+                    found[i] = regex_search_lines(content, compiled, skipped_line);
+                    too_long[i] = skipped_line;
+                } else {
+                    // memmem is vectorized in glibc.
+                    found[i] = pattern.empty()
+                               || memmem(content.data(), content.size(), pattern.data(), pattern.size()) != nullptr;
+                }
+            }
+        });
+        trimResident();
+    }
+    for (size_t i = 0; i < candidates.size(); ++i) {
+        if (too_long[i]) skipped++;
+        if (!found[i]) continue;
+        const SearchDoc& entry = search_index.document(candidates[i]);
+        matches.push_back(fileById(entry.file_id)->getName() + "@" + to_string(entry.version_id));
+    }
+    checked += candidates.size();
+    return "";
+}
+
+string FileSystem::snapshotAll(const string& tag, int* changed_out, int* snapshotted_out) {
+    TraceSpan span("FileSystem::snapshotAll");
+    ScopedLatency timer(stats.command_latency[CMD_SNAPSHOT_ALL]);
+    if (checkpoint_by_tag.containsKey(tag)) {
+        return "Error: Checkpoint '" + tag + "' already exists.\n";
+    }
+    // Only files in the dirty set can differ from the previous checkpoint.
+    GlobalCheckpoint checkpoint;
+    checkpoint.tag = tag;
+    checkpoint.timestamp = time(nullptr);
+    checkpoint.previous = (int)checkpoints.size() - 1;
+    int snapshotted = 0;
+    for (int id : dirty_files) {
+        File* file = fileById(id);
+        if (file == nullptr) continue; // Deleted.
+        if (!file->isCheckpointDirty()) continue; // Listed twice.
+        file->setCheckpointDirty(false);
+        // Freeze the active version so the recorded ID always means this content.
+        if (file->snapshot(tag)) {
+            snapshotted++;
+            updateAnalytics(file);
+        }
+        checkpoint.changed_files.push_back(id);
+        checkpoint.version_ids.push_back(file->getActiveVersionId());
+        file->pinVersion(file->getActiveVersionId());
+    }
+    dirty_files.clear();
+    trimResident();
+    int changed = (int)checkpoint.changed_files.size();
+    checkpoint_by_tag.put(tag, (int)checkpoints.size());
+    checkpoints.push_back(move(checkpoint));
+    if (changed_out) *changed_out = changed;
+    if (snapshotted_out) *snapshotted_out = snapshotted;
+    return "Checkpoint '" + tag + "' created (" + to_string(changed) + " changed files, "
+           + to_string(snapshotted) + " new snapshots).\n";
+}
+
+string FileSystem::rollbackAll(const string& tag, int* restored_out) {
+    TraceSpan span("FileSystem::rollbackAll");
+    ScopedLatency timer(stats.command_latency[CMD_ROLLBACK_ALL]);
+    if (!checkpoint_by_tag.containsKey(tag)) {
+        return "Error: Checkpoint '" + tag + "' not found.\n";
+    }
+    // Walk back through the chain; the first entry seen for a file is the
+    // version it had at the requested checkpoint.
+    HashMap<int, bool> seen;
+    int restored = 0;
+    for (int index = checkpoint_by_tag.get(tag); index != -1; index = checkpoints[index].previous) {
+        const GlobalCheckpoint& checkpoint = checkpoints[index];
+        for (size_t i = 0; i < checkpoint.changed_files.size(); ++i) {
+            int id = checkpoint.changed_files[i];
+            if (seen.containsKey(id)) continue;
+            seen.put(id, true);
+            File* file = fileById(id);
+            if (file == nullptr) continue; // Deleted since.
+            if (file->getActiveVersionId() == checkpoint.version_ids[i]) continue;
+            if (file->rollback(checkpoint.version_ids[i])) {
+                markDirty(file);
+                restored++;
+            }
+        }
+    }
+    trimResident();
+    if (restored_out) *restored_out = restored;
+    return "Restored " + to_string(restored) + " files to checkpoint '" + tag + "'.\n";
+}
+
+bool FileSystem::collectGarbageSlice() {
+    const long long SLICE_BUDGET_NS = 2000000;
+    const size_t BATCH = 256;
+    TraceSpan span("FileSystem::collectGarbageSlice");
+    // The stubs of the files this slice is expected to reach are read before
+    // taking the lock, and the slice ends where that read-ahead ends.
+    FetchedBlobs fetched;
+    size_t window_end = prefetchGcStubs(custom_max<size_t>(1, custom_min<size_t>(BATCH, SLICE_BUDGET_NS / gc_file_ns)),
+                                        fetched);
+
+    lock_guard<mutex> lock(command_lock);
+    auto start = chrono::steady_clock::now();
+    auto elapsed_ns = [&start] {
+        return (long long)chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count();
+    };
+    // Files are pruned a batch at a time in parallel; each prune touches only
+    // its own file, and the shared counters are added up afterwards. Each
+    // batch is sized from the measured cost per file to fill half of the
+    // budget left, so a misestimate overshoots it by little, and loading
+    // stops at the budget file by file.
+    time_t now = time(nullptr);
+    window_end = custom_min(window_end, gc_pass.size());
+    while (gc_cursor < window_end && elapsed_ns() < SLICE_BUDGET_NS) {
+        long long batch_start = elapsed_ns();
+        size_t target = (size_t)custom_max<long long>(1, (SLICE_BUDGET_NS - batch_start) / 2 / gc_file_ns);
+        vector<File*> batch;
+        while (gc_cursor < window_end && batch.size() < target && (batch.empty() || elapsed_ns() < SLICE_BUDGET_NS)) {
+            File* file = fileById(gc_pass[gc_cursor++]);
+            if (file == nullptr) continue; // Deleted since the pass began.
+            file->load(&fetched); // Here rather than in parallel: loading may read the store.
+            batch.push_back(file);
+        }
+        vector<int> freed(batch.size(), 0);
+        vector<long long> bytes(batch.size(), 0);
+        bulk_scheduler().parallelFor(batch.size(), 8, [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; ++i) freed[i] = batch[i]->prune(retention, now, bytes[i]);
+        });
+        for (size_t i = 0; i < batch.size(); ++i) {
+            gc_versions_freed += freed[i];
+            gc_bytes_freed += bytes[i];
+            if (freed[i] == 0) continue;
+            updateAnalytics(batch[i]);
+            for (int id = 0; id < batch[i]->getVersionCount(); ++id) {
+                if (batch[i]->getVersion(id) == nullptr) search_index.removeDocument(batch[i]->getId(), id);
+            }
+        }
+        trimResident();
+        if (!batch.empty()) {
+            long long measured = (elapsed_ns() - batch_start) / (long long)batch.size();
+            gc_file_ns = custom_max<long long>(1000, (3 * gc_file_ns + measured) / 4);
+        }
+    }
+    bool done = gc_cursor >= gc_pass.size();
+    if (done) {
+        gc_pass.clear();
+        gc_cursor = 0;
+        gc_passes++;
+    }
+    gc_max_pause_ns = custom_max(gc_max_pause_ns, elapsed_ns());
+    return done;
+}
+
+string FileSystem::gcRun() {
+    if (!collector.request()) return "Garbage collection is already running.\n";
+    return "Garbage collection started in the background.\n";
+}
+
+string FileSystem::gcStatus() {
+    return string("Policy: keep last ") + to_string(retention.keep_last) + " snapshots, daily for "
+           + to_string(retention.daily_days) + " days, "
+           + (retention.interval_seconds > 0 ? "every " + to_string(retention.interval_seconds) + " s"
+                                             : string("on request only")) + "\n"
+           + "Running: " + (collector.isRunning() ? "yes" : "no") + "\n"
+           + "Passes completed: " + to_string(gc_passes) + "\n"
+           + "Versions freed: " + to_string(gc_versions_freed) + "\n"
+           + "Content bytes freed: " + to_string(gc_bytes_freed) + "\n"
+           + "Longest pause (us): " + format_fixed(gc_max_pause_ns / 1000.0, 3) + "\n";
+}
+
+string FileSystem::gcSetPolicy(int keepLast, int dailyDays, int intervalSeconds) {
+    if (keepLast < 0 || dailyDays < 0 || intervalSeconds < 0) {
+        return "Error: GC policy values cannot be negative.\n";
+    }
+    retention.keep_last = keepLast;
+    retention.daily_days = dailyDays;
+    retention.interval_seconds = intervalSeconds;
+    collector.setInterval(intervalSeconds);
+    return "GC policy updated.\n";
+}
+
+void FileSystem::shareBudget(MemoryBudget* shared) {
+    long long held = resident_set.bytes.load();
+    budget->used -= held;
+    shared->used += held;
+    budget = shared;
+    resident_set.budget = shared;
+}
+
+string FileSystem::setMemoryBudget(long long bytes) {
+    if (bytes < 0) return "Error: The memory budget cannot be negative.\n";
+    budget->limit = bytes;
+    if (bytes == 0) return "Memory budget removed.\n";
+    return "Memory budget set to " + to_string(bytes) + " bytes.\n";
+}
+
+void FileSystem::collectMemory(MemoryUsage& usage, long long& file_count, long long& loaded, long long& table_bytes) {
+    vector<File*> all_files = files.getValues();
+    for (File* file : all_files) {
+        usage.add(file->memoryUsage());
+        if (file->isLoaded()) loaded++;
+    }
+    file_count += (long long)all_files.size();
+    table_bytes += files.memoryBytes() + files_by_id.memoryBytes();
+}
+
+string FileSystem::memoryReport() {
+    TraceSpan span("FileSystem::memoryReport");
+    MemoryUsage usage;
+    long long file_count = 0, loaded = 0, table_bytes = 0;
+    collectMemory(usage, file_count, loaded, table_bytes);
+    return formatMemory(usage, file_count, loaded, table_bytes, *budget);
+}
+
+string FileSystem::formatMemory(const MemoryUsage& usage, long long file_count, long long loaded,
+                                long long table_bytes, const MemoryBudget& budget) {
+    long long limit = budget.limit.load();
+    return "--- Memory (bytes) ---\n"
+           "Files: " + to_string(file_count) + " (" + to_string(loaded) + " loaded, "
+           + to_string(usage.versions) + " versions in memory)\n"
+           + "Nodes: " + to_string(usage.nodes) + "\n"
+           + "Contents: " + to_string(usage.contents) + "\n"
+           + "Messages: " + to_string(usage.messages) + "\n"
+           + "Version maps: " + to_string(usage.version_maps) + "\n"
+           + "Time indexes: " + to_string(usage.time_indexes) + "\n"
+           + "Blame caches: " + to_string(usage.blame_caches) + "\n"
+           + "Stubs: " + to_string(usage.stubs) + "\n"
+           + "File objects: " + to_string(usage.file_objects) + "\n"
+           + "File table: " + to_string(table_bytes) + "\n"
+           + "Total: " + to_string(usage.total() + table_bytes) + "\n"
+           + "Budget: " + to_string(budget.used.load()) + " bytes of loaded trees"
+           + (limit > 0 ? ", limit " + to_string(limit) : string(", no limit")) + ", "
+           + to_string(budget.slack_freed.load()) + " bytes of slack freed, "
+           + to_string(budget.refused.load()) + " writes refused\n";
+}
+
+string FileSystem::fileMemoryReport(const string& filename) {
+    if (!files.containsKey(filename)) return "Error: File not found.\n";
+    File* file = files.get(filename); // Not lookup(): counting must not load a stub.
+    MemoryUsage usage = file->memoryUsage();
+    return "--- Memory of '" + filename + "' (bytes) ---\n"
+           + (file->isLoaded() ? "Loaded: " + to_string(usage.versions) + " versions\n"
+                               : "Not loaded: " + to_string(file->getLiveVersionCount()) + " versions in the store\n")
+           + "Nodes: " + to_string(usage.nodes) + "\n"
+           + "Contents: " + to_string(usage.contents) + "\n"
+           + "Messages: " + to_string(usage.messages) + "\n"
+           + "Version map: " + to_string(usage.version_maps) + "\n"
+           + "Time index: " + to_string(usage.time_indexes) + "\n"
+           + "Blame cache: " + to_string(usage.blame_caches) + "\n"
+           + "Stub: " + to_string(usage.stubs) + "\n"
+           + "File object: " + to_string(usage.file_objects) + "\n"
+           + "Total: " + to_string(usage.total()) + "\n";
+}
+
+string FileSystem::statsReport(bool as_json) {
+    TraceSpan span("FileSystem::statsReport");
+    vector<File*> all_files = files.getValues();
+    HashMapStats files_stats = files.getStats();
+    // Each range of files is summed separately, then the partial sums merged.
+    const size_t GRAIN = 1024;
+    vector<HashMapStats> partial_stats(all_files.size() / GRAIN + 1);
+    bulk_scheduler().parallelFor(all_files.size(), GRAIN, [&](size_t begin, size_t end) {
+        HashMapStats& partial = partial_stats[begin / GRAIN];
+        for (size_t i = begin; i < end; ++i) partial.merge(all_files[i]->getVersionMapStats());
+    });
+    HashMapStats version_stats;
+    for (const HashMapStats& partial : partial_stats) version_stats.merge(partial);
+
+    // Helper lambdas keep the two output formats side by side.
+    auto us = [](double ns) { return format_fixed(ns / 1000.0, 3); };
+    auto map_text = [](const string& title, const HashMapStats& m) {
+        return "--- HashMap: " + title + " ---\n"
+               + "Entries: " + to_string(m.entries)
+               + ", Buckets: " + to_string(m.buckets)
+               + ", Load factor: " + format_fixed(m.loadFactor(), 3)
+               + ", Max chain: " + to_string(m.max_chain)
+               + ", Avg probe length: " + format_fixed(m.avgProbeLength(), 3) + "\n";
+    };
+    auto map_json = [](const HashMapStats& m) {
+        return "{\"entries\":" + to_string(m.entries)
+               + ",\"buckets\":" + to_string(m.buckets)
+               + ",\"load_factor\":" + format_fixed(m.loadFactor(), 3)
+               + ",\"max_chain\":" + to_string(m.max_chain)
+               + ",\"avg_probe_length\":" + format_fixed(m.avgProbeLength(), 3) + "}";
+    };
+
+    long long reclaim_pending, reclaimed_files, reclaimed_versions;
+    reclaimer.counts(reclaim_pending, reclaimed_files, reclaimed_versions);
+    SchedulerStats scheduler = bulk_scheduler().stats();
+
+    string result = "";
+    if (!as_json) {
+        result += "--- Command Latency (microseconds) ---\n";
+        for (int i = 0; i < CMD_TYPE_COUNT; ++i) {
+            const LatencyHistogram& h = stats.command_latency[i];
+            if (h.count() == 0) continue;
+            result += string(COMMAND_NAMES[i]) + ": count=" + to_string(h.count())
+                      + " mean=" + us(h.mean())
+                      + " p50=" + us(h.percentile(50))
+                      + " p90=" + us(h.percentile(90))
+                      + " p99=" + us(h.percentile(99))
+                      + " max=" + us(h.max()) + "\n";
+        }
+        result += "--- Counters ---\n";
+        result += "Files: " + to_string(all_files.size()) + "\n";
+        result += "Bytes stored: " + to_string(stats.bytes_stored) + "\n";
+        result += "Versions created: " + to_string(stats.versions_created) + "\n";
+        result += "Search index: " + to_string(search_index.liveDocumentCount()) + " versions, "
+                  + to_string(search_index.trigramCount()) + " trigrams, "
+                  + to_string(search_index.postingCount()) + " postings ("
+                  + to_string(search_index.deadPostingCount()) + " dead), "
+                  + to_string(search_index.rebuildCount()) + " rebuilds\n";
+        result += "Deleted files: " + to_string(reclaimed_files) + " freed (" + to_string(reclaimed_versions)
+                  + " versions), " + to_string(reclaim_pending) + " pending\n";
+        result += "Resident: " + to_string(resident_set.files) + " of " + to_string(all_files.size())
+                  + " files loaded, " + to_string(resident_set.bytes.load()) + " bytes"
+                  + (resident_limit > 0 ? " (limit " + to_string(resident_limit) + ")" : string("")) + ", "
+                  + to_string(resident_set.loads) + " loads, " + to_string(resident_set.evictions) + " evictions\n";
+        result += "Scheduler: " + to_string(scheduler.workers) + " workers, " + to_string(scheduler.jobs) + " jobs, "
+                  + to_string(scheduler.tasks) + " tasks, " + to_string(scheduler.steals) + " steals, "
+                  + format_fixed(scheduler.idle_ns / 1e6, 3) + " ms idle\n";
+        result += storeReport(false);
+        result += map_text("files", files_stats);
+        result += map_text("version maps (loaded files)", version_stats);
+        return result;
+    }
+
+    result += "{\"latency_us\":{";
+    bool first = true;
+    for (int i = 0; i < CMD_TYPE_COUNT; ++i) {
+        const LatencyHistogram& h = stats.command_latency[i];
+        if (!first) result += ",";
+        first = false;
+        result += "\"" + string(COMMAND_NAMES[i]) + "\":{\"count\":" + to_string(h.count())
+                  + ",\"mean\":" + us(h.mean())
+                  + ",\"p50\":" + us(h.percentile(50))
+                  + ",\"p90\":" + us(h.percentile(90))
+                  + ",\"p99\":" + us(h.percentile(99))
+                  + ",\"max\":" + us(h.max()) + "}";
+    }
+    result += "},\"counters\":{\"files\":" + to_string(all_files.size())
+              + ",\"bytes_stored\":" + to_string(stats.bytes_stored)
+              + ",\"versions_created\":" + to_string(stats.versions_created)
+              + ",\"search_versions\":" + to_string(search_index.liveDocumentCount())
+              + ",\"search_trigrams\":" + to_string(search_index.trigramCount())
+              + ",\"search_postings\":" + to_string(search_index.postingCount())
+              + ",\"search_dead_postings\":" + to_string(search_index.deadPostingCount())
+              + ",\"search_rebuilds\":" + to_string(search_index.rebuildCount())
+              + ",\"reclaimed_files\":" + to_string(reclaimed_files)
+              + ",\"reclaimed_versions\":" + to_string(reclaimed_versions)
+              + ",\"reclaim_pending\":" + to_string(reclaim_pending)
+              + ",\"resident_files\":" + to_string(resident_set.files)
+              + ",\"resident_bytes\":" + to_string(resident_set.bytes.load())
+              + ",\"resident_limit\":" + to_string(resident_limit)
+              + ",\"resident_loads\":" + to_string(resident_set.loads)
+              + ",\"resident_evictions\":" + to_string(resident_set.evictions)
+              + ",\"scheduler_workers\":" + to_string(scheduler.workers)
+              + ",\"scheduler_jobs\":" + to_string(scheduler.jobs)
+              + ",\"scheduler_tasks\":" + to_string(scheduler.tasks)
+              + ",\"scheduler_steals\":" + to_string(scheduler.steals)
+              + ",\"scheduler_idle_ms\":" + format_fixed(scheduler.idle_ns / 1e6, 3) + storeReport(true) + "}";
+    result += ",\"hashmaps\":{\"files\":" + map_json(files_stats)
+              + ",\"version_maps\":" + map_json(version_stats) + "}}\n";
+    return result;
+}
+
+//==============================================================================
+// THREAD POOL
+// Purpose: A fixed set of worker threads that execute submitted tasks in FIFO
+//          order. Used by the server to run commands off the I/O thread.
+//==============================================================================
+
+/**
+ *  An unbounded FIFO queue whose pop() blocks until an item is available or
+ *  the queue is closed. Items live in a vector with a moving head index; the
+ *  consumed prefix is compacted away once it makes up half the storage.
+ */
+template <typename T>
+class BlockingQueue {
+private:
+    vector<T> items;
+    size_t head;
+    bool closed;
+    mutex queue_lock;
+    condition_variable not_empty;
+
+public:
+    BlockingQueue() : head(0), closed(false) {}
+
+    void push(T item) {
+        {
+            lock_guard<mutex> guard(queue_lock);
+            items.push_back(move(item));
+        }
+        not_empty.notify_one();
+    }
+
+    /**
+     *  Waits for the next item. Returns false once the queue is closed and
+     *  fully drained.
+     */
+    bool pop(T& out) {
+        unique_lock<mutex> guard(queue_lock);
+        not_empty.wait(guard, [this] { return head < items.size() || closed; });
+        if (head == items.size()) return false;
+        out = move(items[head]);
+        head++;
+        if (head == items.size()) {
+            items.clear();
+            head = 0;
+        } else if (head * 2 >= items.size()) {
+            items.erase(items.begin(), items.begin() + head);
+            head = 0;
+        }
+        return true;
+    }
+
+    void close() {
+        {
+            lock_guard<mutex> guard(queue_lock);
+            closed = true;
+        }
+        not_empty.notify_all();
+    }
+};
+
+class ThreadPool {
+private:
+    vector<thread> workers;
+    BlockingQueue<function<void()>> tasks;
+
+public:
+    ThreadPool(int thread_count) {
+        if (thread_count < 1) thread_count = 1;
+        for (int i = 0; i < thread_count; ++i) {
+            workers.emplace_back([this] {
+                function<void()> task;
+                while (tasks.pop(task)) task();
+            });
+        }
+    }
+
+    ~ThreadPool() { shutdown(); }
+
+    void submit(function<void()> task) { tasks.push(move(task)); }
+
+    /**
+     *  Finishes all queued tasks and joins the workers.
+     */
+    void shutdown() {
+        tasks.close();
+        for (thread& worker : workers) {
+            if (worker.joinable()) worker.join();
+        }
+    }
+
+    int size() const { return (int)workers.size(); }
+};
+
+//==============================================================================
+// SHARDED FILE SYSTEM
+// Purpose: Partitions files by a hash of their name across independent
+//          FileSystem shards, each driven by its own worker thread. Commands
+//          reach a worker through a lock-free multi-producer queue, so commands
+//          on different shards run in parallel without sharing any state.
+//          With one shard, commands run on the caller's thread as before.
+//==============================================================================
+
+/**
+ *  How many times a shard worker or a waiting submitter polls before it
+ *  sleeps. Most commands finish well within this, which skips the futex
+ *  sleep and wake-up. On one core polling only delays the other side.
+ */
+const int SHARD_SPIN_LIMIT = thread::hardware_concurrency() > 1 ? 2000 : 0;
+
+/**
+ *  A unit of work for a shard worker. It lives on the submitting thread's
+ *  stack until `released` is set.
+ */
+struct ShardTask {
+    function<void(FileSystem&)> run;
+    bool stop_worker = false;
+    atomic<ShardTask*> next{nullptr};
+    mutex done_lock;
+    condition_variable done_signal;
+    bool finished = false;
+    atomic<bool> released{false}; // The worker's last touch of the task.
+
+    void complete() {
+        {
+            lock_guard<mutex> lock(done_lock);
+            finished = true;
+            done_signal.notify_one();
+        }
+        released.store(true, memory_order_release);
+    }
+
+    void wait() {
+        for (int spin = 0; spin < SHARD_SPIN_LIMIT; ++spin) {
+            if (released.load(memory_order_acquire)) return;
+        }
+        {
+            unique_lock<mutex> lock(done_lock);
+            done_signal.wait(lock, [this] { return finished; });
+        }
+        // The worker may still be leaving complete(); the task must outlive that.
+        while (!released.load(memory_order_acquire)) this_thread::yield();
+    }
+};
+
+/**
+ *  An intrusive multi-producer, single-consumer queue (Vyukov's design).
+ *  push() is one atomic exchange and never blocks. pop() may briefly return
+ *  nullptr while a push is half done; the consumer then retries.
+ */
+class MpscQueue {
+private:
+    atomic<ShardTask*> head; // Producers swing this to their node.
+    ShardTask* tail;         // Only the consumer touches this.
+    ShardTask stub;
+
+public:
+    MpscQueue() : head(&stub), tail(&stub) {}
+
+    void push(ShardTask* task) {
+        task->next.store(nullptr, memory_order_relaxed);
+        ShardTask* previous = head.exchange(task, memory_order_acq_rel);
+        previous->next.store(task, memory_order_release);
+    }
+
+    ShardTask* pop() {
+        ShardTask* first = tail;
+        ShardTask* next = first->next.load(memory_order_acquire);
+        if (first == &stub) {
+            if (next == nullptr) return nullptr;
+            tail = next;
+            first = next;
+            next = next->next.load(memory_order_acquire);
+        }
+        if (next != nullptr) {
+            tail = next;
+            return first;
+        }
+        if (first != head.load(memory_order_acquire)) return nullptr; // A push is in progress.
+        push(&stub);
+        next = first->next.load(memory_order_acquire);
+        if (next != nullptr) {
+            tail = next;
+            return first;
+        }
+        return nullptr;
+    }
+};
+
+class ShardedFileSystem {
+private:
+    struct Shard {
+        FileSystem fs;
+        MpscQueue queue;
+        atomic<unsigned> pending{0}; // Tasks pushed but not yet taken; the worker sleeps on it.
+        thread worker;
+    };
+    vector<Shard*> shards;
+    mutex group_lock; // Held while a group of interdependent tasks runs.
+    MemoryBudget budget; // Shared by every shard.
+
+    static void workerLoop(Shard* shard) {
+        while (true) {
+            unsigned pending = shard->pending.load(memory_order_acquire);
+            for (int spin = 0; pending == 0 && spin < SHARD_SPIN_LIMIT; ++spin) {
+                pending = shard->pending.load(memory_order_acquire);
+            }
+            if (pending == 0) {
+                shard->pending.wait(0, memory_order_acquire);
+                continue;
+            }
+            ShardTask* task = shard->queue.pop();
+            if (task == nullptr) {
+                this_thread::yield(); // A producer is between its two steps.
+                continue;
+            }
+            shard->pending.fetch_sub(1, memory_order_relaxed);
+            bool stop = task->stop_worker;
+            if (!stop) task->run(shard->fs);
+            task->complete();
+            if (stop) return;
+        }
+    }
+
+    void post(int index, ShardTask* task) {
+        Shard* shard = shards[index];
+        shard->queue.push(task);
+        shard->pending.fetch_add(1, memory_order_release);
+        shard->pending.notify_one();
+    }
+
+public:
+    ShardedFileSystem(int shard_count) {
+        if (shard_count < 1) shard_count = 1;
+        for (int i = 0; i < shard_count; ++i) {
+            shards.push_back(new Shard());
+            shards.back()->fs.shareBudget(&budget);
+        }
+        if (shard_count > 1) {
+            for (Shard* shard : shards) shard->worker = thread(workerLoop, shard);
+        }
+    }
+
+    ~ShardedFileSystem() {
+        for (size_t i = 0; i < shards.size(); ++i) {
+            if (!shards[i]->worker.joinable()) continue;
+            ShardTask task;
+            task.stop_worker = true;
+            post((int)i, &task);
+            task.wait();
+            shards[i]->worker.join();
+        }
+        for (Shard* shard : shards) delete shard;
+    }
+
+    ShardedFileSystem(const ShardedFileSystem&) = delete;
+    ShardedFileSystem& operator=(const ShardedFileSystem&) = delete;
+
+    int shardCount() const { return (int)shards.size(); }
+
+    /**
+     *  The shard that owns a filename. The string hash is remixed so that
+     *  the shard does not depend on the same low bits as the HashMap bucket.
+     */
+    int shardFor(const string& filename) const {
+        uint64_t mixed = (uint64_t)custom_hash<string>()(filename) * 0x9E3779B97F4A7C15ULL;
+        return (int)((mixed >> 32) % shards.size());
+    }
+
+    FileSystem& shard(int index) { return shards[index]->fs; }
+
+    void setFastExit() {
+        for (Shard* shard : shards) shard->fs.setFastExit();
+    }
+
+    MemoryBudget& memoryBudget() { return budget; }
+    void setMemoryBudget(long long bytes) { budget.limit = bytes; }
+
+    /**
+     *  Splits a limit on loaded version trees evenly between the shards.
+     */
+    void setResidentLimit(long long bytes) {
+        for (Shard* shard : shards) shard->fs.setResidentLimit(bytes / (long long)shards.size());
+    }
+
+    /**
+     *  Runs `work` on one shard's worker and waits for it.
+     */
+    void runOn(int index, const function<void(FileSystem&)>& work) {
+        if (shards.size() == 1) {
+            work(shards[0]->fs);
+            return;
+        }
+        ShardTask task;
+        task.run = work;
+        post(index, &task);
+        task.wait();
+    }
+
+    /**
+     *  Runs `work(fs, shard index)` on every shard in parallel and waits for
+     *  all of them. With `atomic_cut`, every worker first waits until all of
+     *  them have reached this task, so the work sees one consistent moment
+     *  across shards (used by SNAPSHOT_ALL and ROLLBACK_ALL).
+     */
+    void runOnAll(const function<void(FileSystem&, int)>& work, bool atomic_cut = false) {
+        int count = (int)shards.size();
+        if (count == 1) {
+            work(shards[0]->fs, 0);
+            return;
+        }
+        vector<int> all;
+        for (int i = 0; i < count; ++i) all.push_back(i);
+        if (!atomic_cut) {
+            vector<ShardTask> tasks(count);
+            for (int i = 0; i < count; ++i) {
+                tasks[i].run = [&work, i](FileSystem& fs) { work(fs, i); };
+                post(i, &tasks[i]);
+            }
+            for (ShardTask& task : tasks) task.wait();
+            return;
+        }
+        atomic<int> arrived(0);
+        runTogether(all, [&work, &arrived, count](FileSystem& fs, int index) {
+            arrived.fetch_add(1);
+            arrived.notify_all();
+            for (int seen = arrived.load(); seen < count; seen = arrived.load()) arrived.wait(seen);
+            work(fs, index);
+        });
+    }
+
+    /**
+     *  Runs `work(fs, shard index)` on the given shards at the same time, for
+     *  work whose parts wait on each other. Groups are serialized: two groups
+     *  queued in different orders on two shards would otherwise deadlock.
+     */
+    void runTogether(const vector<int>& indices, const function<void(FileSystem&, int)>& work) {
+        if (shards.size() == 1) {
+            work(shards[0]->fs, 0);
+            return;
+        }
+        lock_guard<mutex> group(group_lock);
+        vector<ShardTask> tasks(indices.size());
+        for (size_t i = 0; i < indices.size(); ++i) {
+            int index = indices[i];
+            tasks[i].run = [&work, index](FileSystem& fs) { work(fs, index); };
+            post(index, &tasks[i]);
+        }
+        for (ShardTask& task : tasks) task.wait();
+    }
+
+    /**
+     *  Opens one store per shard: the directory itself for a single shard,
+     *  or a "shard-N" subdirectory of it for each of several. The shard count
+     *  is recorded, since files cannot be found under a different count.
+     */
+    string openStore(const string& directory);
+};
+
+//==============================================================================
+// BULK IMPORT
+// Purpose: Seeds the FileSystem from a directory tree on the local disk. Files
+//          are read in parallel on the bulk scheduler, then loaded in one batch.
+//==============================================================================
+
+/**
+ *  Collects the regular files below a directory, as paths relative to it.
+ *  Symbolic links are not followed.
+ */
+void collect_files(const string& root, vector<string>& relative_paths) {
+    vector<string> pending_dirs;
+    pending_dirs.push_back("");
+    while (!pending_dirs.empty()) {
+        string relative_dir = pending_dirs.back();
+        pending_dirs.pop_back();
+        string full_dir = relative_dir.empty() ? root : root + "/" + relative_dir;
+        DIR* dir = opendir(full_dir.c_str());
+        if (dir == nullptr) continue;
+        while (dirent* entry = readdir(dir)) {
+            string name = entry->d_name;
+            if (name == "." || name == "..") continue;
+            string relative = relative_dir.empty() ? name : relative_dir + "/" + name;
+            unsigned char type = entry->d_type;
+            if (type == DT_UNKNOWN) {
+                struct stat info;
+                if (lstat((root + "/" + relative).c_str(), &info) != 0) continue;
+                type = S_ISDIR(info.st_mode) ? DT_DIR : (S_ISREG(info.st_mode) ? DT_REG : DT_UNKNOWN);
+            }
+            if (type == DT_DIR) pending_dirs.push_back(relative);
+            else if (type == DT_REG) relative_paths.push_back(relative);
+        }
+        closedir(dir);
+    }
+}
+
+/**
+ *  Reads a whole file into memory. Large files are mapped and copied in one
+ *  pass; small ones are read with a single call sized from fstat().
+ */
+bool read_whole_file(const string& path, string& out) {
+    const off_t MMAP_THRESHOLD = 1 << 20;
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return false;
+    struct stat info;
+    if (fstat(fd, &info) != 0) {
+        close(fd);
+        return false;
+    }
+    bool ok = true;
+    if (info.st_size >= MMAP_THRESHOLD) {
+        void* mapped = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (mapped == MAP_FAILED) {
+            ok = false;
+        } else {
+            madvise(mapped, info.st_size, MADV_SEQUENTIAL);
+            out.assign((const char*)mapped, info.st_size);
+            munmap(mapped, info.st_size);
+        }
+    } else {
+        out.resize(info.st_size);
+        size_t done = 0;
+        while (done < out.size()) {
+            ssize_t n = pread(fd, &out[done], out.size() - done, done);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) break;
+            done += n;
+        }
+        out.resize(done); // The file may have shrunk while we read it.
+    }
+    close(fd);
+    return ok;
+}
+
+/**
+ *  Writes the whole buffer at `offset`, retrying short writes.
+ */
+bool pwrite_all(int fd, const char* data, size_t length, uint64_t offset) {
+    while (length > 0) {
+        ssize_t n = pwrite(fd, data, length, (off_t)offset);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        data += n;
+        length -= n;
+        offset += n;
+    }
+    return true;
+}
+
+/**
+ *  Reads exactly `length` bytes at `offset`.
+ */
+bool pread_all(int fd, char* data, size_t length, uint64_t offset) {
+    while (length > 0) {
+        ssize_t n = pread(fd, data, length, (off_t)offset);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        data += n;
+        length -= n;
+        offset += n;
+    }
+    return true;
+}
+
+/**
+ *  Implements IMPORT. Disk reads happen before the file system lock is taken,
+ *  so other clients are only blocked for the in-memory batch load.
+ */
+string import_directory(ShardedFileSystem& system, const string& directory, const string& message) {
+    struct stat info;
+    if (stat(directory.c_str(), &info) != 0 || !S_ISDIR(info.st_mode)) {
+        return "Error: '" + directory + "' is not a readable directory.\n";
+    }
+    vector<string> paths;
+    collect_files(directory, paths);
+    vector<ImportedFile> batch(paths.size());
+
+    bulk_scheduler().parallelFor(paths.size(), 64, [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i) {
+            batch[i].name = paths[i];
+            batch[i].ok = read_whole_file(directory + "/" + paths[i], batch[i].content);
+        }
+    });
+
+    long long unreadable = 0;
+    vector<vector<ImportedFile>> by_shard(system.shardCount());
+    for (ImportedFile& item : batch) {
+        if (!item.ok) unreadable++;
+        else by_shard[system.shardFor(item.name)].push_back(move(item));
+    }
+    // Each shard loads its part of the batch under its own lock, in parallel.
+    // A shard stops early when the memory budget refuses a file.
+    long long readable = (long long)batch.size() - unreadable;
+    atomic<long long> imported(0), bytes(0);
+    system.runOnAll([&](FileSystem& fs, int index) {
+        long long shard_imported = 0, shard_bytes = 0;
+        {
+            lock_guard<mutex> guard(fs.commandMutex());
+            fs.importFiles(by_shard[index], message, shard_imported, shard_bytes);
+        }
+        imported += shard_imported;
+        bytes += shard_bytes;
+    });
+    string result = "Imported " + to_string(imported.load()) + " files (" + to_string(bytes.load()) + " bytes).\n";
+    if (unreadable > 0) result += "Skipped " + to_string(unreadable) + " unreadable files.\n";
+    if (imported.load() < readable) {
+        result += "Error: Memory budget exceeded; " + to_string(readable - imported.load()) + " files not imported.\n";
+    }
+    return result;
+}
+
+//==============================================================================
+// PARALLEL EXPORT
+// Purpose: Checks out one version of every file into a directory on the local
+//          disk. Files are written in parallel, and files whose on-disk content
+//          already matches are left untouched.
+//==============================================================================
+
+/**
+ *  64-bit FNV-1a hash of a byte range.
+ */
+uint64_t fnv1a_hash(const char* data, size_t length) {
+    uint64_t hash = 1469598103934665603ULL;
+    for (size_t i = 0; i < length; ++i) {
+        hash ^= (unsigned char)data[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+/**
+ *  Creates every missing directory on the way to `path`'s parent.
+ */
+bool make_parent_dirs(const string& path) {
+    for (size_t slash = path.find('/', 1); slash != string::npos; slash = path.find('/', slash + 1)) {
+        string dir = path.substr(0, slash);
+        if (mkdir(dir.c_str(), 0755) != 0 && errno != EEXIST) return false;
+    }
+    return true;
+}
+
+/**
+ *  Rejects names that would escape the export directory.
+ */
+bool is_safe_relative_path(const string& name) {
+    if (name.empty() || name[0] == '/') return false;
+    size_t start = 0;
+    while (start <= name.size()) {
+        size_t end = name.find('/', start);
+        if (end == string::npos) end = name.size();
+        string part = name.substr(start, end - start);
+        if (part.empty() || part == "." || part == "..") return false;
+        start = end + 1;
+    }
+    return true;
+}
+
+enum ExportOutcome { EXPORT_WRITTEN, EXPORT_UNCHANGED, EXPORT_FAILED, EXPORT_UNSAFE_NAME };
+
+/**
+ *  Compares an existing file with the chosen content a chunk at a time, so
+ *  saved content is never read whole.
+ */
+bool export_matches(const string& path, const ExportedFile& file) {
+    int fd = open(path.c_str(), O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd < 0) return false;
+    const size_t CHUNK = 1 << 20;
+    string existing, wanted;
+    bool same = true;
+    for (uint64_t done = 0; same && done < file.size(); done += CHUNK) {
+        size_t length = file.size() - done < CHUNK ? (size_t)(file.size() - done) : CHUNK;
+        existing.resize(length);
+        if (!pread_all(fd, &existing[0], length, done)) {
+            same = false;
+        } else if (file.source_fd < 0) {
+            same = memcmp(existing.data(), file.content.data() + done, length) == 0;
+        } else {
+            wanted.resize(length);
+            same = pread_all(file.source_fd, &wanted[0], length, file.source_offset + done) && existing == wanted;
+        }
+    }
+    close(fd);
+    return same;
+}
+
+/**
+ *  Copies saved content from its pack into `to_fd`, inside the kernel with
+ *  copy_file_range where the file systems allow it, else through a buffer.
+ */
+bool export_copy_blob(const ExportedFile& file, int to_fd) {
+    uint64_t done = 0;
+    loff_t from = (loff_t)file.source_offset;
+    while (done < file.source_length) {
+        ssize_t n = copy_file_range(file.source_fd, &from, to_fd, nullptr, file.source_length - done, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break; // Not supported between these files; copy the rest below.
+        done += n;
+    }
+    const size_t CHUNK = 1 << 20;
+    string buffer;
+    while (done < file.source_length) {
+        size_t length = file.source_length - done < CHUNK ? (size_t)(file.source_length - done) : CHUNK;
+        buffer.resize(length);
+        if (!pread_all(file.source_fd, &buffer[0], length, file.source_offset + done)) return false;
+        if (!pwrite_all(to_fd, buffer.data(), length, done)) return false;
+        done += length;
+    }
+    return true;
+}
+
+/**
+ *  Writes one file unless the existing file already has the same content.
+ *  New content goes to a temporary file that is renamed into place, so a
+ *  reader never sees a half-written file. Symlinks are never followed: one
+ *  at the path is replaced, not written through.
+ */
+ExportOutcome export_one(const string& path, const ExportedFile& file) {
+    struct stat info;
+    // Sizes first, so only a possible match costs a read.
+    if (lstat(path.c_str(), &info) == 0 && S_ISREG(info.st_mode) && (uint64_t)info.st_size == file.size()
+        && export_matches(path, file)) {
+        return EXPORT_UNCHANGED;
+    }
+    if (!make_parent_dirs(path)) return EXPORT_FAILED;
+    string temp_path = path + ".anuj-tmp";
+    unlink(temp_path.c_str()); // Left over from a failed run, or a planted link.
+    int fd = open(temp_path.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, 0644);
+    if (fd < 0) return EXPORT_FAILED;
+    const string& content = file.content;
+    const size_t CHUNK = 1 << 20; // Large sequential writes.
+    size_t done = 0;
+    bool ok = file.source_fd < 0 || export_copy_blob(file, fd);
+    while (ok && done < content.size()) {
+        size_t length = content.size() - done < CHUNK ? content.size() - done : CHUNK;
+        ssize_t n = write(fd, content.data() + done, length);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            ok = false;
+            break;
+        }
+        done += n;
+    }
+    if (close(fd) != 0) ok = false;
+    if (!ok || rename(temp_path.c_str(), path.c_str()) != 0) {
+        unlink(temp_path.c_str());
+        return EXPORT_FAILED;
+    }
+    return EXPORT_WRITTEN;
+}
+
+/**
+ *  Implements EXPORT. The chosen versions are picked under the file system
+ *  lock; the disk writes, which read saved content straight from the packs,
+ *  run afterwards without it.
+ *  as_of is -1 to export the active versions.
+ */
+string export_directory(ShardedFileSystem& system, const string& directory, time_t as_of) {
+    if (mkdir(directory.c_str(), 0755) != 0 && errno != EEXIST) {
+        return "Error: Cannot create directory '" + directory + "'.\n";
+    }
+    vector<vector<ExportedFile>> by_shard(system.shardCount());
+    vector<vector<int>> fds_by_shard(system.shardCount());
+    system.runOnAll([&](FileSystem& fs, int index) {
+        lock_guard<mutex> guard(fs.commandMutex());
+        fs.collectForExport(as_of, by_shard[index], fds_by_shard[index]);
+    });
+    vector<ExportedFile> batch = move(by_shard[0]);
+    for (size_t i = 1; i < by_shard.size(); ++i) {
+        for (ExportedFile& file : by_shard[i]) batch.push_back(move(file));
+    }
+
+    vector<int> outcomes(batch.size(), EXPORT_FAILED);
+    bulk_scheduler().parallelFor(batch.size(), 16, [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i) {
+            if (!is_safe_relative_path(batch[i].name)) {
+                outcomes[i] = EXPORT_UNSAFE_NAME;
+                continue;
+            }
+            outcomes[i] = export_one(directory + "/" + batch[i].name, batch[i]);
+        }
+    });
+    for (const vector<int>& fds : fds_by_shard) {
+        for (int fd : fds) close(fd);
+    }
+
+    long long written = 0, unchanged = 0, failed = 0, unsafe = 0, bytes = 0;
+    for (size_t i = 0; i < batch.size(); ++i) {
+        if (outcomes[i] == EXPORT_WRITTEN) {
+            written++;
+            bytes += batch[i].size();
+        } else if (outcomes[i] == EXPORT_UNCHANGED) {
+            unchanged++;
+        } else if (outcomes[i] == EXPORT_UNSAFE_NAME) {
+            unsafe++;
+        } else {
+            failed++;
+        }
+    }
+    string result = "Exported " + to_string(written) + " files (" + to_string(bytes) + " bytes) to '"
+                    + directory + "', " + to_string(unchanged) + " already up to date.\n";
+    if (unsafe > 0) result += "Skipped " + to_string(unsafe) + " files whose names are not relative paths.\n";
+    if (failed > 0) result += "Error: " + to_string(failed) + " files could not be written.\n";
+    return result;
+}
+
+//==============================================================================
+// PACK STORE
+// Purpose: Persists the FileSystem to a directory. Version contents are
+//          appended as blobs to pack files; everything else (the version
+//          trees, checkpoints and the blob -> location table) is written to a
+//          single index file that replaces the previous one with a rename.
+//          Blobs of freed versions become holes, which COMPACT reclaims by
+//          copying the live blobs of sparse packs into a new pack.
+//
+// Pack record:  u32 length | u64 blob ID | content bytes
+// Index file:   "ANJI" | u32 format | u64 next blob ID | u32 next pack
+//               | u32 packs x (u32 number | u64 size | u64 dead bytes)
+//               | u64 blobs x (u64 ID | u32 pack | u64 offset | u32 length)
+//               | u64 length | FileSystem metadata | u64 FNV-1a of all before
+//               All integers are big-endian.
+//==============================================================================
+
+/**
+ *  Appends big-endian integers and length-prefixed strings to a buffer.
+ */
+class IndexWriter {
+public:
+    string out;
+
+    void u8(uint8_t value) { out += (char)value; }
+    void u32(uint32_t value) {
+        for (int shift = 24; shift >= 0; shift -= 8) out += (char)(value >> shift);
+    }
+    void u64(uint64_t value) {
+        for (int shift = 56; shift >= 0; shift -= 8) out += (char)(value >> shift);
+    }
+    void i64(long long value) { u64((uint64_t)value); }
+    void str(string_view value) {
+        u32((uint32_t)value.size());
+        out += value;
+    }
+};
+
+/**
+ *  Reads what IndexWriter wrote. A read past the end sets `ok` to false and
+ *  returns zeros, so callers check once at the end.
+ */
+class IndexReader {
+private:
+    const char* data;
+    size_t length;
+    size_t pos;
+
+    bool need(size_t bytes) {
+        if (!ok || length - pos < bytes) {
+            ok = false;
+            return false;
+        }
+        return true;
+    }
+
+public:
+    bool ok;
+
+    IndexReader(const char* bytes, size_t size) : data(bytes), length(size), pos(0), ok(true) {}
+
+    uint8_t u8() { return need(1) ? (uint8_t)data[pos++] : 0; }
+    uint32_t u32() {
+        if (!need(4)) return 0;
+        uint32_t value = 0;
+        for (int i = 0; i < 4; ++i) value = (value << 8) | (unsigned char)data[pos++];
+        return value;
+    }
+    uint64_t u64() {
+        if (!need(8)) return 0;
+        uint64_t value = 0;
+        for (int i = 0; i < 8; ++i) value = (value << 8) | (unsigned char)data[pos++];
+        return value;
+    }
+    long long i64() { return (long long)u64(); }
+    string str() {
+        uint32_t size = u32();
+        if (!need(size)) return "";
+        string value(data + pos, size);
+        pos += size;
+        return value;
+    }
+    size_t position() const { return pos; }
+    string slice(size_t from, size_t to) const { return string(data + from, to - from); }
+};
+
+struct BlobLocation {
+    long long blob_id;
+    int pack;
+    uint64_t offset;  // Of the record header.
+    uint32_t length;  // Content bytes.
+};
+
+struct PackInfo {
+    uint64_t size = 0;       // Bytes in the file, including record headers.
+    uint64_t dead_bytes = 0; // Bytes of records whose blob was released.
+    int fd = -1;             // -1 once removed.
+};
+
+/**
+ *  Blob reads planned under the FileSystem lock and carried out without it.
+ *  Every pack read from has its own descriptor, so a compaction retiring
+ *  the pack meanwhile does not affect the reads.
+ */
+struct BlobRead {
+    long long blob_id;
+    int fd;
+    uint64_t offset;  // Of the content.
+    uint32_t length;
+};
+
+class ReadPlan {
+public:
+    vector<BlobRead> reads;
+    vector<int> fds; // Closed with the plan.
+
+    ReadPlan() {}
+    ~ReadPlan() {
+        for (int fd : fds) close(fd);
+    }
+    ReadPlan(const ReadPlan&) = delete;
+    ReadPlan& operator=(const ReadPlan&) = delete;
+
+    bool read(const BlobRead& blob, string& out) const {
+        out.resize(blob.length);
+        return pread_all(blob.fd, &out[0], blob.length, blob.offset);
+    }
+};
+
+/**
+ *  A compaction in progress. The copy runs without the FileSystem lock, so the
+ *  job carries everything it needs between the three phases.
+ */
+struct CompactionJob {
+    vector<int> victims;          // Packs being emptied.
+    vector<PackInfo> victim_info; // Their fd and size, copied in phase 1: `packs` may grow and move.
+    int output_pack = 0;          // Where their live blobs go.
+    int output_fd = -1;
+    vector<BlobLocation> moved;   // New location of every copied blob.
+    uint64_t bytes_before = 0;    // Total size of the victims.
+    uint64_t bytes_copied = 0;    // Size of the output pack.
+    double copy_seconds = 0;
+};
+
+class PackStore {
+private:
+    string directory;
+    HashMap<long long, BlobLocation> blobs;
+    vector<PackInfo> packs;       // Indexed by pack number; slot 0 is unused.
+    int active_pack;              // New blobs are appended here.
+    string pending;               // Appended records not yet written to the active pack.
+    uint64_t pending_offset;      // File offset where `pending` starts.
+    long long next_blob_id;
+    long long live_bytes;
+    bool compacting;              // A compaction is between begin and finish.
+
+    static const uint32_t RECORD_HEADER = 12;
+    static const uint64_t PACK_TARGET_BYTES = 64ull << 20; // Start a new pack past this.
+    static const size_t FLUSH_BYTES = 1 << 20;
+
+    string packPath(int number) const {
+        char name[32];
+        snprintf(name, sizeof(name), "/pack-%06d.dat", number);
+        return directory + name;
+    }
+
+    int createPack() {
+        int number = (int)packs.size();
+        packs.emplace_back();
+        packs[number].fd = ::open(packPath(number).c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        return packs[number].fd < 0 ? -1 : number;
+    }
+
+    bool flushPending() {
+        if (pending.empty()) return true;
+        if (!pwrite_all(packs[active_pack].fd, pending.data(), pending.size(), pending_offset)) return false;
+        pending_offset += pending.size();
+        pending.clear();
+        return true;
+    }
+
+public:
+    PackStore() : blobs(1024), active_pack(0), pending_offset(0), next_blob_id(1), live_bytes(0), compacting(false) {}
+
+    ~PackStore() {
+        flushPending();
+        for (PackInfo& pack : packs) {
+            if (pack.fd >= 0) close(pack.fd);
+        }
+    }
+
+    PackStore(const PackStore&) = delete;
+    PackStore& operator=(const PackStore&) = delete;
+
+    /**
+     *  Opens (or creates) a store directory and returns the FileSystem
+     *  metadata from its index, empty for a new store. Pack files the index
+     *  does not list are leftovers of an interrupted save and are removed.
+     */
+    bool open(const string& dir, string& metadata, string& error) {
+        directory = dir;
+        if (mkdir(dir.c_str(), 0755) != 0 && errno != EEXIST) {
+            error = "cannot create directory";
+            return false;
+        }
+        packs.resize(1);
+        string index;
+        string index_path = dir + "/index";
+        struct stat info;
+        if (stat(index_path.c_str(), &info) == 0) {
+            if (!read_whole_file(index_path, index)) {
+                error = "cannot read index";
+                return false;
+            }
+            if (index.size() < 8 || fnv1a_hash(index.data(), index.size() - 8)
+                                    != IndexReader(index.data() + index.size() - 8, 8).u64()) {
+                error = "index checksum mismatch";
+                return false;
+            }
+            IndexReader in(index.data(), index.size() - 8);
+            if (in.str() != "ANJI" || in.u32() != 1) {
+                error = "unknown index format";
+                return false;
+            }
+            next_blob_id = in.i64();
+            packs.resize(in.u32());
+            for (uint32_t count = in.u32(); count > 0 && in.ok; --count) {
+                uint32_t number = in.u32();
+                if (number == 0 || number >= packs.size()) {
+                    in.ok = false;
+                    break;
+                }
+                packs[number].size = in.u64();
+                packs[number].dead_bytes = in.u64();
+                packs[number].fd = ::open(packPath(number).c_str(), O_RDWR | O_CLOEXEC);
+                if (packs[number].fd < 0) {
+                    error = "missing pack " + to_string(number);
+                    return false;
+                }
+            }
+            uint64_t blob_count = in.u64();
+            blobs.reserve((int)custom_max<uint64_t>(blob_count, 16));
+            for (uint64_t i = 0; i < blob_count && in.ok; ++i) {
+                BlobLocation location;
+                location.blob_id = in.i64();
+                location.pack = (int)in.u32();
+                location.offset = in.u64();
+                location.length = in.u32();
+                blobs.put(location.blob_id, location);
+                live_bytes += location.length;
+            }
+            uint64_t metadata_length = in.u64();
+            if (in.ok && metadata_length == index.size() - 8 - in.position()) {
+                metadata = index.substr(in.position(), metadata_length);
+            } else {
+                in.ok = false;
+            }
+            if (!in.ok) {
+                error = "index is truncated";
+                return false;
+            }
+        }
+        // Remove packs an interrupted save or compaction left behind.
+        DIR* listing = opendir(dir.c_str());
+        if (listing != nullptr) {
+            while (dirent* entry = readdir(listing)) {
+                int number;
+                if (sscanf(entry->d_name, "pack-%d.dat", &number) != 1) continue;
+                if (number <= 0 || number >= (int)packs.size() || packs[number].fd < 0) {
+                    unlink((dir + "/" + entry->d_name).c_str());
+                }
+            }
+            closedir(listing);
+        }
+        // Keep appending to the newest pack while it has room. Bytes past its
+        // recorded size were never committed, so they are cut off first.
+        for (int number = (int)packs.size() - 1; number > 0; --number) {
+            if (packs[number].fd < 0) continue;
+            if (packs[number].size < PACK_TARGET_BYTES && ftruncate(packs[number].fd, packs[number].size) == 0) {
+                active_pack = number;
+                pending_offset = packs[number].size;
+                return true;
+            }
+            break;
+        }
+        active_pack = createPack();
+        if (active_pack < 0) {
+            error = "cannot create pack file";
+            return false;
+        }
+        return true;
+    }
+
+    /**
+     *  Appends a blob and returns its ID. The bytes reach the file by the
+     *  next commit at the latest.
+     */
+    long long put(const string& content) {
+        if (packs[active_pack].size >= PACK_TARGET_BYTES) {
+            flushPending();
+            int fresh = createPack();
+            if (fresh > 0) {
+                active_pack = fresh;
+                pending_offset = 0;
+            }
+        }
+        long long blob_id = next_blob_id++;
+        BlobLocation location = {blob_id, active_pack, packs[active_pack].size, (uint32_t)content.size()};
+        IndexWriter header;
+        header.u32(location.length);
+        header.i64(blob_id);
+        pending += header.out;
+        pending += content;
+        packs[active_pack].size += RECORD_HEADER + content.size();
+        blobs.put(blob_id, location);
+        live_bytes += content.size();
+        if (pending.size() >= FLUSH_BYTES) flushPending();
+        return blob_id;
+    }
+
+    bool has(long long blob_id) const { return blobs.containsKey(blob_id); }
+
+    /**
+     *  Plans reading `blob_ids` without the FileSystem lock. Records not yet
+     *  written to the active pack are written first. Returns false if a blob
+     *  is missing or a pack cannot be read; `plan` then holds the others.
+     */
+    bool planReads(const vector<long long>& blob_ids, ReadPlan& plan) {
+        HashMap<int, int> pack_fds; // Pack number -> the plan's descriptor.
+        bool ok = true;
+        for (long long blob_id : blob_ids) {
+            if (!blobs.containsKey(blob_id)) {
+                ok = false;
+                continue;
+            }
+            BlobLocation location = blobs.get(blob_id);
+            if (location.pack == active_pack && location.offset + RECORD_HEADER >= pending_offset && !flushPending()) {
+                ok = false;
+                continue;
+            }
+            if (!pack_fds.containsKey(location.pack)) {
+                int fd = fcntl(packs[location.pack].fd, F_DUPFD_CLOEXEC, 0);
+                if (fd < 0) {
+                    ok = false;
+                    continue;
+                }
+                plan.fds.push_back(fd);
+                pack_fds.put(location.pack, fd);
+            }
+            plan.reads.push_back({blob_id, pack_fds.get(location.pack), location.offset + RECORD_HEADER, location.length});
+        }
+        return ok;
+    }
+
+    /**
+     *  Reads a blob's content.
+     */
+    bool get(long long blob_id, string& out) {
+        if (!blobs.containsKey(blob_id)) return false;
+        BlobLocation location = blobs.get(blob_id);
+        out.resize(location.length);
+        uint64_t start = location.offset + RECORD_HEADER;
+        if (location.pack == active_pack && start >= pending_offset) {
+            memcpy(&out[0], pending.data() + (start - pending_offset), location.length);
+            return true;
+        }
+        if (location.pack == active_pack && !flushPending()) return false;
+        return pread_all(packs[location.pack].fd, &out[0], location.length, start);
+    }
+
+    /**
+     *  Forgets a blob. Its record stays in the pack as a hole until compaction.
+     */
+    void release(long long blob_id) {
+        if (!blobs.containsKey(blob_id)) return;
+        BlobLocation location = blobs.get(blob_id);
+        packs[location.pack].dead_bytes += RECORD_HEADER + location.length;
+        live_bytes -= location.length;
+        blobs.remove(blob_id);
+    }
+
+    /**
+     *  Makes the packs durable, then atomically replaces the index with one
+     *  holding `metadata`.
+     */
+    bool commit(const string& metadata, string& error) {
+        if (!flushPending()) {
+            error = "cannot write pack";
+            return false;
+        }
+        for (PackInfo& pack : packs) {
+            if (pack.fd >= 0 && fdatasync(pack.fd) != 0) {
+                error = "cannot sync pack";
+                return false;
+            }
+        }
+        IndexWriter out;
+        out.str("ANJI");
+        out.u32(1);
+        out.i64(next_blob_id);
+        out.u32((uint32_t)packs.size());
+        uint32_t open_packs = 0;
+        for (const PackInfo& pack : packs) {
+            if (pack.fd >= 0) open_packs++;
+        }
+        out.u32(open_packs);
+        for (size_t number = 1; number < packs.size(); ++number) {
+            if (packs[number].fd < 0) continue;
+            out.u32((uint32_t)number);
+            out.u64(packs[number].size);
+            out.u64(packs[number].dead_bytes);
+        }
+        vector<BlobLocation> all = blobs.getValues();
+        out.u64(all.size());
+        for (const BlobLocation& location : all) {
+            out.i64(location.blob_id);
+            out.u32((uint32_t)location.pack);
+            out.u64(location.offset);
+            out.u32(location.length);
+        }
+        out.u64(metadata.size());
+        out.out += metadata;
+        out.u64(fnv1a_hash(out.out.data(), out.out.size()));
+
+        string temp_path = directory + "/index.tmp";
+        int fd = ::open(temp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        bool ok = fd >= 0 && pwrite_all(fd, out.out.data(), out.out.size(), 0) && fsync(fd) == 0;
+        if (fd >= 0) close(fd);
+        if (!ok || rename(temp_path.c_str(), (directory + "/index").c_str()) != 0) {
+            unlink(temp_path.c_str());
+            error = "cannot write index";
+            return false;
+        }
+        int dir_fd = ::open(directory.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (dir_fd >= 0) {
+            fsync(dir_fd); // Make the rename itself durable.
+            close(dir_fd);
+        }
+        return true;
+    }
+
+    /**
+     *  Phase 1 (FileSystem lock held): picks the packs where at least a
+     *  quarter of the bytes are holes, and creates the output pack. The active
+     *  pack is sealed first if it qualifies. Returns false if nothing needs
+     *  compacting.
+     */
+    bool beginCompaction(CompactionJob& job) {
+        const PackInfo& active = packs[active_pack];
+        if (active.dead_bytes > 0 && active.dead_bytes * 4 >= active.size) {
+            flushPending();
+            int fresh = createPack();
+            if (fresh < 0) return false;
+            active_pack = fresh;
+            pending_offset = 0;
+        }
+        for (size_t number = 1; number < packs.size(); ++number) {
+            const PackInfo& pack = packs[number];
+            if ((int)number == active_pack || pack.fd < 0 || pack.dead_bytes == 0) continue;
+            if (pack.dead_bytes * 4 < pack.size) continue;
+            job.victims.push_back((int)number);
+            job.bytes_before += pack.size;
+        }
+        if (job.victims.empty()) return false;
+        job.output_pack = createPack();
+        compacting = job.output_pack > 0;
+        if (!compacting) return false;
+        for (int victim : job.victims) job.victim_info.push_back(packs[victim]);
+        job.output_fd = packs[job.output_pack].fd;
+        return true;
+    }
+
+    /**
+     *  Phase 2 (no FileSystem lock): streams each victim and copies the records
+     *  that are still live into the output pack. `owner_lock` is taken briefly
+     *  per chunk to check liveness. Copying is paced to `bytes_per_second`
+     *  (0 means unlimited) so foreground I/O keeps its share of the disk.
+     *  Only the job is used outside the lock, never `packs`: a foreground
+     *  put() may add a pack and move the others meanwhile.
+     */
+    bool copyLive(CompactionJob& job, mutex& owner_lock, double bytes_per_second) {
+        const size_t CHUNK = 4 << 20;
+        auto start = chrono::steady_clock::now();
+        string buffer;
+        string output;
+        for (size_t v = 0; v < job.victims.size(); ++v) {
+            int victim = job.victims[v];
+            int fd = job.victim_info[v].fd;
+            uint64_t size = job.victim_info[v].size;
+            uint64_t offset = 0;
+            while (offset < size) {
+                // Read a chunk; a record larger than the chunk is read whole.
+                size_t length = size - offset < CHUNK ? (size_t)(size - offset) : CHUNK;
+                buffer.resize(length);
+                if (!pread_all(fd, &buffer[0], length, offset)) return false;
+                size_t record_end = RECORD_HEADER + IndexReader(buffer.data(), RECORD_HEADER).u32();
+                if (record_end > length) {
+                    buffer.resize(record_end);
+                    if (!pread_all(fd, &buffer[0], record_end, offset)) return false;
+                    length = record_end;
+                }
+
+                // Pick out the live records of this chunk.
+                output.clear();
+                size_t pos = 0;
+                {
+                    lock_guard<mutex> guard(owner_lock);
+                    while (length - pos >= RECORD_HEADER) {
+                        IndexReader header(buffer.data() + pos, RECORD_HEADER);
+                        uint32_t content_length = header.u32();
+                        long long blob_id = header.i64();
+                        if (length - pos - RECORD_HEADER < content_length) break; // Continues in the next chunk.
+                        if (blobs.containsKey(blob_id)) {
+                            BlobLocation location = blobs.get(blob_id);
+                            if (location.pack == victim && location.offset == offset + pos) {
+                                uint64_t new_offset = job.bytes_copied + output.size(); // The output starts empty.
+                                job.moved.push_back({blob_id, job.output_pack, new_offset, content_length});
+                                output.append(buffer.data() + pos, RECORD_HEADER + content_length);
+                            }
+                        }
+                        pos += RECORD_HEADER + content_length;
+                    }
+                }
+                if (!pwrite_all(job.output_fd, output.data(), output.size(), job.bytes_copied)) return false;
+                job.bytes_copied += output.size();
+                offset += pos;
+
+                // Pace to the requested rate.
+                if (bytes_per_second > 0) {
+                    double target = (double)job.bytes_copied / bytes_per_second;
+                    double elapsed = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+                    if (target > elapsed) this_thread::sleep_for(chrono::duration<double>(target - elapsed));
+                }
+            }
+        }
+        if (fdatasync(job.output_fd) != 0) return false;
+        job.copy_seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        return true;
+    }
+
+    /**
+     *  Phase 3 (FileSystem lock held): points the copied blobs at the output
+     *  pack and retires the victims. Blobs released during the copy leave a
+     *  hole in the output pack instead. The victims' files are unlinked by
+     *  removeRetired() once the new index is committed.
+     */
+    void finishCompaction(CompactionJob& job) {
+        packs[job.output_pack].size = job.bytes_copied;
+        for (const BlobLocation& moved : job.moved) {
+            if (blobs.containsKey(moved.blob_id)) {
+                blobs.put(moved.blob_id, moved);
+            } else {
+                packs[job.output_pack].dead_bytes += RECORD_HEADER + moved.length;
+            }
+        }
+        for (int victim : job.victims) {
+            close(packs[victim].fd);
+            packs[victim].fd = -1;
+        }
+        compacting = false;
+    }
+
+    void removeRetired(const CompactionJob& job) {
+        for (int victim : job.victims) unlink(packPath(victim).c_str());
+    }
+
+    /**
+     *  Abandons a failed compaction, discarding its output pack.
+     */
+    void abortCompaction(CompactionJob& job) {
+        if (job.output_pack <= 0) return;
+        close(packs[job.output_pack].fd);
+        packs[job.output_pack].fd = -1;
+        unlink(packPath(job.output_pack).c_str());
+        compacting = false;
+    }
+
+    bool isCompacting() const { return compacting; }
+
+    // Figures for STATS.
+    int packCount() const {
+        int count = 0;
+        for (const PackInfo& pack : packs) {
+            if (pack.fd >= 0) count++;
+        }
+        return count;
+    }
+    int blobCount() const { return blobs.size(); }
+    long long liveBytes() const { return live_bytes; }
+    uint64_t deadBytes() const {
+        uint64_t dead = 0;
+        for (const PackInfo& pack : packs) {
+            if (pack.fd >= 0) dead += pack.dead_bytes;
+        }
+        return dead;
+    }
+    const string& getDirectory() const { return directory; }
+};
+
+//------------------------------------------------------------------------------
+// Persistence methods of File and FileSystem.
+//------------------------------------------------------------------------------
+
+int File::persist(PackStore& store, long long& bytes) {
+    if (!isLoaded()) return 0; // Everything in a stub is already saved.
+    int written = 0;
+    for (int id = 0; id < total_versions; ++id) {
+        if (!version_map.containsKey(id)) continue;
+        VersionNode* node = version_map.get(id);
+        if (node->blob_id != -1) continue;
+        node->blob_id = store.put(node->content);
+        bytes += node->content.size();
+        written++;
+    }
+    return written;
+}
+
+void File::serialize(IndexWriter& out) const {
+    out.str(filename);
+    out.u32((uint32_t)total_versions);
+    out.u32((uint32_t)getActiveVersionId());
+    out.i64(last_modification_time);
+    out.u8(checkpoint_dirty ? 1 : 0);
+    out.u32((uint32_t)pinned_versions.size());
+    for (int id : pinned_versions) out.u32((uint32_t)id);
+    if (!isLoaded()) {
+        out.out += lazy_tree; // Unchanged since it was read.
+        return;
+    }
+    writeTree(out);
+}
+
+void File::writeTree(IndexWriter& out) const {
+    // Parents are written before their children.
+    out.u32((uint32_t)version_map.size());
+    vector<VersionNode*> stack = {root};
+    while (!stack.empty()) {
+        VersionNode* node = stack.back();
+        stack.pop_back();
+        out.u32((uint32_t)node->version_id);
+        out.u32(node->parent ? (uint32_t)node->parent->version_id : UINT32_MAX);
+        out.u32(node->merge_parent ? (uint32_t)node->merge_parent->version_id : UINT32_MAX);
+        out.i64(node->created_timestamp);
+        out.i64(node->snapshot_timestamp);
+        out.str(node->message.view());
+        out.i64(node->blob_id);
+        for (VersionNode* child = node->first_child; child != nullptr; child = child->next_sibling) {
+            stack.push_back(child);
+        }
+    }
+}
+
+bool File::deserialize(IndexReader& in, PackStore& store) {
+    // Replace the root the constructor made; the stored tree comes later.
+    deleteTree(root);
+    version_map.clear();
+    time_index.clear();
+    root = nullptr;
+    active_version = nullptr;
+    resident_bytes = 0;
+
+    filename = in.str();
+    total_versions = (int)in.u32();
+    uint32_t active_id = in.u32();
+    last_modification_time = in.i64();
+    checkpoint_dirty = in.u8() != 0;
+    for (uint32_t count = in.u32(); count > 0 && in.ok; --count) pinned_versions.push_back((int)in.u32());
+    size_t tree_start = in.position();
+    if (!readTree(in, store, false, active_id)) return false;
+    lazy_store = &store;
+    lazy_tree = in.slice(tree_start, in.position());
+    stub_active_id = (int)active_id;
+    stub_live_versions = (int)IndexReader(lazy_tree.data(), 4).u32();
+    return true;
+}
+
+bool File::readTree(IndexReader& in, PackStore& store, bool build, uint32_t active_id, FetchedBlobs* fetched) {
+    uint32_t node_count = in.u32();
+    vector<char> seen(in.ok ? total_versions : 0, 0);
+    vector<VersionNode*> by_id(build ? seen.size() : 0, nullptr);
+    vector<pair<uint32_t, uint32_t>> merges; // (version, merge parent): it may sit in a branch written later.
+    bool has_root = false;
+    for (uint32_t i = 0; i < node_count && in.ok; ++i) {
+        uint32_t id = in.u32();
+        uint32_t parent_id = in.u32();
+        uint32_t merge_id = in.u32();
+        time_t created = in.i64();
+        time_t snapshotted = in.i64();
+        string message = in.str();
+        long long blob_id = in.i64();
+        bool valid = in.ok && id < seen.size() && !seen[id]
+                     && (parent_id == UINT32_MAX ? !has_root : parent_id < seen.size() && seen[parent_id])
+                     && (merge_id == UINT32_MAX || merge_id < seen.size())
+                     && store.has(blob_id);
+        if (!valid) {
+            in.ok = false;
+            break;
+        }
+        seen[id] = 1;
+        if (parent_id == UINT32_MAX) has_root = true;
+        if (merge_id != UINT32_MAX) merges.push_back({id, merge_id});
+        if (!build) continue;
+        string content;
+        if (fetched == nullptr || !fetched->take(blob_id, content)) {
+            store.get(blob_id, content); // Checked when the stub was read; a read error leaves it empty.
+        }
+        VersionNode* parent = parent_id == UINT32_MAX ? nullptr : by_id[parent_id];
+        VersionNode* node = new VersionNode((int)id, move(content), parent);
+        node->created_timestamp = created;
+        node->snapshot_timestamp = snapshotted;
+        node->message = message;
+        node->blob_id = blob_id;
+        if (parent == nullptr) root = node;
+        else parent->addChild(node);
+        by_id[id] = node;
+        version_map.put((int)id, node);
+    }
+    for (const pair<uint32_t, uint32_t>& merge : merges) {
+        if (!seen[merge.second]) in.ok = false;
+    }
+    if (!in.ok || !has_root || active_id >= seen.size() || !seen[active_id]) {
+        in.ok = false;
+        return false;
+    }
+    if (!build) return true;
+    for (const pair<uint32_t, uint32_t>& merge : merges) by_id[merge.first]->merge_parent = by_id[merge.second];
+    active_version = by_id[active_id];
+    for (VersionNode* node : by_id) {
+        if (node != nullptr) time_index.append(node->created_timestamp, node->version_id);
+    }
+    return true;
+}
+
+void File::ensureLoaded(FetchedBlobs* fetched) const {
+    if (isLoaded()) return;
+    TraceSpan span("File::load");
+    File* self = const_cast<File*>(this); // Loading does not change what the file holds.
+    IndexReader in(lazy_tree.data(), lazy_tree.size());
+    self->readTree(in, *lazy_store, true, (uint32_t)stub_active_id, fetched);
+    self->lazy_store = nullptr;
+    string().swap(self->lazy_tree);
+    self->recount();
+    if (resident != nullptr) {
+        resident->add(self);
+        resident->loads++;
+    }
+}
+
+void File::evict(PackStore& store) {
+    if (!isLoaded()) return;
+    TraceSpan span("File::evict");
+    IndexWriter out;
+    writeTree(out);
+    if (in_resident_list) {
+        resident->remove(this);
+        resident->evictions++;
+    }
+    stub_active_id = active_version->version_id;
+    stub_live_versions = version_map.size();
+    deleteTree(root);
+    version_map.reset(16);
+    time_index.clear();
+    time_index.shrink();
+    for (vector<int>* origins : blame_cache.getValues()) delete origins;
+    blame_cache.reset(16);
+    root = nullptr;
+    active_version = nullptr;
+    resident_bytes = 0;
+    lazy_tree = move(out.out);
+    lazy_tree.shrink_to_fit();
+    lazy_store = &store;
+}
+
+void File::setResidentSet(ResidentSet* set) {
+    if (in_resident_list) resident->remove(this);
+    resident = set;
+    if (resident != nullptr && isLoaded()) resident->add(this);
+}
+
+void ResidentSet::add(File* file) {
+    file->resident_prev = nullptr;
+    file->resident_next = head;
+    if (head != nullptr) head->resident_prev = file;
+    head = file;
+    if (tail == nullptr) tail = file;
+    file->in_resident_list = true;
+    adjust(file->resident_bytes);
+    files++;
+}
+
+void ResidentSet::remove(File* file) {
+    if (file->resident_prev != nullptr) file->resident_prev->resident_next = file->resident_next;
+    else head = file->resident_next;
+    if (file->resident_next != nullptr) file->resident_next->resident_prev = file->resident_prev;
+    else tail = file->resident_prev;
+    file->resident_prev = file->resident_next = nullptr;
+    file->in_resident_list = false;
+    adjust(-file->resident_bytes);
+    files--;
+}
+
+void ResidentSet::touch(File* file) {
+    if (!file->in_resident_list || head == file) return;
+    remove(file);
+    add(file);
+}
+
+void File::stubBlobIds(vector<long long>& out) const {
+    // Pick the blob IDs out of the serialized nodes; no content is read.
+    IndexReader in(lazy_tree.data(), lazy_tree.size());
+    for (uint32_t count = in.u32(); count > 0; --count) {
+        in.u32();
+        in.u32();
+        in.u32();
+        in.i64();
+        in.i64();
+        in.str();
+        out.push_back(in.i64());
+    }
+}
+
+bool File::stubBlobAt(time_t as_of, long long& blob_id) const {
+    vector<long long> blobs(total_versions, -1);
+    vector<time_t> created(total_versions, 0);
+    vector<char> present(total_versions, 0);
+    IndexReader in(lazy_tree.data(), lazy_tree.size());
+    for (uint32_t count = in.u32(); count > 0 && in.ok; --count) {
+        uint32_t id = in.u32();
+        in.u32();
+        in.u32();
+        time_t when = in.i64();
+        in.i64();
+        in.str();
+        long long blob = in.i64();
+        if (id >= (uint32_t)total_versions) continue; // Checked when the stub was read.
+        blobs[id] = blob;
+        created[id] = when;
+        present[id] = 1;
+    }
+    int found = as_of == -1 ? stub_active_id : -1;
+    if (as_of != -1) {
+        // The same walk in ID order, with clock steps clamped, as the time
+        // index built by loading.
+        time_t latest = 0;
+        bool any = false;
+        for (int id = 0; id < total_versions; ++id) {
+            if (!present[id]) continue;
+            latest = any && created[id] < latest ? latest : created[id];
+            any = true;
+            if (latest <= as_of) found = id;
+        }
+    }
+    if (found < 0 || found >= total_versions || !present[found]) return false;
+    blob_id = blobs[found];
+    return true;
+}
+
+void File::releaseAllBlobs(vector<long long>& out) {
+    for (long long blob_id : released_blobs) out.push_back(blob_id);
+    released_blobs.clear();
+    if (!isLoaded()) {
+        stubBlobIds(out);
+        return;
+    }
+    for (int id = 0; id < total_versions; ++id) {
+        if (!version_map.containsKey(id)) continue;
+        VersionNode* node = version_map.get(id);
+        if (node->blob_id != -1) out.push_back(node->blob_id);
+        node->blob_id = -1;
+    }
+}
+
+string FileSystem::openStore(const string& directory) {
+    TraceSpan span("FileSystem::openStore");
+    if (store != nullptr) return "Error: A store is already open.\n";
+    if (files.size() > 0) return "Error: A store can only be opened by an empty file system.\n";
+    PackStore* opened = new PackStore();
+    string metadata, error;
+    if (!opened->open(directory, metadata, error)) {
+        delete opened;
+        return "Error: Cannot open store '" + directory + "': " + error + ".\n";
+    }
+    store = opened;
+    if (metadata.empty()) return "Created store '" + directory + "'.\n";
+
+    IndexReader in(metadata.data(), metadata.size());
+    long long versions = 0;
+    for (uint32_t count = in.u32(); count > 0 && in.ok; --count) {
+        File* file = new File("");
+        if (!file->deserialize(in, *store)) {
+            delete file;
+            break;
+        }
+        addFile(file);
+        if (file->isCheckpointDirty()) dirty_files.push_back(file->getId());
+        file->setSearchPending(true);
+        unindexed_files.push_back(file->getId());
+        versions += file->getLiveVersionCount();
+    }
+    for (uint32_t count = in.u32(); count > 0 && in.ok; --count) {
+        GlobalCheckpoint checkpoint;
+        checkpoint.tag = in.str();
+        checkpoint.timestamp = in.i64();
+        checkpoint.previous = (int)in.u32();
+        for (uint32_t entries = in.u32(); entries > 0 && in.ok; --entries) {
+            string name = in.str();
+            int version_id = (int)in.u32();
+            if (!files.containsKey(name)) continue;
+            checkpoint.changed_files.push_back(files.get(name)->getId());
+            checkpoint.version_ids.push_back(version_id);
+        }
+        checkpoint_by_tag.put(checkpoint.tag, (int)checkpoints.size());
+        checkpoints.push_back(move(checkpoint));
+    }
+    if (!in.ok) {
+        return "Error: Store '" + directory + "' has a damaged index; loaded " + to_string(files.size())
+               + " files before the damage.\n";
+    }
+    stats.versions_created += versions;
+    return "Opened store '" + directory + "' (" + to_string(files.size()) + " files, "
+           + to_string(versions) + " versions).\n";
+}
+
+string ShardedFileSystem::openStore(const string& directory) {
+    string marker_path = directory + "/SHARDS";
+    string recorded;
+    bool sharded_store = read_whole_file(marker_path, recorded);
+    int recorded_count = sharded_store ? atoi(recorded.c_str()) : 1;
+    struct stat info;
+    if (!sharded_store && stat((directory + "/index").c_str(), &info) == 0) recorded_count = 1;
+    else if (!sharded_store) recorded_count = (int)shards.size(); // A new store.
+    if (recorded_count != (int)shards.size()) {
+        return "Error: Store '" + directory + "' was written with " + to_string(recorded_count)
+               + (recorded_count == 1 ? " shard" : " shards") + "; start with --shards " + to_string(recorded_count)
+               + ".\n";
+    }
+    if (shards.size() == 1) return shards[0]->fs.openStore(directory);
+
+    if (mkdir(directory.c_str(), 0755) != 0 && errno != EEXIST) {
+        return "Error: Cannot create store directory '" + directory + "'.\n";
+    }
+    if (!sharded_store) {
+        string count = to_string(shards.size()) + "\n";
+        int fd = open(marker_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        bool ok = fd >= 0 && write(fd, count.data(), count.size()) == (ssize_t)count.size();
+        if (fd >= 0 && close(fd) != 0) ok = false;
+        if (!ok) return "Error: Cannot write '" + marker_path + "'.\n";
+    }
+    string result = "";
+    for (size_t i = 0; i < shards.size(); ++i) {
+        string opened = shards[i]->fs.openStore(directory + "/shard-" + to_string(i));
+        if (opened.compare(0, 6, "Error:") == 0) return opened;
+        result += opened;
+    }
+    return result;
+}
+
+void FileSystem::closeStore() {
+    delete store;
+    store = nullptr;
+}
+
+string FileSystem::storeReport(bool as_json) {
+    if (store == nullptr) return "";
+    if (as_json) {
+        return ",\"store_packs\":" + to_string(store->packCount())
+               + ",\"store_blobs\":" + to_string(store->blobCount())
+               + ",\"store_live_bytes\":" + to_string(store->liveBytes())
+               + ",\"store_dead_bytes\":" + to_string(store->deadBytes());
+    }
+    return "Store: " + to_string(store->packCount()) + " packs, " + to_string(store->blobCount()) + " blobs, "
+           + to_string(store->liveBytes()) + " live bytes, " + to_string(store->deadBytes()) + " dead bytes\n";
+}
+
+string FileSystem::serializeMetadata() {
+    IndexWriter out;
+    vector<File*> all_files = files.getValues();
+    out.u32((uint32_t)all_files.size());
+    for (File* file : all_files) file->serialize(out);
+    out.u32((uint32_t)checkpoints.size());
+    for (const GlobalCheckpoint& checkpoint : checkpoints) {
+        out.str(checkpoint.tag);
+        out.i64(checkpoint.timestamp);
+        out.u32((uint32_t)checkpoint.previous);
+        // Files are recorded by their current name; deleted ones are dropped.
+        uint32_t live = 0;
+        for (int id : checkpoint.changed_files) live += files_by_id.containsKey(id) ? 1 : 0;
+        out.u32(live);
+        for (size_t i = 0; i < checkpoint.changed_files.size(); ++i) {
+            File* file = fileById(checkpoint.changed_files[i]);
+            if (file == nullptr) continue;
+            out.str(file->getName());
+            out.u32((uint32_t)checkpoint.version_ids[i]);
+        }
+    }
+    return out.out;
+}
+
+string FileSystem::save() {
+    TraceSpan span("FileSystem::save");
+    ScopedLatency timer(stats.command_latency[CMD_SAVE]);
+    if (store == nullptr) return "Error: No store is open. Start with --store <directory>.\n";
+    int blobs_written = 0;
+    long long bytes = 0;
+    reclaimer.drain(); // Deleted files hand back their blobs once freed.
+    for (long long blob_id : reclaimer.takeReleasedBlobs()) store->release(blob_id);
+    for (File* file : files.getValues()) {
+        for (long long blob_id : file->takeReleasedBlobs()) store->release(blob_id);
+        blobs_written += file->persist(*store, bytes);
+    }
+    string error;
+    if (!store->commit(serializeMetadata(), error)) return "Error: Save failed: " + error + ".\n";
+    return "Saved " + to_string(blobs_written) + " new versions (" + to_string(bytes) + " bytes) to '"
+           + store->getDirectory() + "'.\n";
+}
+
+size_t FileSystem::prefetchGcStubs(size_t count, FetchedBlobs& fetched) {
+    ReadPlan plan;
+    size_t end;
+    {
+        lock_guard<mutex> lock(command_lock);
+        auto start = chrono::steady_clock::now();
+        if (gc_cursor == 0 && gc_pass.empty()) {
+            for (File* file : files.getValues()) gc_pass.push_back(file->getId());
+        }
+        end = gc_cursor + count;
+        if (store == nullptr) return end; // Every file is loaded.
+        vector<long long> blob_ids;
+        for (size_t i = gc_cursor; i < gc_pass.size() && i < end; ++i) {
+            File* file = fileById(gc_pass[i]);
+            if (file != nullptr && !file->isLoaded()) file->stubBlobIds(blob_ids);
+        }
+        store->planReads(blob_ids, plan); // A blob left out is read under the lock instead.
+        long long held_ns = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count();
+        gc_max_pause_ns = custom_max(gc_max_pause_ns, held_ns);
+    }
+    string content;
+    for (const BlobRead& blob : plan.reads) {
+        if (plan.read(blob, content)) fetched.add(blob.blob_id, move(content));
+    }
+    return end;
+}
+
+void FileSystem::collectForExport(time_t as_of, vector<ExportedFile>& out, vector<int>& fds) {
+    TraceSpan span("FileSystem::collectForExport");
+    ScopedLatency timer(stats.command_latency[CMD_EXPORT]);
+    vector<File*> all_files = files.getValues();
+    // Pick each file's version in parallel into fixed slots. Stubs are not
+    // loaded: their blob is found in the serialized tree.
+    vector<ExportedFile> slots(all_files.size());
+    vector<long long> blob_of(all_files.size(), -1);
+    vector<char> present(all_files.size(), 0);
+    bulk_scheduler().parallelFor(all_files.size(), 64, [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i) {
+            File* file = all_files[i];
+            if (!file->isLoaded()) {
+                present[i] = file->stubBlobAt(as_of, blob_of[i]);
+                continue;
+            }
+            const VersionNode* version = as_of == -1 ? file->getVersion(file->getActiveVersionId())
+                                                     : file->versionAt(as_of);
+            if (version == nullptr) continue;
+            present[i] = 1;
+            if (store != nullptr && version->blob_id != -1) blob_of[i] = version->blob_id;
+            else slots[i].content = version->content;
+        }
+    });
+
+    vector<long long> blob_ids;
+    for (size_t i = 0; i < all_files.size(); ++i) {
+        if (present[i] && blob_of[i] != -1) blob_ids.push_back(blob_of[i]);
+    }
+    ReadPlan plan;
+    HashMap<long long, int> read_of; // Blob ID -> index into plan.reads.
+    if (!blob_ids.empty()) {
+        store->planReads(blob_ids, plan);
+        read_of.reserve((int)plan.reads.size());
+        for (size_t r = 0; r < plan.reads.size(); ++r) read_of.put(plan.reads[r].blob_id, (int)r);
+    }
+    out.reserve(out.size() + all_files.size());
+    for (size_t i = 0; i < all_files.size(); ++i) {
+        if (!present[i]) continue;
+        slots[i].name = all_files[i]->getName();
+        if (blob_of[i] != -1) {
+            if (read_of.containsKey(blob_of[i])) {
+                const BlobRead& blob = plan.reads[read_of.get(blob_of[i])];
+                slots[i].source_fd = blob.fd;
+                slots[i].source_offset = blob.offset;
+                slots[i].source_length = blob.length;
+            } else {
+                store->get(blob_of[i], slots[i].content); // Could not be planned; a read error leaves it empty.
+            }
+        }
+        out.push_back(move(slots[i]));
+    }
+    for (int fd : plan.fds) fds.push_back(fd);
+    plan.fds.clear(); // The caller closes them once the files are written.
+}
+
+/**
+ *  Implements COMPACT. Victim packs are chosen and the result is committed
+ *  under the file system lock; the copy in between runs without it.
+ */
+string compact_store(FileSystem& fs, double megabytes_per_second) {
+    PackStore* store;
+    CompactionJob job;
+    {
+        lock_guard<mutex> guard(fs.commandMutex());
+        store = fs.getStore();
+        if (store == nullptr) return "Error: No store is open. Start with --store <directory>.\n";
+        if (store->isCompacting()) return "Error: A compaction is already running.\n";
+        fs.save(); // Release the blobs of freed versions first.
+        if (!store->beginCompaction(job)) return "Nothing to compact.\n";
+    }
+    bool copied = store->copyLive(job, fs.commandMutex(), megabytes_per_second * 1024 * 1024);
+
+    lock_guard<mutex> guard(fs.commandMutex());
+    if (!copied) {
+        store->abortCompaction(job);
+        return "Error: Compaction failed while copying; the store is unchanged.\n";
+    }
+    store->finishCompaction(job);
+    string saved = fs.save();
+    if (saved.compare(0, 6, "Error:") == 0) return saved;
+    store->removeRetired(job);
+
+    uint64_t reclaimed = job.bytes_before > job.bytes_copied ? job.bytes_before - job.bytes_copied : 0;
+    double rate = job.copy_seconds > 0 ? job.bytes_copied / job.copy_seconds / (1024 * 1024) : 0;
+    return "Compacted " + to_string(job.victims.size()) + " packs (" + to_string(job.bytes_before)
+           + " bytes) into " + to_string(job.bytes_copied) + " bytes, reclaiming " + to_string(reclaimed)
+           + " bytes. Copied " + to_string(job.moved.size()) + " blobs in " + format_fixed(job.copy_seconds, 3)
+           + " s (" + format_fixed(rate, 2) + " MB/s).\n";
+}
+
+//==============================================================================
+// COMMAND DISPATCH & INPUT PARSING
+// Purpose: Turns one text command into the response the user sees. Shared by
+//          the interactive prompt and the network server.
+//==============================================================================
+
+/**
+ *  A simple, dependency-free parser for command line input.
+ *  line The raw input string.
+ *  command Output reference for the parsed command.
+ *  args Output reference for the vector of arguments.
+ */
+void parse_input(const string& line, string& command, vector<string>& args) {
+    string current_word = "";
+    bool first_word = true;
+
+    for (char c : line) {
+        if (c == ' ') {
+            if (!current_word.empty()) {
+                if (first_word) {
+                    command = current_word;
+                    first_word = false;
+                } else {
+                    args.push_back(current_word);
+                }
+                current_word = "";
+            }
+        } else {
+            current_word += c;
+        }
+    }
+    // Add the last word after the loop finishes.
+    if (!current_word.empty()) {
+        if (first_word) {
+            command = current_word;
+        } else {
+            args.push_back(current_word);
+        }
+    }
+}
+
+/**
+ *  Parses a whole argument as an integer in [low, high]. Returns "" and sets
+ *  `out`, or "Error: Invalid <what>." for anything else: no number, trailing
+ *  characters, or a value out of range.
+ */
+string parse_integer(const string& text, long long low, long long high, long long& out, const string& what) {
+    try {
+        size_t used = 0;
+        long long value = stoll(text, &used);
+        if (used == text.size() && value >= low && value <= high) {
+            out = value;
+            return "";
+        }
+    } catch (const exception& e) {
+    }
+    return "Error: Invalid " + what + ".\n";
+}
+
+/**
+ *  Parses a whole argument as an int; see parse_integer().
+ */
+string parse_int(const string& text, int& out, const string& what, int low = INT_MIN, int high = INT_MAX) {
+    long long value = 0;
+    string error = parse_integer(text, low, high, value, what);
+    if (error.empty()) out = (int)value;
+    return error;
+}
+
+/**
+ *  Parses a whole argument as a finite, non-negative decimal number.
+ */
+string parse_decimal(const string& text, double& out, const string& what) {
+    try {
+        size_t used = 0;
+        double value = stod(text, &used);
+        if (used == text.size() && value >= 0 && value < 1e300) {
+            out = value;
+            return "";
+        }
+    } catch (const exception& e) {
+    }
+    return "Error: Invalid " + what + ".\n";
+}
+
+/**
+ *  Parses a point in time: either Unix seconds or local time written as
+ *  YYYY-MM-DDTHH:MM[:SS]. Returns false if the text is neither.
+ */
+bool parse_timestamp(const string& text, time_t& out) {
+    if (!text.empty() && text.find_first_not_of("0123456789") == string::npos) {
+        long long seconds;
+        if (!parse_integer(text, 0, LLONG_MAX, seconds, "timestamp").empty()) return false;
+        out = (time_t)seconds;
+        return true;
+    }
+    struct tm parts;
+    memset(&parts, 0, sizeof(parts));
+    const char* end = strptime(text.c_str(), "%Y-%m-%dT%H:%M:%S", &parts);
+    if (end == nullptr || *end != '\0') {
+        memset(&parts, 0, sizeof(parts));
+        end = strptime(text.c_str(), "%Y-%m-%dT%H:%M", &parts);
+        if (end == nullptr || *end != '\0') return false;
+    }
+    parts.tm_isdst = -1; // Let mktime work out daylight saving time.
+    out = mktime(&parts);
+    return out != -1;
+}
+
+/**
+ *  Executes a single parsed command against one file system (or shard) and
+ *  returns its output. The file system's command lock is held while the
+ *  command touches the file system, so this is safe to call from several
+ *  threads at once. should_exit is set when the command asks to end the
+ *  session. IMPORT, EXPORT and COMPACT go through the sharded overload below.
+ */
+string execute_command(FileSystem& anuj, const string& command, const vector<string>& args, bool& should_exit) {
+    lock_guard<mutex> guard(anuj.commandMutex());
+    string output = "";
+
+    if (command == "CREATE" && args.size() == 1) {
+        output += anuj.create(args[0]);
+    } else if (command == "READ" && args.size() == 1) {
+        output += anuj.read(args[0]) + "\n";
+    }
+    // Handle commands that can take multi-word content.
+    else if ((command == "INSERT" || command == "UPDATE" || command == "SNAPSHOT") && args.size() >= 2) {
+        string filename = args[0];
+        string message = "";
+        // Reconstruct the multi-word content/message from the arguments.
+        for (size_t i = 1; i < args.size(); ++i) {
+            message += args[i];
+            if (i < args.size() - 1) {
+                message += " ";
+            }
+        }
+        if (command == "INSERT") output += anuj.insert(filename, message);
+        if (command == "UPDATE") output += anuj.update(filename, message);
+        if (command == "SNAPSHOT") output += anuj.snapshot(filename, message);
+    }
+    // Handle GREP; the pattern may contain spaces.
+    else if (command == "GREP" && !args.empty() && !(args[0] == "-E" && args.size() == 1)) {
+        bool as_regex = args[0] == "-E";
+        string pattern = "";
+        for (size_t i = as_regex ? 1 : 0; i < args.size(); ++i) {
+            pattern += args[i];
+            if (i < args.size() - 1) pattern += " ";
+        }
+        output += anuj.grep(pattern, as_regex);
+    }
+    // Handle ROLLBACK with an optional version ID.
+    else if (command == "ROLLBACK" && args.size() >= 1 && args.size() <= 2) {
+        if (args.size() == 1) {
+            output += anuj.rollback(args[0]); // Rollback to parent.
+        } else {
+            int versionId;
+            string error = parse_int(args[1], versionId, "version ID for ROLLBACK");
+            output += error.empty() ? anuj.rollback(args[0], versionId) : error;
+        }
+    } else if (command == "HISTORY" && args.size() == 1) {
+        output += anuj.history(args[0]);
+    }
+    // Handle BLAME with an optional version ID.
+    else if (command == "BLAME" && args.size() >= 1 && args.size() <= 2) {
+        if (args.size() == 1) {
+            output += anuj.blame(args[0]);
+        } else {
+            int versionId;
+            string error = parse_int(args[1], versionId, "version ID for BLAME");
+            output += error.empty() ? anuj.blame(args[0], versionId) : error;
+        }
+    }
+    // System-wide checkpoints.
+    else if (command == "SNAPSHOT_ALL" && args.size() == 1) {
+        output += anuj.snapshotAll(args[0]);
+    } else if (command == "ROLLBACK_ALL" && args.size() == 1) {
+        output += anuj.rollbackAll(args[0]);
+    }
+    // Handle DIFF and MERGE, which both take two version IDs.
+    else if ((command == "DIFF" || command == "MERGE") && args.size() == 3) {
+        int first, second;
+        string error = parse_int(args[1], first, "version ID for " + command);
+        if (error.empty()) error = parse_int(args[2], second, "version ID for " + command);
+        if (!error.empty()) output += error;
+        else if (command == "DIFF") output += anuj.diff(args[0], first, second);
+        else output += anuj.merge(args[0], first, second);
+    }
+    // Point-in-time commands take a timestamp after the filename.
+    else if ((command == "READ_AT" || command == "ROLLBACK_AT") && args.size() == 2) {
+        time_t when;
+        if (!parse_timestamp(args[1], when)) {
+            output += "Error: Invalid timestamp for " + command + ".\n";
+        } else if (command == "READ_AT") {
+            output += anuj.readAt(args[0], when) + "\n";
+        } else {
+            output += anuj.rollbackAt(args[0], when);
+        }
+    }
+    // Handle analytics commands with an optional number.
+    else if (command == "RECENT_FILES" || command == "BIGGEST_TREES") {
+        int num = -1; // Default to showing all files.
+        if (!args.empty() && !parse_int(args[0], num, "number").empty()) {
+            num = -1;
+            output += "Error: Invalid number. Showing all by default.\n";
+        }
+        if (command == "RECENT_FILES") output += anuj.recentFiles(num);
+        if (command == "BIGGEST_TREES") output += anuj.biggestTrees(num);
+    }
+    // Directory commands.
+    else if (command == "LS" && args.size() <= 2 && (args.size() < 2 || args[0] == "-R")) {
+        bool recursive = !args.empty() && args[0] == "-R";
+        string directory = args.size() > (recursive ? 1u : 0u) ? args.back() : "";
+        output += anuj.list(directory, recursive);
+    } else if (command == "DELETE" && args.size() == 2 && args[0] == "-r") {
+        output += anuj.deleteDirectory(args[1]);
+    } else if (command == "DELETE" && args.size() == 1) {
+        output += anuj.deleteFile(args[0]);
+    } else if (command == "RENAME" && args.size() == 2) {
+        output += anuj.rename(args[0], args[1]);
+    }
+    // Handle LIST: all names, a range, or a glob, each with an optional limit.
+    else if (command == "LIST" && args.size() <= 3) {
+        long long limit = -1; // No limit.
+        string error = args.size() == 3 ? parse_integer(args[2], 0, LLONG_MAX, limit, "limit for LIST") : "";
+        if (!error.empty()) {
+            output += error;
+        } else if (!args.empty() && args[0] == "GLOB" && args.size() >= 2) {
+            output += anuj.globNames(args[1], (size_t)limit);
+        } else if (args.empty()) {
+            output += anuj.listNames("", "", false, (size_t)-1);
+        } else if (args.size() >= 2 && args[0] != "GLOB") {
+            // "-" leaves that end of the range open.
+            string from = args[0] == "-" ? "" : args[0];
+            output += anuj.listNames(from, args[1], args[1] != "-", (size_t)limit);
+        } else {
+            output += "Error: Use LIST, LIST <from> <to> [limit] or LIST GLOB <pattern> [limit].\n";
+        }
+    } else if (command == "SAVE" && args.empty()) {
+        output += anuj.save();
+    } else if (command == "STATS" && args.size() <= 1) {
+        if (args.empty() || args[0] == "TEXT") {
+            output += anuj.statsReport(false);
+        } else if (args[0] == "JSON") {
+            output += anuj.statsReport(true);
+        } else {
+            output += "Error: Unknown STATS format. Use TEXT or JSON.\n";
+        }
+    } else if (command == "MEM" && args.size() <= 2) {
+        if (args.empty()) {
+            output += anuj.memoryReport();
+        } else if (args.size() == 1) {
+            output += anuj.fileMemoryReport(args[0]);
+        } else if (args[0] == "BUDGET") {
+            long long megabytes; // At most 2^30 MB (1 PB), so the shift below cannot overflow.
+            string error = parse_integer(args[1], 0, 1LL << 30, megabytes, "number for MEM BUDGET");
+            output += error.empty() ? anuj.setMemoryBudget(megabytes << 20) : error;
+        } else {
+            output += "Error: Unknown MEM option. Use MEM, MEM <filename> or MEM BUDGET <megabytes>.\n";
+        }
+    } else if (command == "GC" && (args.size() <= 1 || (args[0] == "POLICY" && args.size() <= 4))) {
+        if (args.empty() || args[0] == "RUN") {
+            output += anuj.gcRun();
+        } else if (args[0] == "STATUS") {
+            output += anuj.gcStatus();
+        } else if (args[0] == "POLICY" && args.size() >= 3) {
+            int keep_last, daily_days, interval = 0;
+            string error = parse_int(args[1], keep_last, "number for GC POLICY");
+            if (error.empty()) error = parse_int(args[2], daily_days, "number for GC POLICY");
+            if (error.empty() && args.size() == 4) error = parse_int(args[3], interval, "number for GC POLICY");
+            output += error.empty() ? anuj.gcSetPolicy(keep_last, daily_days, interval) : error;
+        } else {
+            output += "Error: Unknown GC option. Use RUN, STATUS or POLICY <keep_last> <daily_days> [interval_seconds].\n";
+        }
+    } else if (command == "TRACE" && args.size() <= 1) {
+        if (args.empty()) {
+            output += Tracer::instance().exportChromeJson();
+        } else if (args[0] == "ON" || args[0] == "OFF") {
+            Tracer::instance().setEnabled(args[0] == "ON");
+            output += string("Tracing ") + (args[0] == "ON" ? "enabled" : "disabled") + ".\n";
+        } else if (args[0] == "CLEAR") {
+            Tracer::instance().clear();
+            output += "Trace buffers cleared.\n";
+        } else {
+            output += "Error: Unknown TRACE option. Use ON, OFF or CLEAR.\n";
+        }
+    } else if (command == "EXIT" || command == "QUIT") {
+        output += "Exiting system.\n";
+        should_exit = true;
+    } else {
+        output += "Error: Unknown command or incorrect arguments.\n";
+    }
+    return output;
+}
+
+/**
+ *  Merges per-shard lists of names into one sorted list.
+ */
+vector<string> merge_shard_names(vector<vector<string>>& parts) {
+    vector<string> merged;
+    for (vector<string>& part : parts) {
+        for (string& name : part) merged.push_back(move(name));
+    }
+    custom_sort(merged);
+    return merged;
+}
+
+/**
+ *  Moves a file between shards for RENAME. The two shards' workers run the
+ *  halves together, so no other command on either shard can slip in between
+ *  the check of the new name and the move.
+ */
+string rename_across_shards(ShardedFileSystem& system, const string& oldName, const string& newName) {
+    int source = system.shardFor(oldName);
+    int target = system.shardFor(newName);
+    atomic<int> phase(0); // 1: target checked the name, 2: source detached, 3: nothing to move.
+    bool taken = false;
+    File* moving = nullptr;
+    vector<pair<string, int>> places; // The file's checkpoint entries on the source.
+    auto advance = [&phase](int value) {
+        phase.store(value);
+        phase.notify_all();
+    };
+    auto await = [&phase](int at_least) {
+        for (int seen = phase.load(); seen < at_least; seen = phase.load()) phase.wait(seen);
+    };
+    system.runTogether({source, target}, [&](FileSystem& fs, int index) {
+        if (index == target) {
+            {
+                lock_guard<mutex> guard(fs.commandMutex());
+                taken = fs.hasFile(newName);
+            }
+            advance(1);
+            await(2);
+            if (moving == nullptr) return;
+            lock_guard<mutex> guard(fs.commandMutex());
+            fs.attachFile(moving, newName, places); // The name is still free: this worker was busy.
+        } else {
+            await(1);
+            if (!taken) {
+                lock_guard<mutex> guard(fs.commandMutex());
+                moving = fs.detachFile(oldName, places);
+            }
+            advance(moving != nullptr ? 2 : 3);
+        }
+    });
+    if (taken) return "Error: File '" + newName + "' already exists.\n";
+    if (moving == nullptr) return "Error: File not found.\n";
+    return "File '" + oldName + "' renamed to '" + newName + "'.\n";
+}
+
+/**
+ *  Executes a command against a sharded file system. Commands about one file
+ *  run on the shard that owns it. System-wide commands run on every shard and
+ *  their results are merged, so the output matches a single file system's.
+ */
+string execute_command(ShardedFileSystem& system, const string& command, const vector<string>& args,
+                       bool& should_exit) {
+    // IMPORT reads from disk first and takes the lock only for the batch load.
+    if (command == "IMPORT" && args.size() >= 1) {
+        string message = "";
+        for (size_t i = 1; i < args.size(); ++i) {
+            message += args[i];
+            if (i < args.size() - 1) message += " ";
+        }
+        if (message.empty()) message = "Imported from " + args[0];
+        return import_directory(system, args[0], message);
+    }
+    // EXPORT likewise writes to disk outside the lock.
+    if (command == "EXPORT" && args.size() >= 1 && args.size() <= 2) {
+        time_t as_of = -1;
+        if (args.size() == 2 && !parse_timestamp(args[1], as_of)) {
+            return "Error: Invalid timestamp for EXPORT.\n";
+        }
+        return export_directory(system, args[0], as_of);
+    }
+    // COMPACT copies pack data outside the lock, one shard's store at a time.
+    if (command == "COMPACT" && args.size() <= 1) {
+        double rate = 64; // MB per second.
+        if (args.size() == 1) {
+            string error = parse_decimal(args[0], rate, "rate for COMPACT");
+            if (!error.empty()) return error;
+        }
+        string output = "";
+        for (int i = 0; i < system.shardCount(); ++i) {
+            string compacted = compact_store(system.shard(i), rate);
+            if (compacted.compare(0, 6, "Error:") == 0) return compacted;
+            output += compacted;
+        }
+        return output;
+    }
+    if (system.shardCount() == 1) return execute_command(system.shard(0), command, args, should_exit);
+
+    auto on_shard = [&](int index) {
+        string output;
+        system.runOn(index, [&](FileSystem& fs) { output = execute_command(fs, command, args, should_exit); });
+        return output;
+    };
+    // Runs `body` on every shard under that shard's lock.
+    auto on_all = [&system](const function<void(FileSystem&, int)>& body, bool atomic_cut = false) {
+        system.runOnAll([&body](FileSystem& fs, int index) {
+            lock_guard<mutex> guard(fs.commandMutex());
+            body(fs, index);
+        }, atomic_cut);
+    };
+    int shard_count = system.shardCount();
+
+    // Commands about one file.
+    const char* const PER_FILE[] = {"CREATE", "READ", "INSERT", "UPDATE", "SNAPSHOT", "ROLLBACK", "HISTORY",
+                                    "BLAME", "DIFF", "MERGE", "READ_AT", "ROLLBACK_AT"};
+    for (const char* name : PER_FILE) {
+        if (command == name && !args.empty()) return on_shard(system.shardFor(args[0]));
+    }
+    if (command == "DELETE" && args.size() == 1) return on_shard(system.shardFor(args[0]));
+    if (command == "MEM" && args.size() == 1) return on_shard(system.shardFor(args[0]));
+    if (command == "RENAME" && args.size() == 2) {
+        if (system.shardFor(args[0]) == system.shardFor(args[1])) return on_shard(system.shardFor(args[0]));
+        return rename_across_shards(system, args[0], args[1]);
+    }
+
+    // Top-K analytics: each shard's top `num`, merged.
+    if (command == "RECENT_FILES" || command == "BIGGEST_TREES") {
+        string output = "";
+        int num = -1; // Default to showing all files.
+        if (!args.empty() && !parse_int(args[0], num, "number").empty()) {
+            num = -1;
+            output += "Error: Invalid number. Showing all by default.\n";
+        }
+        bool by_recent = command == "RECENT_FILES";
+        vector<vector<RankedFile>> parts(shard_count);
+        on_all([&](FileSystem& fs, int index) { fs.topFiles(by_recent, num, parts[index]); });
+        // Each part is in descending order; repeatedly take the largest head.
+        struct Head {
+            long long value;
+            int part;
+            size_t position;
+            bool operator<(const Head& other) const { return value < other.value; }
+        };
+        MaxHeap<Head> heads;
+        for (int i = 0; i < shard_count; ++i) {
+            if (!parts[i].empty()) heads.insert({parts[i][0].value, i, 0});
+        }
+        vector<RankedFile> top;
+        while (!heads.isEmpty() && (num == -1 || (int)top.size() < num)) {
+            Head head = heads.extractMax();
+            top.push_back(parts[head.part][head.position]);
+            if (head.position + 1 < parts[head.part].size()) {
+                heads.insert({parts[head.part][head.position + 1].value, head.part, head.position + 1});
+            }
+        }
+        return output + (by_recent ? FileSystem::formatRecentFiles(num, top) : FileSystem::formatBiggestTrees(num, top));
+    }
+
+    if (command == "GREP" && !args.empty() && !(args[0] == "-E" && args.size() == 1)) {
+        bool as_regex = args[0] == "-E";
+        string pattern = "";
+        for (size_t i = as_regex ? 1 : 0; i < args.size(); ++i) {
+            pattern += args[i];
+            if (i < args.size() - 1) pattern += " ";
+        }
+        vector<vector<string>> parts(shard_count);
+        vector<string> errors(shard_count);
+        vector<size_t> checked(shard_count, 0), skipped(shard_count, 0);
+        on_all([&](FileSystem& fs, int index) {
+            errors[index] = fs.grepMatches(pattern, as_regex, parts[index], checked[index], skipped[index]);
+        });
+        if (!errors[0].empty()) return errors[0];
+        size_t total_checked = 0, total_skipped = 0;
+        for (int i = 0; i < shard_count; ++i) {
+            total_checked += checked[i];
+            total_skipped += skipped[i];
+        }
+        return FileSystem::formatGrep(merge_shard_names(parts), total_checked, total_skipped);
+    }
+
+    if (command == "LS" && args.size() <= 2 && (args.size() < 2 || args[0] == "-R")) {
+        bool recursive = !args.empty() && args[0] == "-R";
+        string directory = args.size() > (recursive ? 1u : 0u) ? args.back() : "";
+        vector<vector<string>> parts(shard_count);
+        vector<vector<long long>> counts(shard_count);
+        vector<vector<string>> files_here(shard_count);
+        atomic<bool> found(false);
+        on_all([&](FileSystem& fs, int index) {
+            bool exists = recursive ? fs.collectPaths(directory, parts[index])
+                                    : fs.directoryEntries(directory, parts[index], counts[index], files_here[index]);
+            if (exists) found = true;
+        });
+        if (!found) return "Error: Directory '" + directory + "' not found.\n";
+        if (recursive) return FileSystem::formatPaths(merge_shard_names(parts));
+        // A subdirectory may exist on several shards; add up its files.
+        vector<pair<string, long long>> entries;
+        for (int i = 0; i < shard_count; ++i) {
+            for (size_t j = 0; j < parts[i].size(); ++j) entries.push_back({parts[i][j], counts[i][j]});
+        }
+        custom_sort(entries);
+        vector<string> subdirs;
+        vector<long long> subdir_counts;
+        for (const pair<string, long long>& entry : entries) {
+            if (!subdirs.empty() && subdirs.back() == entry.first) {
+                subdir_counts.back() += entry.second;
+            } else {
+                subdirs.push_back(entry.first);
+                subdir_counts.push_back(entry.second);
+            }
+        }
+        return FileSystem::formatDirectory(subdirs, subdir_counts, merge_shard_names(files_here));
+    }
+
+    if (command == "LIST" && args.size() <= 3) {
+        bool glob = !args.empty() && args[0] == "GLOB" && args.size() >= 2;
+        bool range = args.size() >= 2 && args[0] != "GLOB";
+        if (!glob && !range && !args.empty()) return on_shard(0); // The usage error.
+        size_t limit = (size_t)-1;
+        if (args.size() == 3) {
+            long long value;
+            string error = parse_integer(args[2], 0, LLONG_MAX, value, "limit for LIST");
+            if (!error.empty()) return error;
+            limit = (size_t)value;
+        }
+        // Each shard contributes up to one more name than the page holds, to
+        // find where the next page starts.
+        size_t count = limit == (size_t)-1 ? limit : limit + 1;
+        vector<vector<string>> parts(shard_count);
+        on_all([&](FileSystem& fs, int index) {
+            if (glob) fs.collectGlob(args[1], count, parts[index]);
+            else if (range) fs.collectNames(args[0] == "-" ? "" : args[0], args[1], args[1] != "-", count, parts[index]);
+            else fs.collectNames("", "", false, count, parts[index]);
+        });
+        vector<string> names = merge_shard_names(parts);
+        if (names.size() > count) names.resize(count);
+        return FileSystem::formatNamePage(names, limit, glob);
+    }
+
+    if (command == "DELETE" && args.size() == 2 && args[0] == "-r") {
+        const string& directory = args[1];
+        if (directory.empty() || directory == "/") return "Error: Refusing to delete the root directory.\n";
+        atomic<long long> deleted(0);
+        atomic<bool> found(false);
+        on_all([&](FileSystem& fs, int) {
+            long long count = fs.deleteUnder(directory);
+            if (count < 0) return;
+            found = true;
+            deleted += count;
+        });
+        if (!found) return "Error: Directory '" + directory + "' not found.\n";
+        return FileSystem::formatDeleted(directory, deleted);
+    }
+
+    // Checkpoints are taken at one moment across every shard.
+    if ((command == "SNAPSHOT_ALL" || command == "ROLLBACK_ALL") && args.size() == 1) {
+        vector<string> outputs(shard_count);
+        atomic<int> changed(0), snapshotted(0), restored(0);
+        on_all([&](FileSystem& fs, int index) {
+            int shard_changed = 0, shard_snapshotted = 0, shard_restored = 0;
+            if (command == "SNAPSHOT_ALL") outputs[index] = fs.snapshotAll(args[0], &shard_changed, &shard_snapshotted);
+            else outputs[index] = fs.rollbackAll(args[0], &shard_restored);
+            changed += shard_changed;
+            snapshotted += shard_snapshotted;
+            restored += shard_restored;
+        }, true);
+        if (outputs[0].compare(0, 6, "Error:") == 0) return outputs[0];
+        if (command == "ROLLBACK_ALL") {
+            return "Restored " + to_string(restored.load()) + " files to checkpoint '" + args[0] + "'.\n";
+        }
+        return "Checkpoint '" + args[0] + "' created (" + to_string(changed.load()) + " changed files, "
+               + to_string(snapshotted.load()) + " new snapshots).\n";
+    }
+
+    // Memory figures are summed over the shards, which share one budget.
+    if (command == "MEM" && args.empty()) {
+        vector<MemoryUsage> usages(shard_count);
+        vector<long long> file_counts(shard_count, 0), loaded(shard_count, 0), table_bytes(shard_count, 0);
+        on_all([&](FileSystem& fs, int index) {
+            fs.collectMemory(usages[index], file_counts[index], loaded[index], table_bytes[index]);
+        });
+        for (int i = 1; i < shard_count; ++i) {
+            usages[0].add(usages[i]);
+            file_counts[0] += file_counts[i];
+            loaded[0] += loaded[i];
+            table_bytes[0] += table_bytes[i];
+        }
+        return FileSystem::formatMemory(usages[0], file_counts[0], loaded[0], table_bytes[0], system.memoryBudget());
+    }
+
+    if (command == "SAVE" || command == "STATS" || command == "GC") {
+        vector<string> outputs(shard_count);
+        system.runOnAll([&](FileSystem& fs, int index) {
+            bool ignored = false;
+            outputs[index] = execute_command(fs, command, args, ignored);
+        });
+        for (const string& output : outputs) {
+            if (output.compare(0, 6, "Error:") == 0) return output;
+        }
+        bool json = command == "STATS" && !args.empty() && args[0] == "JSON";
+        if (json) {
+            string result = "{\"shards\":[";
+            for (int i = 0; i < shard_count; ++i) {
+                string report = outputs[i];
+                if (!report.empty() && report.back() == '\n') report.pop_back();
+                result += (i > 0 ? "," : "") + report;
+            }
+            return result + "]}\n";
+        }
+        // SAVE reports each shard's store; RUN and POLICY say the same thing
+        // for every shard; STATS and GC STATUS are shown per shard.
+        if (command == "SAVE") {
+            string result = "";
+            for (const string& output : outputs) result += output;
+            return result;
+        }
+        if (command == "GC" && !(args.size() == 1 && args[0] == "STATUS")) return outputs[0];
+        string result = "";
+        for (int i = 0; i < shard_count; ++i) result += "=== Shard " + to_string(i) + " ===\n" + outputs[i];
+        return result;
+    }
+
+    if (command == "EXIT" || command == "QUIT") {
+        should_exit = true;
+        return "Exiting system.\n";
+    }
+    return on_shard(0); // TRACE, which is process-wide, and usage errors.
+}
+
+//==============================================================================
+// NETWORK ENDPOINTS
+// Purpose: Parsing of "tcp:[host:]port" and "unix:path" endpoint strings and
+//          creation of listening and connecting sockets for them.
+//==============================================================================
+
+struct Endpoint {
+    bool is_unix = false;
+    string host = "127.0.0.1"; // TCP only.
+    int port = 0;              // TCP only.
+    string path;               // Unix domain socket only.
+};
+
+/**
+ *  Parses an endpoint specification. Returns false if it is malformed.
+ */
+bool parse_endpoint(const string& spec, Endpoint& out) {
+    if (spec.compare(0, 5, "unix:") == 0) {
+        out.is_unix = true;
+        out.path = spec.substr(5);
+        return !out.path.empty() && out.path.size() < sizeof(sockaddr_un::sun_path);
+    }
+    if (spec.compare(0, 4, "tcp:") != 0) return false;
+    string rest = spec.substr(4);
+    size_t colon = rest.rfind(':');
+    if (colon != string::npos) {
+        out.host = rest.substr(0, colon);
+        rest = rest.substr(colon + 1);
+    }
+    return parse_int(rest, out.port, "port", 1, 65535).empty();
+}
+
+/**
+ *  Fills a socket address for the endpoint. Returns its length, or 0 on error.
+ */
+socklen_t endpoint_address(const Endpoint& endpoint, sockaddr_storage& storage) {
+    memset(&storage, 0, sizeof(storage));
+    if (endpoint.is_unix) {
+        sockaddr_un* addr = (sockaddr_un*)&storage;
+        addr->sun_family = AF_UNIX;
+        strncpy(addr->sun_path, endpoint.path.c_str(), sizeof(addr->sun_path) - 1);
+        return sizeof(sockaddr_un);
+    }
+    sockaddr_in* addr = (sockaddr_in*)&storage;
+    addr->sin_family = AF_INET;
+    addr->sin_port = htons((uint16_t)endpoint.port);
+    if (inet_pton(AF_INET, endpoint.host.c_str(), &addr->sin_addr) != 1) return 0;
+    return sizeof(sockaddr_in);
+}
+
+/**
+ *  Creates a non-blocking listening socket. Returns -1 on failure.
+ */
+int open_listener(const Endpoint& endpoint) {
+    sockaddr_storage storage;
+    socklen_t length = endpoint_address(endpoint, storage);
+    if (length == 0) return -1;
+    int fd = socket(endpoint.is_unix ? AF_UNIX : AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) return -1;
+    if (endpoint.is_unix) {
+        unlink(endpoint.path.c_str()); // Remove a stale socket file from a previous run.
+    } else {
+        int one = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    }
+    if (bind(fd, (sockaddr*)&storage, length) < 0 || listen(fd, SOMAXCONN) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/**
+ *  Opens a blocking client connection. Returns -1 on failure.
+ */
+int connect_endpoint(const Endpoint& endpoint) {
+    sockaddr_storage storage;
+    socklen_t length = endpoint_address(endpoint, storage);
+    if (length == 0) return -1;
+    int fd = socket(endpoint.is_unix ? AF_UNIX : AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) return -1;
+    if (connect(fd, (sockaddr*)&storage, length) < 0) {
+        close(fd);
+        return -1;
+    }
+    if (!endpoint.is_unix) {
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+    return fd;
+}
+
+/**
+ *  Writes the whole buffer to a blocking socket. Returns false on error.
+ */
+bool write_all(int fd, const char* data, size_t length) {
+    while (length > 0) {
+        ssize_t written = send(fd, data, length, MSG_NOSIGNAL);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        data += written;
+        length -= written;
+    }
+    return true;
+}
+
+//==============================================================================
+// NETWORK SERVER
+// Purpose: Serves the command protocol over TCP or a Unix domain socket.
+//          One thread runs an epoll event loop that owns all socket I/O; a
+//          thread pool executes the commands. Clients may pipeline: every
+//          complete request is queued on its connection and answered in order.
+//
+// Text protocol: each request is one line. Each response is the command's
+//                output followed by a line holding a single ".". Output lines
+//                that begin with "." get an extra "." prepended, as in SMTP.
+//
+// Binary protocol: selected by sending BINARY_MAGIC as the first four bytes.
+//                  All integers are big-endian.
+//                  Request:  u32 length | u16 argc | argc x (u32 len | bytes)
+//                            The first argument is the command name.
+//                  Response: u32 length | u8 status | output bytes
+//                            The length covers the status byte and the output.
+//                            Status is 0 on success and 1 if the output is an
+//                            error message.
+//==============================================================================
+
+const char BINARY_MAGIC[4] = {'A', 'N', 'J', 'B'};
+const uint32_t MAX_FRAME_BYTES = 64u * 1024 * 1024; // Larger frames close the connection.
+const size_t MAX_LINE_BYTES = 8u * 1024 * 1024;     // So do longer unfinished text lines.
+
+void put_u32(string& out, uint32_t value) {
+    char bytes[4] = {(char)(value >> 24), (char)(value >> 16), (char)(value >> 8), (char)value};
+    out.append(bytes, 4);
+}
+
+uint32_t get_u32(const char* p) {
+    const unsigned char* u = (const unsigned char*)p;
+    return ((uint32_t)u[0] << 24) | ((uint32_t)u[1] << 16) | ((uint32_t)u[2] << 8) | u[3];
+}
+
+uint16_t get_u16(const char* p) {
+    const unsigned char* u = (const unsigned char*)p;
+    return (uint16_t)((u[0] << 8) | u[1]);
+}
+
+/**
+ *  Encodes a binary request frame. Arguments are sent verbatim, so content may
+ *  contain newlines, repeated spaces or any other bytes.
+ */
+string encode_binary_request(const vector<string>& argv) {
+    size_t length = 2;
+    for (const string& arg : argv) length += 4 + arg.size();
+    string frame;
+    frame.reserve(4 + length);
+    put_u32(frame, (uint32_t)length);
+    frame += (char)(argv.size() >> 8);
+    frame += (char)(argv.size() & 0xff);
+    for (const string& arg : argv) {
+        put_u32(frame, (uint32_t)arg.size());
+        frame += arg;
+    }
+    return frame;
+}
+
+/**
+ *  Decodes one binary request frame body into its arguments.
+ *  Returns false if the frame is malformed.
+ */
+bool decode_binary_request(const char* body, size_t length, vector<string>& argv) {
+    if (length < 2) return false;
+    uint16_t argc = get_u16(body);
+    size_t pos = 2;
+    for (uint16_t i = 0; i < argc; ++i) {
+        if (length - pos < 4) return false;
+        uint32_t arg_length = get_u32(body + pos);
+        pos += 4;
+        if (length - pos < arg_length) return false;
+        argv.emplace_back(body + pos, arg_length);
+        pos += arg_length;
+    }
+    return pos == length;
+}
+
+/**
+ *  Builds the dot-stuffed text response for a command's output.
+ */
+string text_response(const string& output) {
+    string out;
+    out.reserve(output.size() + 4);
+    size_t start = 0;
+    while (start < output.size()) {
+        size_t end = output.find('\n', start);
+        if (end == string::npos) end = output.size();
+        if (output[start] == '.') out += '.';
+        out.append(output, start, end - start);
+        out += '\n';
+        start = end + 1;
+    }
+    out += ".\n";
+    return out;
+}
+
+enum WireProtocol { PROTOCOL_UNKNOWN, PROTOCOL_TEXT, PROTOCOL_BINARY };
+
+/**
+ *  Splits buffered input into requests (command first, then its arguments),
+ *  detecting the protocol from the first bytes. Consumed bytes are removed
+ *  from the buffer. Returns false on a malformed binary frame or a text line
+ *  that grows past MAX_LINE_BYTES without ending.
+ */
+bool parse_requests(WireProtocol& protocol, string& in_buf, vector<vector<string>>& requests) {
+    if (protocol == PROTOCOL_UNKNOWN) {
+        size_t probe = in_buf.size() < 4 ? in_buf.size() : 4;
+        if (in_buf.compare(0, probe, BINARY_MAGIC, probe) != 0) {
+            protocol = PROTOCOL_TEXT;
+        } else if (probe == 4) {
+            protocol = PROTOCOL_BINARY;
+            in_buf.erase(0, 4);
+        } else {
+            return true; // Wait for the rest of the magic.
+        }
+    }
+
+    size_t start = 0;
+    if (protocol == PROTOCOL_TEXT) {
+        size_t newline;
+        while ((newline = in_buf.find('\n', start)) != string::npos) {
+            size_t end = newline;
+            if (end > start && in_buf[end - 1] == '\r') end--;
+            string command;
+            vector<string> args;
+            parse_input(in_buf.substr(start, end - start), command, args);
+            vector<string> argv;
+            if (!command.empty()) {
+                argv.push_back(move(command));
+                for (string& arg : args) argv.push_back(move(arg));
+            }
+            requests.push_back(move(argv));
+            start = newline + 1;
+        }
+        if (in_buf.size() - start > MAX_LINE_BYTES) return false;
+    } else {
+        while (in_buf.size() - start >= 4) {
+            uint32_t length = get_u32(in_buf.data() + start);
+            if (length > MAX_FRAME_BYTES) return false;
+            if (in_buf.size() - start - 4 < length) break;
+            vector<string> argv;
+            if (!decode_binary_request(in_buf.data() + start + 4, length, argv)) return false;
+            requests.push_back(move(argv));
+            start += 4 + length;
+        }
+    }
+    in_buf.erase(0, start);
+    return true;
+}
+
+/**
+ *  One request's result for the wire. READ and READ_AT carry the stored
+ *  content byte for byte; the text protocol ends it with a newline as the
+ *  prompt does.
+ */
+struct Response {
+    bool ok = true;
+    string payload;
+    bool content = false; // The payload is file content.
+};
+
+Response failed_response(string message) {
+    Response response;
+    response.ok = false;
+    response.payload = move(message);
+    return response;
+}
+
+/**
+ *  Executes one parsed request. An empty request (a blank text line) yields
+ *  an empty response. Every other command reports failure through its
+ *  "Error:" line, which is where the status comes from.
+ */
+Response run_request(ShardedFileSystem& fs, vector<string>& argv, bool& should_exit) {
+    Response response;
+    if (argv.empty()) return response;
+    string command = move(argv[0]);
+    argv.erase(argv.begin());
+    // IMPORT and EXPORT name directories on the server's disk, so a remote
+    // client could read or overwrite any file the server can; only the local
+    // prompt may use them.
+    if (command == "IMPORT" || command == "EXPORT") {
+        return failed_response("Error: " + command + " is only available at the local prompt.\n");
+    }
+    if ((command == "READ" && argv.size() == 1) || (command == "READ_AT" && argv.size() == 2)) {
+        time_t when = -1;
+        if (command == "READ_AT" && !parse_timestamp(argv[1], when)) {
+            return failed_response("Error: Invalid timestamp for READ_AT.\n");
+        }
+        fs.runOn(fs.shardFor(argv[0]), [&](FileSystem& shard) {
+            lock_guard<mutex> guard(shard.commandMutex());
+            response.ok = shard.readContent(argv[0], when, response.payload);
+        });
+        if (response.ok) response.content = true;
+        else response.payload += "\n";
+        return response;
+    }
+    response.payload = execute_command(fs, command, argv, should_exit);
+    response.ok = response.payload.compare(0, 6, "Error:") != 0;
+    return response;
+}
+
+/**
+ *  True for the commands that can block for seconds on disk I/O: SAVE syncs
+ *  every pack and COMPACT copies them at a paced rate. The coroutine server
+ *  runs these off its reactor thread.
+ */
+bool is_blocking_request(const vector<string>& argv) {
+    return !argv.empty() && (argv[0] == "SAVE" || argv[0] == "COMPACT");
+}
+
+/**
+ *  Frames a response for the wire. Binary responses keep the header and the
+ *  payload as separate chunks so they can be sent without copying.
+ */
+void encode_response(WireProtocol protocol, Response response, vector<string>& chunks) {
+    if (protocol == PROTOCOL_BINARY) {
+        string header;
+        put_u32(header, (uint32_t)(response.payload.size() + 1));
+        header += (char)(response.ok ? 0 : 1);
+        chunks.push_back(move(header));
+        if (!response.payload.empty()) chunks.push_back(move(response.payload));
+    } else {
+        if (response.content) response.payload += "\n";
+        chunks.push_back(text_response(response.payload));
+    }
+}
+
+/**
+ *  Common control surface of the server implementations, so that a signal
+ *  handler or benchmark can stop whichever one is running.
+ */
+class ServerBase {
+protected:
+    atomic<bool> running;
+
+public:
+    ServerBase() : running(false) {}
+    virtual ~ServerBase() {}
+
+    virtual bool start(const Endpoint& endpoint) = 0;
+    virtual void run() = 0;
+    void stop() { running = false; }
+};
+
+/**
+ *  State for one client connection. The I/O thread owns the socket and the
+ *  input buffer; everything shared with the workers is guarded by conn_lock.
+ */
+struct Connection {
+    int fd;
+    WireProtocol protocol = PROTOCOL_UNKNOWN; // Decided by the first bytes received.
+    string in_buf;              // Bytes received but not yet parsed.
+    bool read_closed = false;   // The peer will send no more requests.
+    bool closed = false;        // The connection has been torn down.
+    bool want_write = false;    // EPOLLOUT is currently registered.
+    shared_ptr<Connection>* holder = nullptr; // The epoll registration record.
+    bool flush_queued = false;  // Already on the completed list (guarded by completed_lock).
+
+    mutex conn_lock;
+    vector<vector<string>> pending; // Parsed requests (command first) waiting to run.
+    size_t pending_head = 0;
+    vector<string> out_chunks;  // Responses waiting to be written, gathered by writev.
+    size_t out_offset = 0;      // Bytes of out_chunks[0] already written.
+    bool busy = false;          // A worker is draining `pending`.
+    bool quit_requested = false;// The client sent EXIT or QUIT.
+
+    Connection(int socket_fd) : fd(socket_fd) {}
+};
+
+class CommandServer : public ServerBase {
+private:
+    ShardedFileSystem& fs;
+    ThreadPool pool;
+    int listen_fd;
+    int epoll_fd;
+    int wake_fd;                                    // eventfd used by workers to wake the loop.
+
+    mutex completed_lock;
+    vector<shared_ptr<Connection>> completed;       // Connections with fresh output.
+    vector<shared_ptr<Connection>*> graveyard;      // Holders freed after each event batch.
+
+    /**
+     *  Registers or updates the epoll interest set for a connection.
+     */
+    void watch(shared_ptr<Connection>* holder, int op) {
+        Connection& conn = **holder;
+        epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = (conn.read_closed ? 0u : (uint32_t)(EPOLLIN | EPOLLRDHUP)) | (conn.want_write ? (uint32_t)EPOLLOUT : 0u);
+        ev.data.ptr = holder;
+        epoll_ctl(epoll_fd, op, conn.fd, &ev);
+    }
+
+    /**
+     *  Executes the connection's queued requests in order. Runs on a worker.
+     */
+    void drain(shared_ptr<Connection> conn) {
+        while (true) {
+            vector<string> argv;
+            WireProtocol protocol;
+            {
+                lock_guard<mutex> guard(conn->conn_lock);
+                if (conn->closed || conn->quit_requested || conn->pending_head == conn->pending.size()) {
+                    conn->pending.clear();
+                    conn->pending_head = 0;
+                    conn->busy = false;
+                    break;
+                }
+                argv = move(conn->pending[conn->pending_head++]);
+                protocol = conn->protocol;
+            }
+            bool should_exit = false;
+            Response response = run_request(fs, argv, should_exit);
+            {
+                lock_guard<mutex> guard(conn->conn_lock);
+                encode_response(protocol, move(response), conn->out_chunks);
+                if (should_exit) conn->quit_requested = true;
+            }
+            notifyCompleted(conn);
+        }
+        notifyCompleted(conn);
+    }
+
+    void notifyCompleted(const shared_ptr<Connection>& conn) {
+        {
+            lock_guard<mutex> guard(completed_lock);
+            if (conn->flush_queued) return; // The loop has not picked up the last wake-up yet.
+            conn->flush_queued = true;
+            completed.push_back(conn);
+        }
+        uint64_t one = 1;
+        ssize_t ignored = write(wake_fd, &one, sizeof(one));
+        (void)ignored;
+    }
+
+    void acceptClients() {
+        while (true) {
+            int fd = accept4(listen_fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (fd < 0) return; // EAGAIN: no more pending connections.
+            int one = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+            shared_ptr<Connection>* holder = new shared_ptr<Connection>(make_shared<Connection>(fd));
+            (*holder)->holder = holder;
+            watch(holder, EPOLL_CTL_ADD);
+        }
+    }
+
+    /**
+     *  Reads what is available, up to about 1 MB per wake-up, and queues
+     *  complete requests for execution.
+     */
+    void onReadable(shared_ptr<Connection>* holder) {
+        shared_ptr<Connection> conn = *holder;
+        char buf[65536];
+        size_t received = 0;
+        while (true) {
+            ssize_t n = recv(conn->fd, buf, sizeof(buf), 0);
+            if (n > 0) {
+                conn->in_buf.append(buf, n);
+                received += n;
+                if (received >= (1 << 20)) break; // Parse, and check the limits, before reading on.
+                continue;
+            }
+            if (n == 0) conn->read_closed = true;
+            else if (errno == EINTR) continue;
+            else if (errno != EAGAIN && errno != EWOULDBLOCK) conn->read_closed = true;
+            break;
+        }
+
+        vector<vector<string>> requests;
+        if (!parse_requests(conn->protocol, conn->in_buf, requests)) {
+            closeConnection(holder);
+            return;
+        }
+        bool start_worker = false;
+        {
+            lock_guard<mutex> guard(conn->conn_lock);
+            for (auto& request : requests) conn->pending.push_back(move(request));
+            if (!conn->busy && conn->pending_head < conn->pending.size()) {
+                conn->busy = true;
+                start_worker = true;
+            }
+        }
+        if (start_worker) pool.submit([this, conn] { drain(conn); });
+        if (conn->read_closed) watch(holder, EPOLL_CTL_MOD);
+        flush(holder);
+    }
+
+    /**
+     *  Writes buffered responses with writev, straight from the chunks the
+     *  workers produced, and closes the connection once it is finished.
+     */
+    void flush(shared_ptr<Connection>* holder) {
+        Connection& conn = **holder;
+        if (conn.closed) return;
+        bool finished;
+        bool want_write;
+        {
+            lock_guard<mutex> guard(conn.conn_lock);
+            const size_t MAX_IOV = 64;
+            size_t first = 0; // Index of the first unsent chunk.
+            while (first < conn.out_chunks.size()) {
+                iovec iov[MAX_IOV];
+                size_t count = 0;
+                for (size_t i = first; i < conn.out_chunks.size() && count < MAX_IOV; ++i, ++count) {
+                    size_t skip = (i == first) ? conn.out_offset : 0;
+                    iov[count].iov_base = (void*)(conn.out_chunks[i].data() + skip);
+                    iov[count].iov_len = conn.out_chunks[i].size() - skip;
+                }
+                msghdr msg;
+                memset(&msg, 0, sizeof(msg));
+                msg.msg_iov = iov;
+                msg.msg_iovlen = count;
+                ssize_t n = sendmsg(conn.fd, &msg, MSG_NOSIGNAL);
+                if (n < 0 && errno == EINTR) continue;
+                if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+                if (n <= 0) {
+                    // The peer is gone; drop what is left.
+                    first = conn.out_chunks.size();
+                    conn.out_offset = 0;
+                    conn.read_closed = true;
+                    conn.quit_requested = true;
+                    break;
+                }
+                size_t sent = (size_t)n;
+                while (sent > 0) {
+                    size_t remaining = conn.out_chunks[first].size() - conn.out_offset;
+                    if (sent < remaining) {
+                        conn.out_offset += sent;
+                        break;
+                    }
+                    sent -= remaining;
+                    conn.out_offset = 0;
+                    first++;
+                }
+            }
+            conn.out_chunks.erase(conn.out_chunks.begin(), conn.out_chunks.begin() + first);
+            want_write = !conn.out_chunks.empty();
+            finished = !conn.busy && !want_write
+                       && (conn.quit_requested || (conn.read_closed && conn.pending_head == conn.pending.size()));
+        }
+        if (finished) {
+            closeConnection(holder);
+        } else if (want_write != conn.want_write) {
+            conn.want_write = want_write;
+            watch(holder, EPOLL_CTL_MOD);
+        }
+    }
+
+    void closeConnection(shared_ptr<Connection>* holder) {
+        Connection& conn = **holder;
+        {
+            lock_guard<mutex> guard(conn.conn_lock);
+            if (conn.closed) return;
+            conn.closed = true;
+        }
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, conn.fd, nullptr);
+        close(conn.fd);
+        graveyard.push_back(holder);
+    }
+
+public:
+    CommandServer(ShardedFileSystem& file_system, int worker_threads)
+        : fs(file_system), pool(worker_threads), listen_fd(-1), epoll_fd(-1), wake_fd(-1) {}
+
+    ~CommandServer() {
+        pool.shutdown();
+        if (listen_fd >= 0) close(listen_fd);
+        if (wake_fd >= 0) close(wake_fd);
+        if (epoll_fd >= 0) close(epoll_fd);
+    }
+
+    /**
+     *  Binds the endpoint. Returns false (with errno set) on failure.
+     */
+    bool start(const Endpoint& endpoint) override {
+        listen_fd = open_listener(endpoint);
+        if (listen_fd < 0) return false;
+        epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (epoll_fd < 0 || wake_fd < 0) return false;
+        epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.ptr = &listen_fd;
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &ev);
+        ev.data.ptr = &wake_fd;
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wake_fd, &ev);
+        running = true;
+        return true;
+    }
+
+    /**
+     *  Runs the event loop until stop() is called.
+     */
+    void run() override {
+        const int MAX_EVENTS = 256;
+        epoll_event events[MAX_EVENTS];
+        while (running) {
+            int count = epoll_wait(epoll_fd, events, MAX_EVENTS, 200);
+            for (int i = 0; i < count; ++i) {
+                void* tag = events[i].data.ptr;
+                if (tag == &listen_fd) {
+                    acceptClients();
+                } else if (tag == &wake_fd) {
+                    uint64_t ignored;
+                    ssize_t n = read(wake_fd, &ignored, sizeof(ignored));
+                    (void)n;
+                    vector<shared_ptr<Connection>> ready;
+                    {
+                        lock_guard<mutex> guard(completed_lock);
+                        ready.swap(completed);
+                        for (auto& conn : ready) conn->flush_queued = false;
+                    }
+                    for (auto& conn : ready) {
+                        if (!conn->closed) flush(conn->holder);
+                    }
+                } else {
+                    shared_ptr<Connection>* holder = (shared_ptr<Connection>*)tag;
+                    if ((*holder)->closed) continue;
+                    if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+                        closeConnection(holder);
+                    } else {
+                        if (events[i].events & (EPOLLIN | EPOLLRDHUP)) onReadable(holder);
+                        if (!(*holder)->closed && (events[i].events & EPOLLOUT)) flush(holder);
+                    }
+                }
+            }
+            for (shared_ptr<Connection>* holder : graveyard) delete holder;
+            graveyard.clear();
+        }
+    }
+};
+
+//==============================================================================
+// COROUTINE SERVER
+// Purpose: An alternative server built on C++20 coroutines. Each connection is
+//          a coroutine that reads as if it were blocking; whenever a socket
+//          would block it suspends on the reactor, so a single thread keeps
+//          hundreds of connections in flight without a stack per connection.
+//          The reactor is epoll based; io_uring is not used because it needs
+//          liburing or raw ring setup that this project does not depend on.
+//==============================================================================
+
+/**
+ *  A detached coroutine: starts immediately and frees its own frame when it
+ *  finishes. Used for per-connection and accept loops.
+ */
+struct DetachedTask {
+    struct promise_type {
+        DetachedTask get_return_object() { return {}; }
+        suspend_never initial_suspend() noexcept { return {}; }
+        suspend_never final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { terminate(); }
+    };
+};
+
+/**
+ *  Single-threaded epoll reactor. Coroutines park on a file descriptor with a
+ *  one-shot registration and are resumed when it becomes ready, sleep until a
+ *  deadline, or hand blocking work to a small worker pool and are resumed
+ *  here once it is done. Whatever is still parked when the reactor stops is
+ *  destroyed along with its socket.
+ */
+class Reactor {
+private:
+    /**
+     *  A suspended coroutine and the descriptor it belongs to.
+     */
+    struct Parked {
+        int fd;
+        void* frame;
+    };
+
+    /**
+     *  A coroutine sleeping until `deadline`.
+     */
+    struct Timer {
+        chrono::steady_clock::time_point deadline;
+        void* frame;
+    };
+
+    static const int OFFLOAD_THREADS = 2;
+
+    int epoll_fd;
+    int wake_fd;                 // Signalled when offloaded work finishes.
+    HashMap<int, Parked> parked; // By descriptor; only the reactor thread touches it.
+    vector<Timer> timers;
+    mutex finished_lock;
+    vector<int> finished;        // Descriptors whose offloaded work is done.
+    ThreadPool offload_pool;
+
+    void park(int fd, coroutine_handle<> handle) { parked.put(fd, {fd, handle.address()}); }
+
+    void resumeParked(int fd) {
+        if (!parked.containsKey(fd)) return;
+        void* frame = parked.get(fd).frame;
+        parked.remove(fd);
+        coroutine_handle<>::from_address(frame).resume();
+    }
+
+    void complete(int fd) {
+        {
+            lock_guard<mutex> guard(finished_lock);
+            finished.push_back(fd);
+        }
+        uint64_t one = 1;
+        ssize_t n = write(wake_fd, &one, sizeof(one));
+        (void)n;
+    }
+
+    void resumeFinished() {
+        uint64_t ignored;
+        ssize_t n = read(wake_fd, &ignored, sizeof(ignored));
+        (void)n;
+        vector<int> ready;
+        {
+            lock_guard<mutex> guard(finished_lock);
+            ready.swap(finished);
+        }
+        for (int fd : ready) resumeParked(fd);
+    }
+
+    /**
+     *  Resumes the sleepers whose deadline has passed and returns how long
+     *  epoll may wait for the next one, at most `longest` ms.
+     */
+    int resumeTimers(int longest) {
+        auto now = chrono::steady_clock::now();
+        vector<void*> due;
+        size_t i = 0;
+        while (i < timers.size()) {
+            if (timers[i].deadline <= now) {
+                due.push_back(timers[i].frame);
+                timers[i] = timers.back();
+                timers.pop_back();
+            } else {
+                i++;
+            }
+        }
+        for (void* frame : due) coroutine_handle<>::from_address(frame).resume();
+        int wait_ms = longest;
+        for (const Timer& timer : timers) {
+            long long left = chrono::duration_cast<chrono::milliseconds>(timer.deadline - now).count() + 1;
+            if (left < wait_ms) wait_ms = left < 0 ? 0 : (int)left;
+        }
+        return wait_ms;
+    }
+
+public:
+    Reactor() : epoll_fd(epoll_create1(EPOLL_CLOEXEC)), wake_fd(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)),
+                parked(64), offload_pool(OFFLOAD_THREADS) {
+        epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.fd = wake_fd;
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wake_fd, &ev);
+    }
+    ~Reactor() {
+        if (epoll_fd >= 0) close(epoll_fd);
+        if (wake_fd >= 0) close(wake_fd);
+    }
+
+    /**
+     *  Arranges for `handle` to be resumed once `fd` has one of `events`.
+     */
+    void arm(int fd, uint32_t events, coroutine_handle<> handle) {
+        park(fd, handle);
+        epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = events | EPOLLONESHOT | EPOLLRDHUP;
+        ev.data.fd = fd;
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &ev) < 0 && errno == ENOENT) {
+            epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+        }
+    }
+
+    void forget(int fd) { epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, nullptr); }
+
+    /**
+     *  Resumes ready coroutines until `running` turns false. Offloaded work
+     *  is then allowed to finish, since it still refers to its coroutine.
+     */
+    void run(const atomic<bool>& running) {
+        const int MAX_EVENTS = 256;
+        epoll_event events[MAX_EVENTS];
+        int wait_ms = 200;
+        while (running) {
+            int count = epoll_wait(epoll_fd, events, MAX_EVENTS, wait_ms);
+            for (int i = 0; i < count; ++i) {
+                if (events[i].data.fd == wake_fd) resumeFinished();
+                else resumeParked(events[i].data.fd);
+            }
+            wait_ms = resumeTimers(200);
+        }
+        offload_pool.shutdown();
     }
-    // Reverse the list to display in chronological order (root first).
-    custom_reverse(history_entries);
-    for (const auto& entry : history_entries) {
-        result += entry + "\n";
+
+    /**
+     *  Destroys every coroutine still suspended after run() and closes its
+     *  descriptor, except `keep_fd` (the listener, which its owner closes).
+     */
+    void destroyParked(int keep_fd) {
+        for (const Parked& entry : parked.getValues()) {
+            coroutine_handle<>::from_address(entry.frame).destroy();
+            if (entry.fd != keep_fd) close(entry.fd);
+        }
+        parked.clear();
+        for (const Timer& timer : timers) coroutine_handle<>::from_address(timer.frame).destroy();
+        timers.clear();
     }
-    return result;
-}
 
-string File::getName() const { return filename; }
-int File::getVersionCount() const { return total_versions; }
-time_t File::getLastModificationTime() const { return last_modification_time; }
+    /**
+     *  Awaitable that suspends the coroutine until the descriptor is ready.
+     */
+    struct ReadyAwaitable {
+        Reactor& reactor;
+        int fd;
+        uint32_t events;
+        bool await_ready() const noexcept { return false; }
+        void await_suspend(coroutine_handle<> handle) { reactor.arm(fd, events, handle); }
+        void await_resume() const noexcept {}
+    };
+
+    ReadyAwaitable readable(int fd) { return {*this, fd, EPOLLIN}; }
+    ReadyAwaitable writable(int fd) { return {*this, fd, EPOLLOUT}; }
+
+    /**
+     *  Awaitable that suspends the coroutine for a while, without using a
+     *  descriptor (it may be waiting out EMFILE).
+     */
+    struct SleepAwaitable {
+        Reactor& reactor;
+        int milliseconds;
+        bool await_ready() const noexcept { return false; }
+        void await_suspend(coroutine_handle<> handle) {
+            auto deadline = chrono::steady_clock::now() + chrono::milliseconds(milliseconds);
+            reactor.timers.push_back({deadline, handle.address()});
+        }
+        void await_resume() const noexcept {}
+    };
+
+    SleepAwaitable sleep(int milliseconds) { return {*this, milliseconds}; }
+
+    /**
+     *  Awaitable that runs `work` on the worker pool and resumes the
+     *  coroutine serving `fd` on the reactor thread afterwards, so a long
+     *  command does not stall every other connection.
+     */
+    struct OffloadAwaitable {
+        Reactor& reactor;
+        int fd;
+        function<void()> work;
+        bool await_ready() const noexcept { return false; }
+        void await_suspend(coroutine_handle<> handle) {
+            reactor.park(fd, handle);
+            Reactor* owner = &reactor;
+            int client = fd;
+            function<void()>* job = &work; // Lives in the suspended frame until resumed.
+            reactor.offload_pool.submit([owner, client, job] {
+                (*job)();
+                owner->complete(client);
+            });
+        }
+        void await_resume() const noexcept {}
+    };
+
+    OffloadAwaitable offload(int fd, function<void()> work) { return {*this, fd, move(work)}; }
+};
+
+class CoroutineServer : public ServerBase {
+private:
+    ShardedFileSystem& fs;
+    Reactor reactor;
+    int listen_fd;
+
+    /**
+     *  Serves one client: read, execute pipelined requests in order, write.
+     */
+    DetachedTask serveConnection(int fd) {
+        WireProtocol protocol = PROTOCOL_UNKNOWN;
+        string in_buf;
+        bool open = true;
+        char buf[65536];
+        while (open && running) {
+            ssize_t n = recv(fd, buf, sizeof(buf), 0);
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                co_await reactor.readable(fd);
+                continue;
+            }
+            if (n <= 0) break;
+            in_buf.append(buf, n);
+
+            vector<vector<string>> requests;
+            if (!parse_requests(protocol, in_buf, requests)) break;
+            vector<string> chunks;
+            for (auto& argv : requests) {
+                bool should_exit = false;
+                Response response;
+                if (is_blocking_request(argv)) {
+                    co_await reactor.offload(fd, [&] { response = run_request(fs, argv, should_exit); });
+                } else {
+                    response = run_request(fs, argv, should_exit);
+                }
+                encode_response(protocol, move(response), chunks);
+                if (should_exit) {
+                    open = false;
+                    break;
+                }
+            }
+
+            // Gather the responses into one write, suspending while the socket is full.
+            string out;
+            for (const string& chunk : chunks) out += chunk;
+            size_t sent = 0;
+            while (sent < out.size()) {
+                ssize_t w = send(fd, out.data() + sent, out.size() - sent, MSG_NOSIGNAL);
+                if (w > 0) {
+                    sent += w;
+                } else if (w < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                    co_await reactor.writable(fd);
+                } else if (w < 0 && errno == EINTR) {
+                    continue;
+                } else {
+                    open = false;
+                    break;
+                }
+            }
+        }
+        reactor.forget(fd);
+        close(fd);
+    }
+
+    DetachedTask acceptLoop() {
+        while (running) {
+            int fd = accept4(listen_fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (fd < 0) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    co_await reactor.readable(listen_fd);
+                } else if (errno != EINTR && errno != ECONNABORTED) {
+                    // Out of descriptors or memory: the listener stays readable, so back off.
+                    co_await reactor.sleep(100);
+                }
+                continue;
+            }
+            int one = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+            serveConnection(fd);
+        }
+    }
+
+public:
+    CoroutineServer(ShardedFileSystem& file_system) : fs(file_system), listen_fd(-1) {}
+
+    ~CoroutineServer() {
+        if (listen_fd >= 0) close(listen_fd);
+    }
+
+    bool start(const Endpoint& endpoint) override {
+        listen_fd = open_listener(endpoint);
+        if (listen_fd < 0) return false;
+        running = true;
+        return true;
+    }
 
+    void run() override {
+        acceptLoop();
+        reactor.run(running);
+        reactor.destroyParked(listen_fd);
+    }
+};
 
 //==============================================================================
-// METHOD IMPLEMENTATIONS: FileSystem
+// THREAD-PER-CONNECTION SERVER
+// Purpose: The classic blocking design, kept as a baseline for benchmarking
+//          the event-loop and coroutine servers.
 //==============================================================================
 
-FileSystem::FileSystem() : files(256) {} // Initialize with a capacity of 256.
+class ThreadPerConnectionServer : public ServerBase {
+private:
+    /**
+     *  One client's thread. Only the accept loop touches the list, and it
+     *  closes the socket after joining, so a shutdown() never hits a reused fd.
+     */
+    struct Client {
+        thread worker;
+        int fd;
+        atomic<bool> finished{false};
+    };
 
-FileSystem::~FileSystem() {
-    // Clean up dynamically allocated File objects.
-    vector<File*> all_files = files.getValues();
-    for (File* file_ptr : all_files) {
-        delete file_ptr;
+    ShardedFileSystem& fs;
+    int listen_fd;
+    vector<unique_ptr<Client>> clients;
+
+    /**
+     *  Joins the threads that have finished and closes their sockets.
+     */
+    void reapClients() {
+        size_t i = 0;
+        while (i < clients.size()) {
+            if (!clients[i]->finished) {
+                i++;
+                continue;
+            }
+            clients[i]->worker.join();
+            close(clients[i]->fd);
+            clients[i] = move(clients.back());
+            clients.pop_back();
+        }
     }
-}
 
-void FileSystem::updateAnalytics() {
-    // Re-create the heaps from scratch.
-    recent_files_heap = MaxHeap<FileMetric>();
-    biggest_trees_heap = MaxHeap<FileMetric>();
-    vector<File*> all_files = files.getValues();
-    // Populate heaps with fresh data from all files.
-    for (File* file_ptr : all_files) {
-        recent_files_heap.insert({file_ptr->getName(), file_ptr->getLastModificationTime()});
-        biggest_trees_heap.insert({file_ptr->getName(), (long long)file_ptr->getVersionCount()});
+    void serveConnection(Client* client) {
+        int fd = client->fd;
+        WireProtocol protocol = PROTOCOL_UNKNOWN;
+        string in_buf;
+        char buf[65536];
+        bool open = true;
+        while (open) {
+            ssize_t n = recv(fd, buf, sizeof(buf), 0);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) break;
+            in_buf.append(buf, n);
+            vector<vector<string>> requests;
+            if (!parse_requests(protocol, in_buf, requests)) break;
+            vector<string> chunks;
+            for (auto& argv : requests) {
+                bool should_exit = false;
+                encode_response(protocol, run_request(fs, argv, should_exit), chunks);
+                if (should_exit) {
+                    open = false;
+                    break;
+                }
+            }
+            string out;
+            for (const string& chunk : chunks) out += chunk;
+            if (!write_all(fd, out.data(), out.size())) break;
+        }
+        client->finished = true;
     }
-}
 
-void FileSystem::create(const string& filename) {
-    if (files.containsKey(filename)) {
-        cout << "Error: File '" << filename << "' already exists.\n";
-        return;
+public:
+    ThreadPerConnectionServer(ShardedFileSystem& file_system) : fs(file_system), listen_fd(-1) {}
+
+    ~ThreadPerConnectionServer() {
+        if (listen_fd >= 0) close(listen_fd);
     }
-    files.put(filename, new File(filename));
-    updateAnalytics();
-    cout << "File '" << filename << "' created.\n";
-}
 
-string FileSystem::read(const string& filename) {
-    if (!files.containsKey(filename)) return "Error: File not found.";
-    return files.get(filename)->read();
-}
+    bool start(const Endpoint& endpoint) override {
+        listen_fd = open_listener(endpoint);
+        if (listen_fd < 0) return false;
+        running = true;
+        return true;
+    }
 
-void FileSystem::insert(const string& filename, const string& content) {
-    if (!files.containsKey(filename)) {
-        cout << "Error: File not found.\n";
-        return;
+    /**
+     *  Accepts until stop(), then wakes the threads still blocked in recv()
+     *  by shutting their sockets down, and joins them.
+     */
+    void run() override {
+        while (running) {
+            reapClients();
+            int fd = accept4(listen_fd, nullptr, nullptr, SOCK_CLOEXEC);
+            if (fd < 0) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR || errno == ECONNABORTED) {
+                    // The listener is non-blocking; wait briefly so stop() is noticed.
+                    pollfd pfd = {listen_fd, POLLIN, 0};
+                    poll(&pfd, 1, 200);
+                } else {
+                    // Out of descriptors or memory: the listener stays readable, so back off.
+                    this_thread::sleep_for(chrono::milliseconds(100));
+                }
+                continue;
+            }
+            int one = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+            clients.push_back(make_unique<Client>());
+            clients.back()->fd = fd;
+            clients.back()->worker = thread(&ThreadPerConnectionServer::serveConnection, this, clients.back().get());
+        }
+        for (unique_ptr<Client>& client : clients) shutdown(client->fd, SHUT_RDWR);
+        for (unique_ptr<Client>& client : clients) {
+            client->worker.join();
+            close(client->fd);
+        }
+        clients.clear();
     }
-    files.get(filename)->insert(content);
-    updateAnalytics();
-    cout << "Content inserted into '" << filename << "'.\n";
-}
+};
 
-void FileSystem::update(const string& filename, const string& content) {
-    if (!files.containsKey(filename)) {
-        cout << "Error: File not found.\n";
-        return;
+//==============================================================================
+// LOAD GENERATOR
+// Purpose: A bundled client that drives a running server with pipelined
+//          requests over several connections and reports throughput and
+//          latency percentiles.
+//==============================================================================
+
+struct LoadGenConfig {
+    Endpoint endpoint;
+    int connections = 4;    // Concurrent client connections (one thread each).
+    int requests = 10000;   // Requests sent per connection.
+    int pipeline = 16;      // Maximum requests in flight per connection.
+    int payload = 64;       // Bytes of content per INSERT/UPDATE.
+    bool binary = false;    // Use the binary protocol instead of text lines.
+};
+
+/**
+ *  Buffered reader for text or binary protocol responses on a blocking socket.
+ */
+class ResponseReader {
+private:
+    int fd;
+    bool binary;
+    string buf;
+    size_t pos;
+
+    /**
+     *  Receives more bytes, discarding the consumed prefix first.
+     */
+    bool fill() {
+        buf.erase(0, pos);
+        pos = 0;
+        char chunk[65536];
+        while (true) {
+            ssize_t n = recv(fd, chunk, sizeof(chunk), 0);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) return false;
+            buf.append(chunk, n);
+            return true;
+        }
     }
-    files.get(filename)->update(content);
-    updateAnalytics();
-    cout << "Content updated in '" << filename << "'.\n";
-}
 
-void FileSystem::snapshot(const string& filename, const string& message) {
-    if (!files.containsKey(filename)) {
-        cout << "Error: File not found.\n";
+public:
+    ResponseReader(int socket_fd, bool binary_protocol) : fd(socket_fd), binary(binary_protocol), pos(0) {}
+
+    /**
+     *  Reads one response. Text responses are read up to their "." line with
+     *  the dot-stuffing undone; binary responses are read by their length.
+     *  Returns false if the connection closed first.
+     */
+    bool read(string& out, bool& is_error) {
+        out.clear();
+        if (binary) {
+            while (buf.size() - pos < 4 || buf.size() - pos - 4 < get_u32(buf.data() + pos)) {
+                if (!fill()) return false;
+            }
+            uint32_t length = get_u32(buf.data() + pos);
+            if (length == 0) return false;
+            is_error = buf[pos + 4] != 0;
+            out.assign(buf, pos + 5, length - 1);
+            pos += 4 + length;
+            return true;
+        }
+        while (true) {
+            size_t newline = buf.find('\n', pos);
+            if (newline == string::npos) {
+                if (!fill()) return false;
+                continue;
+            }
+            size_t start = pos;
+            pos = newline + 1;
+            if (newline - start == 1 && buf[start] == '.') {
+                is_error = out.compare(0, 6, "Error:") == 0;
+                return true;
+            }
+            if (buf[start] == '.') start++;
+            out.append(buf, start, newline + 1 - start);
+        }
+    }
+};
+
+/**
+ *  Runs one client connection to completion, recording per-request latency.
+ */
+void run_load_client(const LoadGenConfig& config, int client_id, LatencyHistogram& latency, long long& errors) {
+    int fd = connect_endpoint(config.endpoint);
+    if (fd < 0) {
+        errors += config.requests;
         return;
     }
-    files.get(filename)->snapshot(message);
-    updateAnalytics(); // A snapshot might update last modification time.
+    ResponseReader reader(fd, config.binary);
+    string filename = "loadgen_" + to_string(client_id);
+    string payload(config.payload > 0 ? config.payload : 1, 'x');
+    string response;
+    bool is_error = false;
+
+    // Frames one request in the configured protocol.
+    auto encode = [&config](const vector<string>& argv) {
+        if (config.binary) return encode_binary_request(argv);
+        string line = argv[0];
+        for (size_t i = 1; i < argv.size(); ++i) line += " " + argv[i];
+        return line + "\n";
+    };
+
+    string hello = config.binary ? string(BINARY_MAGIC, 4) : "";
+    hello += encode({"CREATE", filename});
+    write_all(fd, hello.data(), hello.size());
+    reader.read(response, is_error); // May already exist from an earlier run; that is fine.
+
+    // Cycle through a mix that is always valid: the snapshot follows an edit.
+    vector<chrono::steady_clock::time_point> sent_at(config.requests);
+    int sent = 0;
+    int done = 0;
+    string batch;
+    while (done < config.requests) {
+        batch.clear();
+        while (sent < config.requests && sent - done < config.pipeline) {
+            switch (sent % 4) {
+                case 0: batch += encode({"UPDATE", filename, payload}); break;
+                case 1: batch += encode({"READ", filename}); break;
+                case 2: batch += encode({"SNAPSHOT", filename, "checkpoint " + to_string(sent)}); break;
+                default: batch += encode({"INSERT", filename, payload}); break;
+            }
+            sent_at[sent] = chrono::steady_clock::now();
+            sent++;
+        }
+        if (!batch.empty() && !write_all(fd, batch.data(), batch.size())) break;
+        if (!reader.read(response, is_error)) break;
+        auto elapsed = chrono::steady_clock::now() - sent_at[done];
+        latency.record(chrono::duration_cast<chrono::nanoseconds>(elapsed).count());
+        if (is_error) errors++;
+        done++;
+    }
+    errors += config.requests - done; // Requests lost to a dropped connection.
+    close(fd);
 }
 
-void FileSystem::rollback(const string& filename, int versionId) {
-    if (!files.containsKey(filename)) {
-        cout << "Error: File not found.\n";
-        return;
+struct LoadGenResult {
+    LatencyHistogram latency;
+    long long errors = 0;
+    double seconds = 0;
+
+    double throughput() const { return latency.count() / (seconds > 0 ? seconds : 1); }
+};
+
+/**
+ *  Runs all clients in parallel and collects their measurements.
+ */
+LoadGenResult run_load_generator(const LoadGenConfig& config) {
+    vector<LatencyHistogram> latencies(config.connections);
+    vector<long long> errors(config.connections, 0);
+    vector<thread> clients;
+    auto start = chrono::steady_clock::now();
+    for (int i = 0; i < config.connections; ++i) {
+        clients.emplace_back(run_load_client, cref(config), i, ref(latencies[i]), ref(errors[i]));
     }
-    if (files.get(filename)->rollback(versionId)) {
-        cout << "Rollback successful for '" << filename << "'.\n";
-    } else {
-        cout << "Error: Rollback failed. Invalid version or already at root.\n";
+    for (thread& client : clients) client.join();
+
+    LoadGenResult result;
+    result.seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    for (int i = 0; i < config.connections; ++i) {
+        result.latency.merge(latencies[i]);
+        result.errors += errors[i];
     }
+    return result;
 }
 
-string FileSystem::history(const string& filename) {
-    if (!files.containsKey(filename)) return "Error: File not found.\n";
-    return files.get(filename)->history();
+void print_load_result(const LoadGenConfig& config, const LoadGenResult& result) {
+    auto us = [](double ns) { return format_fixed(ns / 1000.0, 1); };
+    cout << "Protocol: " << (config.binary ? "binary" : "text")
+         << ", Connections: " << config.connections << ", Requests per connection: " << config.requests
+         << ", Pipeline depth: " << config.pipeline << "\n";
+    cout << "Elapsed: " << format_fixed(result.seconds, 3) << " s, Throughput: "
+         << format_fixed(result.throughput(), 0) << " req/s\n";
+    cout << "Latency (microseconds): mean=" << us(result.latency.mean())
+         << " p50=" << us(result.latency.percentile(50))
+         << " p90=" << us(result.latency.percentile(90)) << " p99=" << us(result.latency.percentile(99))
+         << " max=" << us(result.latency.max()) << "\n";
+    cout << "Errors: " << result.errors << "\n";
 }
 
-string FileSystem::recentFiles(int num) {
-    string result = "";
-    int limit = (num == -1) ? files.getValues().size() : num;
-    
-    result += (num == -1) ? "--- Top All Recently Modified Files ---\n"
-                          : "--- Top " + to_string(num) + " Recently Modified Files ---\n";
-
-    // Use a temporary heap to extract max values without destroying the original.
-    MaxHeap<FileMetric> tempHeap = recent_files_heap;
-    int count = 0;
-    while (count < limit && !tempHeap.isEmpty()) {
-        FileMetric metric = tempHeap.extractMax();
-        time_t t = metric.value;
-        char time_buf[100];
-        strftime(time_buf, sizeof(time_buf), "%c", localtime(&t));
-        result += metric.filename + " (Modified: " + time_buf + ")\n";
-        count++;
+//==============================================================================
+// MAIN FUNCTION
+//==============================================================================
+
+ServerBase* active_server = nullptr; // Stopped by SIGINT/SIGTERM.
+
+void handle_stop_signal(int) {
+    if (active_server != nullptr) active_server->stop();
+}
+
+/**
+ *  Creates the server for a --mode name: "pool" (epoll loop plus thread pool),
+ *  "coro" (single-threaded coroutines) or "threads" (thread per connection).
+ */
+ServerBase* make_server(const string& mode, ShardedFileSystem& fs, int threads) {
+    if (mode == "pool") return new CommandServer(fs, threads);
+    if (mode == "coro") return new CoroutineServer(fs);
+    if (mode == "threads") return new ThreadPerConnectionServer(fs);
+    return nullptr;
+}
+
+/**
+ *  Looks up "--name value" among the command line options.
+ */
+int option_value(int argc, char* argv[], const string& name, int default_value) {
+    for (int i = 1; i + 1 < argc; ++i) {
+        if (name == argv[i]) {
+            int value;
+            return parse_int(argv[i + 1], value, name).empty() ? value : default_value;
+        }
     }
-    return result;
+    return default_value;
 }
 
-string FileSystem::biggestTrees(int num) {
-    string result = "";
-    int limit = (num == -1) ? files.getValues().size() : num;
+string option_string(int argc, char* argv[], const string& name, const string& default_value) {
+    for (int i = 1; i + 1 < argc; ++i) {
+        if (name == argv[i]) return argv[i + 1];
+    }
+    return default_value;
+}
 
-    result += (num == -1) ? "--- Top All Files by Version Count ---\n"
-                          : "--- Top " + to_string(num) + " Files by Version Count ---\n";
-    
-    // Use a temporary heap to preserve the original analytics data.
-    MaxHeap<FileMetric> tempHeap = biggest_trees_heap;
-    int count = 0;
-    while (count < limit && !tempHeap.isEmpty()) {
-        FileMetric metric = tempHeap.extractMax();
-        result += metric.filename + " (" + to_string(metric.value) + " versions)\n";
-        count++;
+/**
+ *  Checks whether a flag without a value was given.
+ */
+bool has_option(int argc, char* argv[], const string& name) {
+    for (int i = 1; i < argc; ++i) {
+        if (name == argv[i]) return true;
     }
-    return result;
+    return false;
 }
 
-//==============================================================================
-// MAIN FUNCTION & INPUT PARSING
-//==============================================================================
+LoadGenConfig load_config_from_options(int argc, char* argv[]) {
+    LoadGenConfig config;
+    config.connections = option_value(argc, argv, "--connections", config.connections);
+    config.requests = option_value(argc, argv, "--requests", config.requests);
+    config.pipeline = option_value(argc, argv, "--pipeline", config.pipeline);
+    config.payload = option_value(argc, argv, "--payload", config.payload);
+    config.binary = has_option(argc, argv, "--binary");
+    return config;
+}
 
 /**
- *  A simple, dependency-free parser for command line input.
- *  line The raw input string.
- *  command Output reference for the parsed command.
- *  args Output reference for the vector of arguments.
+ *  Runs the same load against each server design in turn, in-process over a
+ *  Unix domain socket, and prints a comparison table.
  */
-void parse_input(const string& line, string& command, vector<string>& args) {
-    string current_word = "";
-    bool first_word = true;
+int run_server_benchmark(const LoadGenConfig& base_config, int threads, int shards) {
+    const char* modes[] = {"pool", "coro", "threads"};
+    Endpoint endpoint;
+    parse_endpoint("unix:/tmp/anuj-bench-" + to_string(getpid()) + ".sock", endpoint);
+    LoadGenConfig config = base_config;
+    config.endpoint = endpoint;
 
-    for (char c : line) {
-        if (c == ' ') {
-            if (!current_word.empty()) {
-                if (first_word) {
-                    command = current_word;
-                    first_word = false;
-                } else {
-                    args.push_back(current_word);
-                }
-                current_word = "";
-            }
-        } else {
-            current_word += c;
+    cout << "Mode     Throughput(req/s)  p50(us)    p99(us)    Errors\n";
+    for (const char* mode : modes) {
+        ShardedFileSystem anuj(shards);
+        ServerBase* server = make_server(mode, anuj, threads);
+        if (!server->start(endpoint)) {
+            cout << "Error: Could not listen on " << endpoint.path << ": " << strerror(errno) << "\n";
+            delete server;
+            return 1;
         }
+        thread loop([server] { server->run(); });
+        LoadGenResult result = run_load_generator(config);
+        server->stop();
+        loop.join();
+        delete server;
+        unlink(endpoint.path.c_str());
+
+        char row[160];
+        snprintf(row, sizeof(row), "%-8s %-18s %-10s %-10s %lld\n", mode,
+                 format_fixed(result.throughput(), 0).c_str(),
+                 format_fixed(result.latency.percentile(50) / 1000.0, 1).c_str(),
+                 format_fixed(result.latency.percentile(99) / 1000.0, 1).c_str(), result.errors);
+        cout << row << flush;
     }
-    // Add the last word after the loop finishes.
-    if (!current_word.empty()) {
-        if (first_word) {
-            command = current_word;
-        } else {
-            args.push_back(current_word);
+    return 0;
+}
+
+/**
+ *  Compares the ordered name index with sorting the HashMap's values on each
+ *  request, for a full sorted listing, one page of a range and a glob.
+ */
+int run_index_benchmark(int file_count) {
+    HashMap<string, File*> files(256);
+    NameIndex index;
+    unsigned long long seed = 88172645463325252ULL; // xorshift64
+    auto random = [&seed] {
+        seed ^= seed << 13;
+        seed ^= seed >> 7;
+        seed ^= seed << 17;
+        return seed;
+    };
+    auto start = chrono::steady_clock::now();
+    for (int i = 0; i < file_count; ++i) {
+        string name = "dir" + to_string(random() % 100) + "/sub" + to_string(random() % 100) + "/file"
+                      + to_string(i) + (random() % 2 ? ".c" : ".h");
+        files.put(name, new File(name));
+        index.insert(name);
+    }
+    double build_seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    // The baseline: collect and sort every name, as a listing would without the index.
+    auto sorted_names = [&files] {
+        vector<string> names;
+        for (File* file : files.getValues()) names.push_back(file->getName());
+        custom_sort(names);
+        return names;
+    };
+    auto time_per_call = [](int repeats, auto body) {
+        auto begin = chrono::steady_clock::now();
+        volatile size_t sink = 0; // Keeps the work from being optimized away.
+        for (int i = 0; i < repeats; ++i) sink = sink + body(i);
+        return chrono::duration<double>(chrono::steady_clock::now() - begin).count() / repeats * 1e6;
+    };
+    const int SORT_REPEATS = 5, INDEX_REPEATS = 200;
+    const size_t PAGE = 100;
+    auto page_start = [](int i) { return "dir" + to_string(i % 100) + "/sub5"; };
+    string glob = "dir42/sub7/*.c";
+
+    double full_sorted = time_per_call(SORT_REPEATS, [&](int) { return sorted_names().size(); });
+    double full_index = time_per_call(SORT_REPEATS, [&](int) {
+        vector<string> names;
+        names.reserve(index.size());
+        index.scan("", [&names](const string& name) {
+            names.push_back(name);
+            return true;
+        });
+        return names.size();
+    });
+    double page_sorted = time_per_call(SORT_REPEATS, [&](int i) {
+        vector<string> names = sorted_names();
+        size_t low = 0, high = names.size();
+        string from = page_start(i);
+        while (low < high) {
+            size_t mid = (low + high) / 2;
+            if (names[mid] < from) low = mid + 1;
+            else high = mid;
         }
+        return (high + PAGE < names.size() ? high + PAGE : names.size()) - high;
+    });
+    double page_index = time_per_call(INDEX_REPEATS, [&](int i) {
+        size_t taken = 0;
+        index.scan(page_start(i), [&taken](const string&) { return ++taken < PAGE; });
+        return taken;
+    });
+    double glob_sorted = time_per_call(SORT_REPEATS, [&](int) {
+        size_t matched = 0;
+        for (const string& name : sorted_names()) matched += glob_match(glob, name);
+        return matched;
+    });
+    double glob_index = time_per_call(INDEX_REPEATS, [&](int) {
+        size_t matched = 0;
+        string prefix = glob.substr(0, glob.find_first_of("*?["));
+        index.scan(prefix, [&](const string& name) {
+            if (name.compare(0, prefix.size(), prefix) != 0) return false;
+            matched += glob_match(glob, name);
+            return true;
+        });
+        return matched;
+    });
+
+    cout << "Indexed " << file_count << " names in " << format_fixed(build_seconds, 3) << " s.\n";
+    cout << "Operation           Sort getValues(us)  Name index(us)\n";
+    char row[160];
+    const char* labels[] = {"Full listing", "Page of 100", "Glob"};
+    double sorted_times[] = {full_sorted, page_sorted, glob_sorted};
+    double index_times[] = {full_index, page_index, glob_index};
+    for (int i = 0; i < 3; ++i) {
+        snprintf(row, sizeof(row), "%-19s %-19s %s\n", labels[i], format_fixed(sorted_times[i], 1).c_str(),
+                 format_fixed(index_times[i], 1).c_str());
+        cout << row;
     }
+    for (File* file : files.getValues()) delete file;
+    return 0;
+}
+
+void print_usage() {
+    cout << "Usage:\n"
+         << "  anuj [--store <directory>] [--shards N] [--resident-mb N] [--mem-budget-mb N]\n"
+         << "                                         Interactive prompt.\n"
+         << "  anuj --serve <endpoint> [--mode pool|coro|threads] [--threads N] [--store <directory>] [--shards N]\n"
+         << "       [--resident-mb N] [--mem-budget-mb N]\n"
+         << "                                         Serve the command protocol.\n"
+         << "  anuj --loadgen <endpoint> [--connections N] [--requests N] [--pipeline N] [--payload N] [--binary]\n"
+         << "  anuj --bench-servers [--connections N] [--requests N] [--pipeline N] [--binary] [--shards N]\n"
+         << "  anuj --bench-index [--files N]         Ordered name index against sorting.\n"
+         << "Endpoints are tcp:[host:]port or unix:path.\n";
 }
 
 /**
  *  The main entry point and command processing loop for the program.
  */
-int main() {
-    FileSystem anuj;
+int main(int argc, char* argv[]) {
+    string store_dir = option_string(argc, argv, "--store", "");
+    int shards = option_value(argc, argv, "--shards", 1);
+    long long resident_mb = option_value(argc, argv, "--resident-mb", 0);
+    long long budget_mb = option_value(argc, argv, "--mem-budget-mb", 0);
+    if (shards < 1 || resident_mb < 0 || budget_mb < 0) {
+        print_usage();
+        return 1;
+    }
+    string first_option = argc > 1 ? argv[1] : "";
+    if (argc > 1 && first_option != "--store" && first_option != "--shards" && first_option != "--resident-mb"
+        && first_option != "--mem-budget-mb") {
+        string mode = argv[1];
+        int threads = option_value(argc, argv, "--threads", (int)thread::hardware_concurrency());
+        if (mode == "--bench-servers") {
+            return run_server_benchmark(load_config_from_options(argc, argv), threads, shards);
+        }
+        if (mode == "--bench-index") {
+            return run_index_benchmark(option_value(argc, argv, "--files", 200000));
+        }
+
+        Endpoint endpoint;
+        if ((mode != "--serve" && mode != "--loadgen") || argc < 3 || !parse_endpoint(argv[2], endpoint)) {
+            print_usage();
+            return 1;
+        }
+        if (mode == "--loadgen") {
+            LoadGenConfig config = load_config_from_options(argc, argv);
+            config.endpoint = endpoint;
+            if (config.connections < 1 || config.requests < 1 || config.pipeline < 1) {
+                print_usage();
+                return 1;
+            }
+            print_load_result(config, run_load_generator(config));
+            return 0;
+        }
+
+        ShardedFileSystem anuj(shards);
+        anuj.setResidentLimit(resident_mb << 20);
+        anuj.setMemoryBudget(budget_mb << 20);
+        if (!store_dir.empty()) {
+            string opened = anuj.openStore(store_dir);
+            cout << opened << flush;
+            if (opened.compare(0, 6, "Error:") == 0) return 1;
+        }
+        string server_mode = option_string(argc, argv, "--mode", "pool");
+        ServerBase* server = make_server(server_mode, anuj, threads);
+        if (server == nullptr) {
+            print_usage();
+            return 1;
+        }
+        if (!server->start(endpoint)) {
+            cout << "Error: Could not listen on " << argv[2] << ": " << strerror(errno) << "\n";
+            delete server;
+            return 1;
+        }
+        active_server = server;
+        signal(SIGINT, handle_stop_signal);
+        signal(SIGTERM, handle_stop_signal);
+        cout << "Serving on " << argv[2] << " (" << server_mode << " mode";
+        if (server_mode == "pool") cout << ", " << (threads > 0 ? threads : 1) << " worker threads";
+        if (shards > 1) cout << ", " << shards << " shards";
+        cout << ")." << endl;
+        server->run();
+        active_server = nullptr;
+        delete server;
+        if (endpoint.is_unix) unlink(endpoint.path.c_str());
+        cout << "Server stopped." << endl;
+        anuj.setFastExit();
+        return 0;
+    }
+
+    ShardedFileSystem anuj(shards);
+    anuj.setResidentLimit(resident_mb << 20);
+    anuj.setMemoryBudget(budget_mb << 20);
     cout << "--- Time-Travelling File System ---" << endl;
+    if (!store_dir.empty()) {
+        string opened = anuj.openStore(store_dir);
+        cout << opened << flush;
+        if (opened.compare(0, 6, "Error:") == 0) return 1;
+    }
     cout << "Enter 'QUIT' or 'EXIT' to terminate." << endl;
     string line;
-    
+
     // Main command loop.
     while (true) {
         cout << "> ";
@@ -700,62 +9071,12 @@ int main() {
         string command;
         vector<string> args;
         parse_input(line, command, args);
+        if (command.empty()) continue;  // A line of only spaces.
 
-        // --- Command Processing Logic ---
-
-        if (command == "CREATE" && args.size() == 1) {
-            anuj.create(args[0]);
-        } else if (command == "READ" && args.size() == 1) {
-            cout << anuj.read(args[0]) << endl;
-        } 
-        // Handle commands that can take multi-word content.
-        else if ((command == "INSERT" || command == "UPDATE" || command == "SNAPSHOT") && args.size() >= 2) {
-            string filename = args[0];
-            string message = "";
-            // Reconstruct the multi-word content/message from the arguments.
-            for (size_t i = 1; i < args.size(); ++i) {
-                message += args[i];
-                if (i < args.size() - 1) {
-                    message += " ";
-                }
-            }
-            if (command == "INSERT") anuj.insert(filename, message);
-            if (command == "UPDATE") anuj.update(filename, message);
-            if (command == "SNAPSHOT") anuj.snapshot(filename, message);
-        } 
-        // Handle ROLLBACK with an optional version ID.
-        else if (command == "ROLLBACK" && args.size() >= 1 && args.size() <= 2) {
-            if (args.size() == 1) {
-                anuj.rollback(args[0]); // Rollback to parent.
-            } else {
-                try {
-                    int versionId = stoi(args[1]); // Convert argument to integer.
-                    anuj.rollback(args[0], versionId);
-                } catch (const invalid_argument& e) {
-                    cout << "Error: Invalid version ID for ROLLBACK.\n";
-                }
-            }
-        } else if (command == "HISTORY" && args.size() == 1) {
-            cout << anuj.history(args[0]);
-        } 
-        // Handle analytics commands with an optional number.
-        else if (command == "RECENT_FILES" || command == "BIGGEST_TREES") {
-            int num = -1; // Default to showing all files.
-            if (!args.empty()) {
-                try {
-                    num = stoi(args[0]);
-                } catch (const invalid_argument& e) {
-                    cout << "Error: Invalid number. Showing all by default.\n";
-                }
-            }
-            if (command == "RECENT_FILES") cout << anuj.recentFiles(num);
-            if (command == "BIGGEST_TREES") cout << anuj.biggestTrees(num);
-        } else if (command == "EXIT" || command == "QUIT") {
-            cout << "Exiting system." << endl;
-            break;
-        } else {
-            cout << "Error: Unknown command or incorrect arguments.\n";
-        }
+        bool should_exit = false;
+        cout << execute_command(anuj, command, args, should_exit) << flush;
+        if (should_exit) break;
     }
+    anuj.setFastExit();
     return 0;
-}
\ No newline at end of file
+}